@@ -0,0 +1,183 @@
+// Download benchmark.
+// Runs the client's FTP steps against a server (normally the local stand-in, server/ftp_server.c)
+// several times, and reports the latency of every command and the throughput of the transfer.
+//
+// Usage: ./bin/bench [-n runs] [-o output-file] ftp://[<user>:<password>@]<host>[:<port>]/<url-path>
+
+#include "../include/download.h"
+
+#define DEFAULT_RUNS    5
+#define DEFAULT_OUTPUT  "/dev/null"
+
+/* Measured steps of a run, in order */
+enum Step {
+    STEP_CONNECT,
+    STEP_GREETING,
+    STEP_USER,
+    STEP_PASS,
+    STEP_TYPE,
+    STEP_SIZE,
+    STEP_PASSIVE,
+    STEP_DATA_CONNECT,
+    STEP_REST,
+    STEP_RETR,
+    STEP_TRANSFER,
+    STEP_COMPLETE,
+    STEP_QUIT,
+    STEP_COUNT
+};
+
+static const char *stepNames[STEP_COUNT] = {
+    "connect", "greeting (220)", "USER", "PASS", "TYPE", "SIZE", "EPSV / PASV", "data connect",
+    "REST", "RETR (150)", "transfer", "complete (226)", "QUIT"
+};
+
+// Function to send a command and check its reply
+static int command(const int socket, const char *line, int expected) {
+    char answer[MAX_LENGTH];
+
+    write(socket, line, strlen(line));
+    return readResponse(socket, answer) == expected ? 0 : -1;
+}
+
+// Function to run every step once, filling the seconds each one took and the bytes received
+static int run(struct URL *url, const int fd, double *times, long long *bytes) {
+    char answer[MAX_LENGTH], ip[MAX_LENGTH], userCommand[MAX_LENGTH + 8], passCommand[MAX_LENGTH + 8];
+    long long size;
+    int port, code, socketB;
+
+    snprintf(userCommand, sizeof(userCommand), "user %s\n", url->user);
+    snprintf(passCommand, sizeof(passCommand), "pass %s\n", url->password);
+
+    double last = monotonicSeconds(), now;
+#define LAP(step) (now = monotonicSeconds(), times[step] = now - last, last = now)
+
+    int socketA = createSocket(url->host, url->port);
+    if (socketA < 0) return -1;
+    LAP(STEP_CONNECT);
+
+    if (readResponse(socketA, answer) != SV_READY4AUTH) goto fail;
+    LAP(STEP_GREETING);
+    if (command(socketA, userCommand, SV_READY4PASS) != 0) goto fail;
+    LAP(STEP_USER);
+    if (command(socketA, passCommand, SV_LOGINSUCCESS) != 0) goto fail;
+    LAP(STEP_PASS);
+    if (binaryMode(socketA) != SV_COMMAND_OK) goto fail;
+    LAP(STEP_TYPE);
+    if (resourceSize(socketA, url->resource, &size) != SV_FILE_STATUS) goto fail;
+    LAP(STEP_SIZE);
+    if (passiveMode(socketA, ip, &port) != SV_PASSIVE) goto fail;
+    LAP(STEP_PASSIVE);
+
+    socketB = createDataSocket(ip, port);
+    if (socketB < 0) goto fail;
+    LAP(STEP_DATA_CONNECT);
+
+    if (restartAt(socketA, 0) != SV_PENDING) goto failData;
+    LAP(STEP_REST);
+    code = requestResource(socketA, url->resource);
+    if (code != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT) goto failData;
+    LAP(STEP_RETR);
+
+    *bytes = receiveData(socketB, fd, 0, -1);
+    close(socketB);
+    if (*bytes != size) goto fail;
+    LAP(STEP_TRANSFER);
+
+    if (readResponse(socketA, answer) != SV_TRANSFER_COMPLETE) goto fail;
+    LAP(STEP_COMPLETE);
+    if (command(socketA, "quit\n", SV_GOODBYE) != 0) goto fail;
+    LAP(STEP_QUIT);
+
+#undef LAP
+    close(socketA);
+    return 0;
+
+failData:
+    close(socketB);
+fail:
+    close(socketA);
+    return -1;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = DEFAULT_RUNS, option;
+    const char *output = DEFAULT_OUTPUT;
+
+    while ((option = getopt(argc, argv, "n:o:")) != -1) {
+        switch (option) {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                runs = 0;
+                break;
+        }
+    }
+
+    if (runs <= 0 || optind != argc - 1) {
+        printf("Usage: %s [-n runs] [-o output-file] ftp://[<user>:<password>@]<host>[:<port>]/<url-path>\n", argv[0]);
+        exit(1);
+    }
+
+    struct URL url;
+    memset(&url, 0, sizeof(url));
+    if (parse(argv[optind], &url) != 0) {
+        printf("Parse error\n");
+        exit(1);
+    }
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(output);
+        exit(1);
+    }
+
+    double *times = calloc((size_t) runs * STEP_COUNT, sizeof(double));
+    double *rates = calloc(runs, sizeof(double));
+    if (times == NULL || rates == NULL) {
+        printf("Error - Not possible to allocate %d runs\n", runs);
+        exit(1);
+    }
+
+    long long bytes = 0;
+    for (int r = 0; r < runs; r++) {
+        if (run(&url, fd, &times[r * STEP_COUNT], &bytes) != 0) {
+            printf("Run %d failed\n", r + 1);
+            exit(1);
+        }
+        rates[r] = bytes / times[r * STEP_COUNT + STEP_TRANSFER] / 1e6;
+    }
+    close(fd);
+
+    printf("Download benchmark: %s, %lld bytes, %d runs\n\n", argv[optind], bytes, runs);
+    printf("  %-16s %10s %10s %10s %10s\n", "step (ms)", "min", "median", "mean", "max");
+
+    double column[runs];
+    for (int s = 0; s < STEP_COUNT; s++) {
+        double sum = 0;
+        for (int r = 0; r < runs; r++) {
+            column[r] = times[r * STEP_COUNT + s] * 1e3;
+            sum += column[r];
+        }
+        qsort(column, runs, sizeof(double), compareDoubles);
+        printf("  %-16s %10.3f %10.3f %10.3f %10.3f\n", stepNames[s], column[0], column[runs / 2], sum / runs, column[runs - 1]);
+    }
+
+    double sum = 0;
+    for (int r = 0; r < runs; r++) sum += rates[r];
+    qsort(rates, runs, sizeof(double), compareDoubles);
+    printf("\n  %-16s %10.1f %10.1f %10.1f %10.1f\n", "throughput MB/s", rates[0], rates[runs / 2], sum / runs, rates[runs - 1]);
+
+    free(times);
+    free(rates);
+    return 0;
+}
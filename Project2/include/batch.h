@@ -0,0 +1,84 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "download.h"
+
+#define MAX_TRANSFERS       16      // Transfers in flight (one connection per host per transfer)
+#define DEFAULT_TRANSFERS   4
+#define MAX_HOSTS           8       // Hosts with an open session, per transfer worker
+#define LISTING_BUFFER_SIZE 65536   // Initial size of a directory listing
+#define MIRROR_MAX_DEPTH    32      // Directories recursed into below the mirrored one
+
+/* One file to download */
+struct Job {
+    struct URL url;             // Server and resource
+    char path[MAX_LENGTH];      // Local path
+};
+
+/* Files to download, shared by the transfer workers */
+struct Batch {
+    struct Job *jobs;
+    int count;
+    int capacity;
+    int next;                   // Next job to hand out
+    int done;                   // Jobs downloaded
+    int failed;                 // Jobs that failed
+    pthread_mutex_t lock;
+};
+
+/* Authenticated control connection kept open between files */
+struct Session {
+    char host[MAX_LENGTH];
+    int port;
+    char user[MAX_LENGTH];
+    char password[MAX_LENGTH];
+    int socket;
+};
+
+/* 
+* Add a file to the batch
+* @param batch, the batch
+* @param url, server and resource of the file
+* @param path, local path of the file
+* @return 0 if there is no allocation error or -1 otherwise
+*/
+int addJob(struct Batch *batch, const struct URL *url, const char *path);
+
+/* 
+* Add every URL of a list (one per line, '#' starts a comment) to the batch
+* @param batch, the batch
+* @param input, stream with the list
+* @return number of URLs added or -1 on a parse error
+*/
+int readUrlList(struct Batch *batch, FILE *input);
+
+/* 
+* Add every file of a remote directory to the batch, recursively with MLSD (or only its entries with NLST).
+* Names with a '/', "." and ".." are skipped, and at most MIRROR_MAX_DEPTH levels of directories are followed
+* @param socket, authenticated server connection file descriptor
+* @param url, server and remote directory
+* @param remoteDir, remote directory to list
+* @param localDir, local directory mirroring it
+* @param batch, the batch
+* @return 0 if the directory could be listed or -1 otherwise
+*/
+int mirrorDirectory(const int socket, const struct URL *url, const char *remoteDir, const char *localDir, struct Batch *batch);
+
+/* 
+* Download one file on an open session: new PASV data connection, RETR, receive
+* @param socket, authenticated server connection file descriptor
+* @param resource, remote file
+* @param path, local path, parent directories are created
+* @return server response code obtained by the operation
+*/
+int downloadFile(const int socket, const char *resource, const char *path);
+
+/* 
+* Download every file of the batch with nTransfers workers, each one reusing one control connection per host
+* @param batch, the batch
+* @param nTransfers, number of transfers in flight
+* @return 0 if every file was downloaded or -1 otherwise
+*/
+int runBatch(struct Batch *batch, int nTransfers);
+
+#endif // BATCH_H
@@ -1,3 +1,7 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -8,18 +12,33 @@
 #include <string.h>
 #include <regex.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+
+#include "sha256.h"
 
 #define MAX_LENGTH  500
 #define FTP_PORT    21
 
 /* Server responses */
+#define SV_READY4TRANSFER_ALT   125
+#define SV_COMMAND_OK           200
+#define SV_FILE_STATUS          213
 #define SV_READY4AUTH           220
 #define SV_READY4PASS           331
 #define SV_LOGINSUCCESS         230
 #define SV_PASSIVE              227
+#define SV_EXT_PASSIVE          229
 #define SV_READY4TRANSFER       150
 #define SV_TRANSFER_COMPLETE    226
 #define SV_GOODBYE              221
+#define SV_PENDING              350
 
 /* Parser regular expressions */
 #define AT              "@"
@@ -31,11 +50,84 @@
 #define PASS_REGEX      "%*[^/]//%*[^:]:%[^@\n$]"
 #define RESPCODE_REGEX  "%d"
 #define PASSIVE_REGEX   "%*[^(](%d,%d,%d,%d,%d,%d)%*[^\n$)]"
+#define EPSV_REGEX      "%*[^(](%*c%*c%*c%d"
+#define SIZE_REGEX      "%*d %lld"
+#define MDTM_REGEX      "%*d %4d%2d%2d%2d%2d%2d"
+
+/* Data connection */
+#define DATA_BUFFER_SIZE    (256 * 1024)        // Bytes moved per receive / splice call
+#define DATA_SOCKET_RCVBUF  (4 * 1024 * 1024)   // Requested SO_RCVBUF of data connections, if rmem_max allows it
+#define RMEM_MAX_PATH       "/proc/sys/net/core/rmem_max"
+#define SPLICE_UNSUPPORTED  -2
+#define HASH_BUFFERS        4                   // Buffers in flight to the hashing thread
+
+/* Checksum verification */
+#define DIGEST_SUFFIX       ".sha256"           // Sibling resource holding the digest of a resource
+#define DIGEST_FILE_SIZE    4096                // Bytes of the sibling read, a 'sha256sum' line fits
+#define CORRUPT_SUFFIX      ".corrupt"          // Suffix of a kept file whose digest did not match
+
+/* Segmented download */
+#define MAX_SEGMENTS        16
+#define MIN_SEGMENT_SIZE    (1 << 20)   // Smaller files are not worth splitting
+
+/* Resumed download */
+#define RESUME_ATTEMPTS     5       // Connections tried before giving up on an interrupted transfer
+#define RESUME_DELAY        1       // Seconds between attempts
+
+/* Name resolution and connection */
+#define MAX_CACHED_HOSTS        64
+#define MAX_ADDRESSES           8       // Addresses of a host tried when connecting
+#define CONNECT_ATTEMPT_DELAY   250     // Milliseconds before racing the next address (Happy Eyeballs)
+#define CONNECT_TIMEOUT         10000   // Milliseconds for a connection to any address
+
+/* Resolved addresses of a host, in connection order */
+struct HostEntry {
+    char host[MAX_LENGTH];
+    int pending;                                        // A thread is resolving the host
+    int count;                                          // Number of addresses, 0 if the lookup failed
+    struct sockaddr_storage addresses[MAX_ADDRESSES];
+    socklen_t lengths[MAX_ADDRESSES];
+};
 
 /* Default login for case 'ftp://<host>/<url-path>' */
 #define DEFAULT_USER        "anonymous"
 #define DEFAULT_PASSWORD    "password"
 
+#define USAGE   "Usage: ./download [-j N | -c | -p] [--json <file|->] [--sha256 <hex> | --verify] [--keep-corrupt] ftp://[<user>:<password>@]<host>[:<port>]/<url-path>\n" \
+                "       ./download -i <url-list|-> [-k K]\n" \
+                "       ./download -m [-k K] ftp://[<user>:<password>@]<host>[:<port>]/<directory>\n"
+
+/* Live progress, shown on stderr when it is a terminal */
+#define PROGRESS_INTERVAL   0.5     // Seconds between progress lines
+
+/* Where the time of a download went, reported as a JSON summary at exit */
+struct Metrics {
+    const char *mode;       // 'serial', 'segmented', 'continue', 'pipelined', 'batch' or 'mirror'
+    double start;           // Monotonic time the program started at
+    double dns;             // Seconds spent in each phase, 0 if it did not run
+    double connect;
+    double auth;
+    double passive;
+    double transfer;        // Data connection, RETR, data and 226
+    double firstByte;       // Seconds from the start to the first byte of data, -1 if none arrived
+    long long bytes;        // Bytes received
+    long long size;         // Expected bytes, -1 if unknown
+    int status;             // 0 once the download succeeded, -1 before
+    int checksum;           // 1 if the SHA-256 matched, 0 if it did not, -1 if it was not checked
+};
+
+/* Pipelined download: seconds from the start until the end of each step */
+struct Timings {
+    double connect;     // Control connection established
+    double greeting;    // 220 received
+    double user;        // USER answered
+    double setup;       // PASS, TYPE, SIZE and EPSV / PASV answered
+    double request;     // RETR answered, data connection established
+    double firstByte;   // First byte of the resource received
+    double transfer;    // Last byte received and 226 received
+    long long size;     // Resource size, -1 if SIZE failed
+};
+
 /* Parser output */
 struct URL {
     char host[MAX_LENGTH];      // 'ftp.up.pt'
@@ -43,16 +135,30 @@ struct URL {
     char file[MAX_LENGTH];      // 'warrant-canary-0.txt'
     char user[MAX_LENGTH];      // 'username'
     char password[MAX_LENGTH];  // 'password'
-    char ip[MAX_LENGTH];        // 193.137.29.15
+    char ip[MAX_LENGTH];        // 193.137.29.15 or 2001:690:2200:910::15, first resolved address
+    int port;                   // 21 unless given as '<host>:<port>'
+};
+
+/* One byte range of a segmented download */
+struct Segment {
+    struct URL *url;        // Server and resource
+    int socket;             // Control connection, -1 to open a new one
+    int fd;                 // Output file
+    off_t offset;           // First byte of the range
+    off_t length;           // Number of bytes of the range
+    off_t received;         // Bytes written so far
+    int status;             // 0 if the range was fully downloaded, -1 otherwise
 };
 
-/* Machine states that receives the response from the server */
-typedef enum {
-    START,
-    SINGLE,
-    MULTIPLE,
-    END
-} ResponseState;
+/* Buffered reader of a control connection, bytes past the current reply are kept for the next one */
+#define MAX_SOCKETS         1024
+#define READER_SIZE         4096
+
+struct LineReader {
+    char data[READER_SIZE];
+    int start;              // First byte not yet consumed
+    int end;                // End of the bytes read
+};
 
 /* 
 * Parser that transforms user input in url parameters
@@ -63,12 +169,29 @@ typedef enum {
 int parse(char *input, struct URL *url);
 
 /* 
-* Create socket file descriptor based on given server ip and port
-* @param ip, a string containing the server ip
+* Resolve a host name with getaddrinfo, each host is looked up once per process
+* @param host, a host name or a numeric IPv4 / IPv6 address
+* @param ip, string that will be filled with the first address
+* @return 0 if the host has an address or -1 otherwise
+*/
+int resolveHost(const char *host, char *ip);
+
+/* 
+* Create socket file descriptor connected to the given server and port, racing the connection
+* to every address of the server (IPv6 and IPv4 interleaved, one more every CONNECT_ATTEMPT_DELAY)
+* @param host, a string containing the server host name or ip
+* @param port, an integer value containing the server port
+* @return socket file descriptor if there is no error or -1 otherwise
+*/
+int createSocket(char *host, int port);
+
+/* 
+* Create data connection socket, with a receive buffer sized for bulk transfers
+* @param host, a string containing the server host name or ip
 * @param port, an integer value containing the server port
 * @return socket file descriptor if there is no error or -1 otherwise
 */
-int createSocket(char *ip, int port);
+int createDataSocket(char *host, int port);
 
 /* 
 * Authenticate connection
@@ -80,19 +203,29 @@ int createSocket(char *ip, int port);
 int authConn(const int socket, const char *user, const char *pass);
 
 /* 
-* Read server response
+* Connect to the server, authenticate and switch to binary mode
+* @param host, a string containing the server host name or ip
+* @param port, an integer value containing the server port
+* @param user, a string containing the username
+* @param pass, a string containing the password
+* @return authenticated server connection file descriptor or -1 otherwise
+*/
+int openSession(char *host, int port, const char *user, const char *pass);
+
+/* 
+* Read server response, single line ('NNN text') or multi-line ('NNN-text' ... 'NNN text')
 * @param socket, server connection file descriptor
-* @param buffer, string that will be filled with server response
-* @return server response code obtained by the operation
+* @param buffer, string that will be filled with the last line of the server response
+* @return server response code obtained by the operation, or -1 if the connection was closed or failed
 */
 int readResponse(const int socket, char *buffer);
 
 /* 
-* Enter in passive mode
+* Enter in passive mode, with EPSV (IPv6 and IPv4) and PASV as fallback for IPv4 servers without it
 * @param socket, server connection file descriptor
 * @param ip, string that will be filled with data connection ip
 * @param port, string that will be filled with data connection port
-* @return server response code obtained by the operation
+* @return SV_PASSIVE if the data connection details are known or -1 otherwise
 */
 int passiveMode(const int socket, char* ip, int *port);
 
@@ -113,10 +246,164 @@ int requestResource(const int socket, char *resource);
 */
 int getResource(const int socketA, const int socketB, char *filename);
 
+/* 
+* Get resource from server, writing it in the file from the given offset on (the rest of the file is dropped)
+* @param socketA, server connection file descriptor
+* @param socketB, server connection file descriptor
+* @param filename, string that contains the desired file name
+* @param offset, size of the part of the file already downloaded
+* @param hash, if not NULL, started and filled with the whole file while it is received (the part
+* already downloaded is read back from the file)
+* @return server response code obtained by the operation, or -1 if the file can not be opened or written
+*/
+int getResourceFrom(const int socketA, const int socketB, char *filename, long long offset, struct Sha256 *hash);
+
+/* 
+* Switch the transfer type to binary (image)
+* @param socket, server connection file descriptor
+* @return server response code obtained by the operation
+*/
+int binaryMode(const int socket);
+
+/* 
+* Get the size of a resource
+* @param socket, server connection file descriptor
+* @param resource, string that contains the desired resource
+* @param size, filled with the resource size in bytes
+* @return server response code obtained by the operation
+*/
+int resourceSize(const int socket, char *resource, long long *size);
+
+/* 
+* Get the modification time of a resource
+* @param socket, server connection file descriptor
+* @param resource, string that contains the desired resource
+* @param mtime, filled with the modification time of the resource (UTC)
+* @return server response code obtained by the operation
+*/
+int resourceTime(const int socket, char *resource, time_t *mtime);
+
+/* 
+* Set the offset where the next transfer starts
+* @param socket, server connection file descriptor
+* @param offset, byte offset in the resource
+* @return server response code obtained by the operation
+*/
+int restartAt(const int socket, long long offset);
+
+/* 
+* Download one byte range into the output file, on its own control and data connections
+* @param arg, the struct Segment to download
+* @return NULL, the result is left in the segment status
+*/
+void *getSegment(void *arg);
+
+/* 
+* Download a resource in parallel byte ranges using REST, writing each one in place with pwrite
+* @param socketA, authenticated server connection file descriptor, used by the first segment
+* @param url, server and resource
+* @param size, size of the resource in bytes
+* @param nSegments, number of parallel connections
+* @return 0 if every range was downloaded or -1 otherwise
+*/
+int getResourceParallel(const int socketA, struct URL *url, long long size, int nSegments);
+
+/* 
+* Download a resource continuing a partial local file, reconnecting if the transfer is interrupted.
+* The partial file is only kept if it is smaller than the resource and not older than its SIZE / MDTM
+* @param url, server and resource
+* @param timings, filled with the time each step of the last attempt finished (greeting and firstByte are not timed)
+* @param hash, if not NULL, filled with the whole file
+* @return 0 if the whole resource was downloaded or -1 otherwise
+*/
+int continueResource(struct URL *url, struct Timings *timings, struct Sha256 *hash);
+
+/* 
+* Download a resource saving round trips: PASS, TYPE I, SIZE and EPSV / PASV are sent in one write and
+* the data connection is established while RETR is on its way
+* @param url, server and resource
+* @param timings, filled with the time each step finished
+* @param hash, if not NULL, filled with the whole file while it is received
+* @return 0 if the whole resource was downloaded or -1 otherwise
+*/
+int getResourcePipelined(struct URL *url, struct Timings *timings, struct Sha256 *hash);
+
+/* 
+* Get the expected digest of a resource from its sibling '<resource>.sha256' ('sha256sum' format)
+* @param socket, authenticated server connection file descriptor
+* @param resource, string that contains the resource the digest is for
+* @param digest, filled with the SHA256_SIZE bytes of the digest
+* @return 0 if the digest was read or -1 otherwise
+*/
+int fetchDigest(const int socket, const char *resource, unsigned char *digest);
+
+/* 
+* Hash the first bytes of a file
+* @param fd, file descriptor open for reading
+* @param length, number of bytes to hash
+* @param hash, started hash the bytes are added to
+* @return 0 if the file had that many bytes or -1 otherwise
+*/
+int hashFile(const int fd, long long length, struct Sha256 *hash);
+
+/* 
+* Get the time of a monotonic clock
+* @return seconds since an arbitrary point, not affected by changes of the system time
+*/
+double monotonicSeconds();
+
+/* 
+* Start counting the bytes received by receiveData (in every thread), with a live progress line
+* (bytes, instantaneous and average throughput, ETA) on stderr when it is a terminal
+* @param total, expected bytes, or -1 to add up the sizes announced in the RETR replies ('150 ... (N bytes)')
+*/
+void progressStart(long long total);
+
+/* 
+* Stop the progress line and get what was counted
+* @param bytes, filled with the bytes received since progressStart
+* @param total, filled with the expected bytes, -1 if unknown
+* @return monotonic time of the first byte received, or -1 if none was
+*/
+double progressStop(long long *bytes, long long *total);
+
+/* 
+* Write the metrics of a download as a single line JSON object
+* @param file, output stream
+* @param url, server and resource
+* @param metrics, timings collected by main
+*/
+void writeSummary(FILE *file, const struct URL *url, const struct Metrics *metrics);
+
+/* 
+* Move data from a data connection into a file, with splice() through a pipe when the kernel
+* supports it and recv() into a large aligned buffer otherwise
+* @param socket, data connection file descriptor
+* @param fd, output file descriptor
+* @param offset, file offset where the data is written
+* @param length, number of bytes to receive, or -1 to receive until the server closes the connection
+* @return number of bytes received or -1 on error
+*/
+long long receiveData(const int socket, const int fd, off_t offset, long long length);
+
+/* 
+* Like receiveData, adding every byte to a hash as it arrives. The data goes through user space (recv),
+* and with more than one CPU the hashing runs on a helper thread, HASH_BUFFERS chunks behind the socket
+* @param socket, data connection file descriptor
+* @param fd, output file descriptor
+* @param offset, file offset where the data is written
+* @param length, number of bytes to receive, or -1 to receive until the server closes the connection
+* @param hash, started hash the data is added to, or NULL to only receive
+* @return number of bytes received or -1 on error
+*/
+long long receiveDataHashed(const int socket, const int fd, off_t offset, long long length, struct Sha256 *hash);
+
 /* 
 * Closes the server connection and the socket itself
 * @param socketA, server connection file descriptor
 * @param socketB, server connection file descriptor
 * @return 0 if there is no close error or -1 otherwise
 */
-int closeConnection(const int socketA, const int socketB);
\ No newline at end of file
+int closeConnection(const int socketA, const int socketB);
+
+#endif // DOWNLOAD_H
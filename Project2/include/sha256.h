@@ -0,0 +1,54 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE         32      // Bytes of a digest
+#define SHA256_HEX_SIZE     65      // Characters of a digest in hexadecimal, with the terminator
+
+/* Incremental SHA-256 (FIPS 180-4) */
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;                // Bytes hashed so far
+    unsigned char block[64];        // Bytes waiting for a full block
+    size_t used;
+};
+
+/*
+* Start a new hash
+* @param hash, the hash state
+*/
+void sha256Init(struct Sha256 *hash);
+
+/*
+* Add bytes to the hash
+* @param hash, the hash state
+* @param data, the bytes
+* @param size, number of bytes
+*/
+void sha256Update(struct Sha256 *hash, const void *data, size_t size);
+
+/*
+* Finish the hash
+* @param hash, the hash state, it must be initialized again to be reused
+* @param digest, filled with the SHA256_SIZE bytes of the digest
+*/
+void sha256Final(struct Sha256 *hash, unsigned char *digest);
+
+/*
+* Write a digest in lowercase hexadecimal
+* @param digest, the SHA256_SIZE bytes of the digest
+* @param hex, filled with SHA256_HEX_SIZE characters
+*/
+void sha256ToHex(const unsigned char *digest, char *hex);
+
+/*
+* Read a digest written in hexadecimal, as the first word of a 'sha256sum' line
+* @param hex, the text
+* @param digest, filled with the SHA256_SIZE bytes of the digest
+* @return 0 if the text starts with 64 hexadecimal digits or -1 otherwise
+*/
+int sha256FromHex(const char *hex, unsigned char *digest);
+
+#endif // SHA256_H
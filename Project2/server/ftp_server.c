@@ -0,0 +1,355 @@
+// Local FTP stand-in server.
+// Speaks just enough FTP (USER, PASS, TYPE, SIZE, MDTM, PASV, EPSV, REST, RETR, NOOP, QUIT) for the
+// download client to be run and measured offline. Files are generated: the size of a resource is
+// given by its name, e.g. '/100M', '/pub/4K.bin' or '/1G.iso' (K, M and G are powers of 1024), and
+// byte i of every file is i % 251, so REST offsets can be checked.
+//
+// With -l every reply leaves the server that long after its command arrived, like over a link with
+// that round trip time: pipelined commands are answered together, serial ones pay it each time.
+//
+// Usage: ./bin/ftpserver [-a address] [-p port] [-r bytes/s] [-l latency-ms]
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ADDRESS "127.0.0.1"
+#define DEFAULT_PORT    2121
+#define MAX_LENGTH      500
+#define SEND_CHUNK      (256 * 1024)    // Bytes per send() on the data connection
+#define PATTERN_PERIOD  251             // Period of the generated data (a prime, so it does not align with chunks)
+#define ACCEPT_TIMEOUT  10000           // Milliseconds to wait for the data connection
+#define INPUT_SIZE      4096            // Control connection read buffer
+
+/* Server options, shared by every session */
+struct Options {
+    long long rate;     // Bytes per second of each data connection, 0 for unlimited
+    int latency;        // Milliseconds between a command arriving and its reply
+};
+
+/* One control connection */
+struct Session {
+    int control;            // Control connection
+    int listener;           // Passive mode listener, -1 if none
+    long long restart;      // Offset of the next RETR
+    double received;        // When the bytes of the current command arrived
+    char input[INPUT_SIZE]; // Commands read and not yet handled
+    int start, end;
+};
+
+static struct Options options;
+static unsigned char pattern[SEND_CHUNK + PATTERN_PERIOD];
+static time_t startTime;
+
+// Function to get the seconds of a monotonic clock
+static double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to send a reply on the control connection, once the configured latency has passed
+static int reply(struct Session *session, const char *format, ...) {
+    char line[MAX_LENGTH];
+    va_list args;
+
+    if (options.latency > 0) {
+        double wait = session->received + options.latency / 1e3 - monotonicSeconds();
+        if (wait > 0) usleep((useconds_t) (wait * 1e6));
+    }
+
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 2, format, args);
+    va_end(args);
+    if (length > (int) sizeof(line) - 3) length = sizeof(line) - 3;
+
+    line[length++] = '\r';
+    line[length++] = '\n';
+    return send(session->control, line, length, MSG_NOSIGNAL) == length ? 0 : -1;
+}
+
+// Function to get the size of a generated file from its name ('<digits>[K|M|G][.<extension>]')
+static long long resourceSize(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    char *end;
+    long long size = strtoll(name, &end, 10);
+    if (end == name || size < 0) return -1;
+
+    switch (*end) {
+        case 'K': size <<= 10; end++; break;
+        case 'M': size <<= 20; end++; break;
+        case 'G': size <<= 30; end++; break;
+        default: break;
+    }
+
+    return (*end == '\0' || *end == '.') ? size : -1;
+}
+
+// Function to open the passive mode listener, on the address the client reached us at
+static int openListener(struct Session *session, struct sockaddr_storage *address) {
+    socklen_t length = sizeof(*address);
+    if (getsockname(session->control, (struct sockaddr *) address, &length) < 0) return -1;
+
+    if (address->ss_family == AF_INET) ((struct sockaddr_in *) address)->sin_port = 0;
+    else ((struct sockaddr_in6 *) address)->sin6_port = 0;
+
+    if (session->listener >= 0) close(session->listener);
+    session->listener = socket(address->ss_family, SOCK_STREAM, 0);
+    if (session->listener < 0) return -1;
+
+    if (bind(session->listener, (struct sockaddr *) address, length) < 0 ||
+        listen(session->listener, 1) < 0 ||
+        getsockname(session->listener, (struct sockaddr *) address, &length) < 0) {
+        close(session->listener);
+        session->listener = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to read the next command line, without the line terminator. Returns -1 on EOF or error
+static int readCommand(struct Session *session, char *line) {
+    while (1) {
+        char *begin = session->input + session->start;
+        char *newline = memchr(begin, '\n', session->end - session->start);
+
+        if (newline != NULL) {
+            int length = newline - begin < MAX_LENGTH - 1 ? newline - begin : MAX_LENGTH - 1;
+            memcpy(line, begin, length);
+            line[length] = '\0';
+            line[strcspn(line, "\r")] = '\0';
+            session->start += newline - begin + 1;
+            return 0;
+        }
+
+        // Keep the partial line and read more, a line that does not fit is dropped
+        memmove(session->input, begin, session->end - session->start);
+        session->end -= session->start;
+        session->start = 0;
+        if (session->end == INPUT_SIZE) session->end = 0;
+
+        ssize_t bytes = read(session->control, session->input + session->end, INPUT_SIZE - session->end);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+
+        session->end += bytes;
+        session->received = monotonicSeconds();
+    }
+}
+
+// Function to send bytes [offset, size) of a generated file, at most at the configured rate
+static int sendFile(const int data, long long offset, long long size) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long sent = 0;
+
+    while (offset < size) {
+        long long chunk = size - offset < SEND_CHUNK ? size - offset : SEND_CHUNK;
+        ssize_t bytes = send(data, pattern + offset % PATTERN_PERIOD, chunk, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += bytes;
+        sent += bytes;
+
+        // Sleep until the bytes sent so far are due
+        if (options.rate > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+            double due = (double) sent / options.rate;
+            if (due > elapsed) usleep((useconds_t) ((due - elapsed) * 1e6));
+        }
+    }
+
+    return 0;
+}
+
+// Function to answer RETR: accept the data connection and send the file
+static int retrieve(struct Session *session, const char *path) {
+    long long size = resourceSize(path);
+    long long offset = session->restart;
+    session->restart = 0;
+
+    if (size < 0) return reply(session, "550 Failed to open file.");
+    if (session->listener < 0) return reply(session, "425 Use PASV or EPSV first.");
+    if (offset > size) offset = size;
+
+    if (reply(session, "150 Opening BINARY mode data connection for %s (%lld bytes).", path, size - offset) < 0) return -1;
+
+    struct pollfd pending = {.fd = session->listener, .events = POLLIN};
+    int data = poll(&pending, 1, ACCEPT_TIMEOUT) == 1 ? accept(session->listener, NULL, NULL) : -1;
+    close(session->listener);
+    session->listener = -1;
+
+    if (data < 0) return reply(session, "425 Can't open data connection.");
+
+    int result = sendFile(data, offset, size);
+    close(data);
+    session->received = monotonicSeconds();
+
+    return result == 0 ? reply(session, "226 Transfer complete.") : reply(session, "426 Connection closed; transfer aborted.");
+}
+
+// Function to run one control connection
+static void *serveSession(void *arg) {
+    struct Session *session = calloc(1, sizeof(struct Session));
+    struct sockaddr_storage address;
+    char line[MAX_LENGTH];
+
+    if (session == NULL) {
+        close((int) (long) arg);
+        return NULL;
+    }
+    session->control = (int) (long) arg;
+    session->listener = -1;
+    session->received = monotonicSeconds();
+
+    int result = reply(session, "220 Local FTP stand-in ready.");
+
+    while (result == 0 && readCommand(session, line) == 0) {
+
+        char *argument = strchr(line, ' ');
+        if (argument != NULL) *argument++ = '\0';
+        else argument = "";
+
+        if (strcasecmp(line, "USER") == 0) result = reply(session, "331 Please specify the password.");
+        else if (strcasecmp(line, "PASS") == 0) result = reply(session, "230 Login successful.");
+        else if (strcasecmp(line, "TYPE") == 0) result = reply(session, "200 Switching to Binary mode.");
+        else if (strcasecmp(line, "NOOP") == 0) result = reply(session, "200 NOOP ok.");
+        else if (strcasecmp(line, "SIZE") == 0) {
+            long long size = resourceSize(argument);
+            result = size < 0 ? reply(session, "550 Could not get file size.") : reply(session, "213 %lld", size);
+        }
+        else if (strcasecmp(line, "MDTM") == 0) {
+            // Every generated file is as old as the server
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", gmtime(&startTime));
+            result = resourceSize(argument) < 0 ? reply(session, "550 Could not get file modification time.") : reply(session, "213 %s", stamp);
+        }
+        else if (strcasecmp(line, "PASV") == 0) {
+            if (openListener(session, &address) < 0 || address.ss_family != AF_INET) {
+                result = reply(session, "500 PASV is only available over IPv4.");
+                continue;
+            }
+            struct sockaddr_in *ipv4 = (struct sockaddr_in *) &address;
+            unsigned char *ip = (unsigned char *) &ipv4->sin_addr.s_addr;
+            int port = ntohs(ipv4->sin_port);
+            result = reply(session, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).", ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xFF);
+        }
+        else if (strcasecmp(line, "EPSV") == 0) {
+            if (openListener(session, &address) < 0) {
+                result = reply(session, "425 Can't open passive connection.");
+                continue;
+            }
+            int port = address.ss_family == AF_INET ? ntohs(((struct sockaddr_in *) &address)->sin_port)
+                                                    : ntohs(((struct sockaddr_in6 *) &address)->sin6_port);
+            result = reply(session, "229 Entering Extended Passive Mode (|||%d|)", port);
+        }
+        else if (strcasecmp(line, "REST") == 0) {
+            session->restart = atoll(argument);
+            result = reply(session, "350 Restart position accepted (%lld).", session->restart);
+        }
+        else if (strcasecmp(line, "RETR") == 0) result = retrieve(session, argument);
+        else if (strcasecmp(line, "QUIT") == 0) {
+            reply(session, "221 Goodbye.");
+            break;
+        }
+        else result = reply(session, "502 Command not implemented.");
+    }
+
+    if (session->listener >= 0) close(session->listener);
+    close(session->control);
+    free(session);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = DEFAULT_ADDRESS;
+    int port = DEFAULT_PORT, option;
+
+    while ((option = getopt(argc, argv, "a:p:r:l:")) != -1) {
+        switch (option) {
+            case 'a': address = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'r': options.rate = atoll(optarg); break;
+            case 'l': options.latency = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-a address] [-p port] [-r bytes/s] [-l latency-ms]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    for (int i = 0; i < (int) sizeof(pattern); i++) pattern[i] = i % PATTERN_PERIOD;
+    startTime = time(NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Listen on the numeric address given, IPv4 or IPv6
+    struct addrinfo hints, *local;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    snprintf(service, sizeof(service), "%d", port);
+
+    int error = getaddrinfo(address, service, &hints, &local);
+    if (error != 0) {
+        printf("Invalid address '%s': %s\n", address, gai_strerror(error));
+        exit(1);
+    }
+
+    int listener = socket(local->ai_family, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (listener < 0 || bind(listener, local->ai_addr, local->ai_addrlen) < 0 || listen(listener, 64) < 0) {
+        perror("bind()");
+        exit(1);
+    }
+    freeaddrinfo(local);
+
+    printf("Serving generated files on %s port %d (rate %lld B/s, latency %d ms)\n",
+           address, port, options.rate, options.latency);
+    fflush(stdout);
+
+    while (1) {
+        int control = accept(listener, NULL, NULL);
+        if (control < 0) {
+            if (errno == EINTR) continue;
+            perror("accept()");
+            break;
+        }
+
+        // Replies are small and sent back to back (150 then 226), Nagle would hold the second one
+        int noDelay = 1;
+        setsockopt(control, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveSession, (void *) (long) control) != 0) {
+            close(control);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    return 0;
+}
@@ -0,0 +1,349 @@
+#include "../include/batch.h"
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+// Function to add a file to the batch
+int addJob(struct Batch *batch, const struct URL *url, const char *path) {
+    pthread_mutex_lock(&batch->lock);
+
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? 2 * batch->capacity : 64;
+        struct Job *jobs = realloc(batch->jobs, capacity * sizeof(struct Job));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&batch->lock);
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->capacity = capacity;
+    }
+
+    struct Job *job = &batch->jobs[batch->count++];
+    job->url = *url;
+    snprintf(job->path, MAX_LENGTH, "%s", path);
+
+    pthread_mutex_unlock(&batch->lock);
+    return 0;
+}
+
+// Function to read a list of URLs
+int readUrlList(struct Batch *batch, FILE *input) {
+    char *line = NULL;
+    size_t size = 0;
+    int added = 0, lineNumber = 0;
+
+    while (getline(&line, &size, input) != -1) {
+        lineNumber++;
+
+        // Trim whitespace, skip empty lines and comments
+        char *begin = line;
+        while (*begin == ' ' || *begin == '\t') begin++;
+        char *end = begin + strlen(begin);
+        while (end > begin && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+        *end = '\0';
+        if (*begin == '\0' || *begin == '#') continue;
+
+        struct URL url;
+        memset(&url, 0, sizeof(url));
+        if (parse(begin, &url) != 0) {
+            // The line is not printed, it may hold a password
+            printf("Parse error in line %d of the URL list\n", lineNumber);
+            free(line);
+            return -1;
+        }
+
+        if (addJob(batch, &url, url.file) != 0) {
+            free(line);
+            return -1;
+        }
+        added++;
+    }
+
+    free(line);
+    return added;
+}
+
+// Function to create the parent directories of a local path
+static int makeParents(const char *path) {
+    char dir[MAX_LENGTH];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            perror(dir);
+            return -1;
+        }
+        *slash = '/';
+    }
+
+    return 0;
+}
+
+// Function to read a whole listing from a data connection
+static char *readListing(const int socket) {
+    size_t capacity = LISTING_BUFFER_SIZE, length = 0;
+    char *listing = malloc(capacity + 1);
+    if (listing == NULL) return NULL;
+
+    ssize_t bytes;
+    while ((bytes = read(socket, listing + length, capacity - length)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            free(listing);
+            return NULL;
+        }
+        length += bytes;
+
+        if (length == capacity) {
+            char *bigger = realloc(listing, 2 * capacity + 1);
+            if (bigger == NULL) {
+                free(listing);
+                return NULL;
+            }
+            listing = bigger;
+            capacity *= 2;
+        }
+    }
+
+    listing[length] = '\0';
+    return listing;
+}
+
+// Function to list a directory with the given command ("mlsd" or "nlst")
+static char *listDirectory(const int socket, const char *command, const char *remoteDir, int *code) {
+    char ip[MAX_LENGTH], answer[MAX_LENGTH];
+    int port;
+
+    if (passiveMode(socket, ip, &port) != SV_PASSIVE) {
+        *code = -1;
+        return NULL;
+    }
+    int socketB = createSocket(ip, port);
+    if (socketB < 0) {
+        *code = -1;
+        return NULL;
+    }
+
+    char listCommand[6 + strlen(remoteDir) + 2];
+    sprintf(listCommand, "%s %s\n", command, remoteDir);
+    write(socket, listCommand, strlen(listCommand));
+
+    *code = readResponse(socket, answer);
+    if (*code != SV_READY4TRANSFER && *code != SV_READY4TRANSFER_ALT) {
+        close(socketB);
+        return NULL;
+    }
+
+    char *listing = readListing(socketB);
+    close(socketB);
+    *code = readResponse(socket, answer);
+
+    if (*code != SV_TRANSFER_COMPLETE) {
+        free(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+// Function to add every file of a remote directory to the batch, depth directories below the mirrored one
+static int mirrorLevel(const int socket, const struct URL *url, const char *remoteDir, const char *localDir, struct Batch *batch, int depth) {
+    int code, machineListing = 1;
+
+    // MLSD tells files from directories, NLST (no recursion) is the fallback
+    char *listing = listDirectory(socket, "mlsd", remoteDir, &code);
+    if (listing == NULL && code >= 500) {
+        machineListing = 0;
+        listing = listDirectory(socket, "nlst", remoteDir, &code);
+    }
+    if (listing == NULL) {
+        printf("Not possible to list '%s' (%d)\n", remoteDir, code);
+        return -1;
+    }
+
+    int result = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(listing, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        const char *name = line;
+        int isDirectory = 0;
+
+        if (machineListing) {
+            // 'fact=value;fact=value; name'
+            char *space = strchr(line, ' ');
+            if (space == NULL) continue;
+            *space = '\0';
+            name = space + 1;
+
+            for (char *fact = line; *fact; fact++) *fact = tolower((unsigned char) *fact);
+            if (strstr(line, "type=cdir") || strstr(line, "type=pdir")) continue;
+            if (strstr(line, "type=dir")) isDirectory = 1;
+            else if (!strstr(line, "type=file")) continue;
+        }
+        else {
+            // Some servers prefix the directory
+            const char *slash = strrchr(name, '/');
+            if (slash != NULL) name = slash + 1;
+        }
+        // The name comes from the server: it must not leave the local directory
+        if (*name == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            printf("Skipping unsafe name '%s' in '%s'\n", name, remoteDir);
+            continue;
+        }
+
+        char remotePath[MAX_LENGTH], localPath[MAX_LENGTH];
+        snprintf(remotePath, sizeof(remotePath), "%s/%s", remoteDir, name);
+        snprintf(localPath, sizeof(localPath), "%s/%s", localDir, name);
+
+        if (isDirectory) {
+            if (depth == MIRROR_MAX_DEPTH) {
+                printf("Not mirroring '%s', deeper than %d directories\n", remotePath, MIRROR_MAX_DEPTH);
+                result = -1;
+            }
+            else if (mirrorLevel(socket, url, remotePath, localPath, batch, depth + 1) != 0) result = -1;
+        }
+        else {
+            struct URL file = *url;
+            snprintf(file.resource, MAX_LENGTH, "%s", remotePath);
+            snprintf(file.file, MAX_LENGTH, "%s", name);
+            if (addJob(batch, &file, localPath) != 0) result = -1;
+        }
+    }
+
+    free(listing);
+    return result;
+}
+
+// Function to add every file of a remote directory to the batch
+int mirrorDirectory(const int socket, const struct URL *url, const char *remoteDir, const char *localDir, struct Batch *batch) {
+    return mirrorLevel(socket, url, remoteDir, localDir, batch, 0);
+}
+
+// Function to download one file on an open session
+int downloadFile(const int socket, const char *resource, const char *path) {
+    char ip[MAX_LENGTH];
+    int port;
+
+    if (passiveMode(socket, ip, &port) != SV_PASSIVE) return -1;
+    int socketB = createDataSocket(ip, port);
+    if (socketB < 0) return -1;
+
+    int code = requestResource(socket, (char *) resource);
+    if (code != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT) {
+        close(socketB);
+        return code;
+    }
+
+    if (makeParents(path) != 0) {
+        close(socketB);
+        return -1;
+    }
+
+    code = getResource(socket, socketB, (char *) path);
+    close(socketB);
+    return code;
+}
+
+// Function to get the session of a worker for a server, logging in the first time
+static int sessionFor(struct Session *sessions, int *nSessions, const struct URL *url) {
+    for (int i = 0; i < *nSessions; i++) {
+        if (strcmp(sessions[i].host, url->host) == 0 && sessions[i].port == url->port && strcmp(sessions[i].user, url->user) == 0 &&
+            strcmp(sessions[i].password, url->password) == 0) {
+            if (sessions[i].socket >= 0) return sessions[i].socket;
+
+            sessions[i].socket = openSession((char *) url->host, url->port, url->user, url->password);
+            return sessions[i].socket;
+        }
+    }
+
+    // Too many hosts, the oldest session is closed
+    if (*nSessions == MAX_HOSTS) {
+        if (sessions[0].socket >= 0) {
+            write(sessions[0].socket, "quit\n", 5);
+            close(sessions[0].socket);
+        }
+        memmove(&sessions[0], &sessions[1], (MAX_HOSTS - 1) * sizeof(struct Session));
+        (*nSessions)--;
+    }
+
+    struct Session *session = &sessions[(*nSessions)++];
+    snprintf(session->host, MAX_LENGTH, "%s", url->host);
+    session->port = url->port;
+    snprintf(session->user, MAX_LENGTH, "%s", url->user);
+    snprintf(session->password, MAX_LENGTH, "%s", url->password);
+    session->socket = openSession((char *) url->host, url->port, url->user, url->password);
+
+    return session->socket;
+}
+
+// Function run by each transfer worker
+static void *batchWorker(void *arg) {
+    struct Batch *batch = (struct Batch *) arg;
+    struct Session sessions[MAX_HOSTS];
+    int nSessions = 0;
+
+    while (1) {
+        // Take the next job
+        pthread_mutex_lock(&batch->lock);
+        struct Job *job = batch->next < batch->count ? &batch->jobs[batch->next++] : NULL;
+        pthread_mutex_unlock(&batch->lock);
+        if (job == NULL) break;
+
+        int code = -1;
+        int socket = sessionFor(sessions, &nSessions, &job->url);
+        if (socket >= 0) code = downloadFile(socket, job->url.resource, job->path);
+
+        pthread_mutex_lock(&batch->lock);
+        if (code == SV_TRANSFER_COMPLETE) {
+            batch->done++;
+            printf("[%d/%d] %s\n", batch->done + batch->failed, batch->count, job->path);
+        }
+        else {
+            batch->failed++;
+            printf("[%d/%d] %s failed (%d)\n", batch->done + batch->failed, batch->count, job->path, code);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        // A connection that answered out of protocol can not be trusted for the next file
+        if (socket >= 0 && code < 0) {
+            for (int i = 0; i < nSessions; i++) {
+                if (sessions[i].socket == socket) sessions[i].socket = -1;
+            }
+            close(socket);
+        }
+    }
+
+    // Log out of every server
+    for (int i = 0; i < nSessions; i++) {
+        if (sessions[i].socket >= 0) {
+            write(sessions[i].socket, "quit\n", 5);
+            close(sessions[i].socket);
+        }
+    }
+
+    return NULL;
+}
+
+// Function to download every file of the batch
+int runBatch(struct Batch *batch, int nTransfers) {
+    pthread_t threads[MAX_TRANSFERS];
+
+    if (nTransfers > batch->count) nTransfers = batch->count;
+
+    for (int i = 0; i < nTransfers; i++) {
+        if (pthread_create(&threads[i], NULL, batchWorker, batch) != 0) {
+            perror("pthread_create()");
+            nTransfers = i;
+            break;
+        }
+    }
+
+    // With no worker at all, nothing can be downloaded
+    if (nTransfers == 0 && batch->count > 0) return -1;
+
+    for (int i = 0; i < nTransfers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%d of %d files downloaded\n", batch->done, batch->count);
+    return batch->failed ? -1 : 0;
+}
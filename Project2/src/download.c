@@ -26,52 +26,309 @@ int parse(char *input, struct URL *url) {
     sscanf(input, RESOURCE_REGEX, url->resource);
     strcpy(url->file, strrchr(input, '/') + 1);
 
+    // Optional port, 'ftp://<host>:<port>/<url-path>' or 'ftp://[2001:db8::1]:<port>/<url-path>'
+    url->port = FTP_PORT;
+    char *bracket = url->host[0] == '[' ? strchr(url->host, ']') : NULL;
+    char *colon = bracket ? (bracket[1] == ':' ? bracket + 1 : NULL) : strchr(url->host, ':');
+    if (colon != NULL && (bracket != NULL || strchr(colon + 1, ':') == NULL)) {
+        char *end;
+        long port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535) return -1;
+        url->port = port;
+        *colon = '\0';
+    }
+
+    // The brackets of an IPv6 address are not part of it
+    size_t hostLength = strlen(url->host);
+    if (hostLength > 2 && url->host[0] == '[' && url->host[hostLength - 1] == ']') {
+        memmove(url->host, url->host + 1, hostLength - 2);
+        url->host[hostLength - 2] = '\0';
+    }
+
     // Resolve the IP address from the hostname
-    struct hostent *h;
     if (strlen(url->host) == 0) return -1;
 
-    if ((h = gethostbyname(url->host)) == NULL) {
+    if (resolveHost(url->host, url->ip) != 0) {
         printf("Invalid hostname '%s'\n", url->host);
-        exit(-1);
+        return -1;
     }
-    strcpy(url->ip, inet_ntoa(*((struct in_addr *) h->h_addr)));
 
     // Return 0 if parsing and validation are successful
     return !(strlen(url->host) && strlen(url->user) && strlen(url->password) && strlen(url->resource) && strlen(url->file));
 }
 
-// Function to create a socket and connect to the server
-int createSocket(char *ip, int port) {
-    int sockfd;
-    struct sockaddr_in server_addr;
+// Readers of the control connections, indexed by socket
+static struct LineReader *readers[MAX_SOCKETS];
 
-    // Initialize server address structure
-    bzero((char *) &server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-    server_addr.sin_port = htons(port);
+// Control connections whose server does not know EPSV, indexed by socket
+static char noExtendedPassive[MAX_SOCKETS];
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket()");
-        exit(-1);
+// Function to get the reader of a control connection, empty for a new socket
+static struct LineReader *lineReader(const int socket, int reset) {
+    if (socket < 0 || socket >= MAX_SOCKETS) return NULL;
+
+    if (readers[socket] == NULL) {
+        readers[socket] = malloc(sizeof(struct LineReader));
+        if (readers[socket] == NULL) return NULL;
+        reset = 1;
     }
+    if (reset) readers[socket]->start = readers[socket]->end = 0;
 
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        perror("connect()");
-        exit(-1);
+    return readers[socket];
+}
+
+// Hosts already resolved, shared by every thread
+static struct HostEntry hosts[MAX_CACHED_HOSTS];
+static int nHosts, nextEviction;
+static pthread_mutex_t hostsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hostResolved = PTHREAD_COND_INITIALIZER;
+
+// Function to get the seconds of a monotonic clock
+double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to get the milliseconds of a monotonic clock
+static long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Function to copy the addresses of a getaddrinfo list, alternating families starting with the preferred one
+static int orderAddresses(struct addrinfo *list, struct sockaddr_storage *addresses, socklen_t *lengths) {
+    if (list == NULL) return 0;
+
+    int families[2] = {list->ai_family, list->ai_family == AF_INET6 ? AF_INET : AF_INET6};
+    struct addrinfo *next[2] = {list, list};
+    int count = 0;
+
+    while (count < MAX_ADDRESSES && (next[0] != NULL || next[1] != NULL)) {
+        for (int f = 0; f < 2 && count < MAX_ADDRESSES; f++) {
+            while (next[f] != NULL && next[f]->ai_family != families[f]) next[f] = next[f]->ai_next;
+            if (next[f] == NULL) continue;
+
+            memcpy(&addresses[count], next[f]->ai_addr, next[f]->ai_addrlen);
+            lengths[count++] = next[f]->ai_addrlen;
+            next[f] = next[f]->ai_next;
+        }
+    }
+
+    return count;
+}
+
+// Function to resolve a host, concurrent lookups of the same host wait for the first one
+static int lookupHost(const char *host, struct sockaddr_storage *addresses, socklen_t *lengths) {
+    struct addrinfo hints, *list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Numeric addresses (as in PASV / EPSV replies) need no lookup nor cache
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(host, NULL, &hints, &list) == 0) {
+        int count = orderAddresses(list, addresses, lengths);
+        freeaddrinfo(list);
+        return count;
+    }
+    hints.ai_flags = 0;
+
+    pthread_mutex_lock(&hostsLock);
+
+    struct HostEntry *entry = NULL;
+    for (int i = 0; i < nHosts; i++) {
+        if (strcmp(hosts[i].host, host) == 0) {
+            entry = &hosts[i];
+            break;
+        }
+    }
+    while (entry != NULL && entry->pending) pthread_cond_wait(&hostResolved, &hostsLock);
+
+    // Failed lookups are retried
+    if (entry == NULL || entry->count == 0) {
+        if (entry == NULL) {
+            if (nHosts < MAX_CACHED_HOSTS) entry = &hosts[nHosts++];
+            else {
+                // Replace a host not being resolved
+                do entry = &hosts[nextEviction++ % MAX_CACHED_HOSTS]; while (entry->pending);
+            }
+            snprintf(entry->host, MAX_LENGTH, "%s", host);
+        }
+        entry->pending = 1;
+        entry->count = 0;
+        pthread_mutex_unlock(&hostsLock);
+
+        int error = getaddrinfo(host, NULL, &hints, &list);
+        if (error != 0) printf("getaddrinfo(%s): %s\n", host, gai_strerror(error));
+
+        pthread_mutex_lock(&hostsLock);
+        if (error == 0) {
+            entry->count = orderAddresses(list, entry->addresses, entry->lengths);
+            freeaddrinfo(list);
+        }
+        entry->pending = 0;
+        pthread_cond_broadcast(&hostResolved);
+    }
+
+    int count = entry->count;
+    memcpy(addresses, entry->addresses, count * sizeof(struct sockaddr_storage));
+    memcpy(lengths, entry->lengths, count * sizeof(socklen_t));
+
+    pthread_mutex_unlock(&hostsLock);
+    return count;
+}
+
+// Function to resolve a host and get its first address
+int resolveHost(const char *host, char *ip) {
+    struct sockaddr_storage addresses[MAX_ADDRESSES];
+    socklen_t lengths[MAX_ADDRESSES];
+
+    if (lookupHost(host, addresses, lengths) == 0) return -1;
+
+    return getnameinfo((struct sockaddr *) &addresses[0], lengths[0], ip, MAX_LENGTH, NULL, 0, NI_NUMERICHOST) == 0 ? 0 : -1;
+}
+
+static pthread_once_t receiveBufferOnce = PTHREAD_ONCE_INIT;
+static int receiveBufferMax;
+
+// Function to read the largest SO_RCVBUF the kernel grants (net.core.rmem_max), 0 if unknown
+static void readReceiveBufferMax() {
+    FILE *file = fopen(RMEM_MAX_PATH, "r");
+    if (file == NULL) return;
+    if (fscanf(file, "%d", &receiveBufferMax) != 1 || receiveBufferMax < 0) receiveBufferMax = 0;
+    fclose(file);
+}
+
+static int maxReceiveBuffer() {
+    pthread_once(&receiveBufferOnce, readReceiveBufferMax);
+    return receiveBufferMax;
+}
+
+// Function to start a non-blocking connection to one address, returns the socket or -1
+static int startConnect(struct sockaddr_storage *address, socklen_t length, int port, int receiveBuffer, int *connected) {
+    if (address->ss_family == AF_INET) ((struct sockaddr_in *) address)->sin_port = htons(port);
+    else ((struct sockaddr_in6 *) address)->sin6_port = htons(port);
+
+    int sockfd = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) return -1;
+
+    // The receive window is negotiated on connect, so the buffer must be set before it. Setting it turns
+    // receive autotuning off, so it is only set when the kernel would grant it whole and it is larger
+    int current;
+    socklen_t size = sizeof(current);
+    if (receiveBuffer > 0 && receiveBuffer <= maxReceiveBuffer()
+        && getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &current, &size) == 0 && current < receiveBuffer
+        && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer)) < 0) {
+        perror("setsockopt()");
+    }
+
+    *connected = connect(sockfd, (struct sockaddr *) address, length) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Function to create a socket and connect to the server, with an optional receive buffer size
+static int openSocket(char *host, int port, int receiveBuffer) {
+    struct sockaddr_storage addresses[MAX_ADDRESSES];
+    socklen_t lengths[MAX_ADDRESSES];
+    int count = lookupHost(host, addresses, lengths);
+    if (count == 0) return -1;
+
+    // Race the addresses: a new attempt starts every CONNECT_ATTEMPT_DELAY ms, or as soon as every
+    // pending one failed, and the first connection established wins
+    struct pollfd attempts[MAX_ADDRESSES];
+    int nAttempts = 0, pending = 0, sockfd = -1, error = ETIMEDOUT;
+    long long start = monotonicMs(), lastAttempt = 0;
+
+    while (sockfd < 0) {
+        long long now = monotonicMs();
+
+        if (nAttempts < count && (pending == 0 || now - lastAttempt >= CONNECT_ATTEMPT_DELAY)) {
+            int connected;
+            int fd = startConnect(&addresses[nAttempts], lengths[nAttempts], port, receiveBuffer, &connected);
+            attempts[nAttempts].fd = fd;
+            attempts[nAttempts].events = POLLOUT;
+            attempts[nAttempts].revents = 0;
+            nAttempts++;
+            lastAttempt = now;
+
+            if (fd < 0) error = errno;
+            else if (connected) sockfd = fd;
+            else pending++;
+            continue;
+        }
+
+        if (pending == 0 || now - start >= CONNECT_TIMEOUT) break;
+
+        long long timeout = CONNECT_TIMEOUT - (now - start);
+        if (nAttempts < count && CONNECT_ATTEMPT_DELAY - (now - lastAttempt) < timeout) {
+            timeout = CONNECT_ATTEMPT_DELAY - (now - lastAttempt);
+        }
+
+        if (poll(attempts, nAttempts, timeout) < 0) {
+            if (errno == EINTR) continue;
+            error = errno;
+            break;
+        }
+
+        for (int i = 0; i < nAttempts && sockfd < 0; i++) {
+            if (attempts[i].fd < 0 || attempts[i].revents == 0) continue;
+
+            int result = 0;
+            socklen_t resultLength = sizeof(result);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &result, &resultLength);
+
+            if (result == 0) {
+                sockfd = attempts[i].fd;
+            } else {
+                error = result;
+                close(attempts[i].fd);
+                pending--;
+            }
+            attempts[i].fd = -1;
+        }
     }
 
+    // Give up the attempts still in progress
+    for (int i = 0; i < nAttempts; i++) {
+        if (attempts[i].fd >= 0 && attempts[i].fd != sockfd) close(attempts[i].fd);
+    }
+
+    if (sockfd < 0) {
+        printf("connect() to '%s' port %d: %s\n", host, port, strerror(error));
+        return -1;
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+    lineReader(sockfd, 1);  // Forget bytes left by a previous socket with the same number
+    if (sockfd < MAX_SOCKETS) noExtendedPassive[sockfd] = 0;
+
     return sockfd;
 }
 
+// Function to create a control connection socket
+int createSocket(char *host, int port) {
+    return openSocket(host, port, 0);
+}
+
+// Function to create a data connection socket
+int createDataSocket(char *host, int port) {
+    return openSocket(host, port, DATA_SOCKET_RCVBUF);
+}
+
 // Function to authenticate the connection with the FTP server
 int authConn(const int socket, const char* user, const char* pass) {
-    char userCommand[5 + strlen(user) + 1];
+    // Command, argument, '\n' and the terminating '\0'
+    char userCommand[5 + strlen(user) + 2];
     sprintf(userCommand, "user %s\n", user);
 
-    char passCommand[5 + strlen(pass) + 1];
+    char passCommand[5 + strlen(pass) + 2];
     sprintf(passCommand, "pass %s\n", pass);
 
     char answer[MAX_LENGTH];
@@ -88,186 +345,962 @@ int authConn(const int socket, const char* user, const char* pass) {
     return readResponse(socket, answer);
 }
 
-// Function to enter passive mode and get the data connection details
-int passiveMode(const int socket, char *ip, int *port) {
+// Function to open an authenticated binary mode session
+int openSession(char *host, int port, const char *user, const char *pass) {
     char answer[MAX_LENGTH];
+    int socket = createSocket(host, port);
+    if (socket < 0) return -1;
+
+    if (readResponse(socket, answer) != SV_READY4AUTH ||
+        authConn(socket, user, pass) != SV_LOGINSUCCESS ||
+        binaryMode(socket) != SV_COMMAND_OK) {
+        close(socket);
+        return -1;
+    }
+
+    return socket;
+}
+
+// Function to get the data connection details from an EPSV (229) or PASV (227) reply
+static int parsePassive(const int socket, int code, const char *answer, char *ip, int *port) {
     int ip1, ip2, ip3, ip4, port1, port2;
 
-    // Send PASV command and check the response
-    write(socket, "pasv\n", 5);
-    if (readResponse(socket, answer) != SV_PASSIVE) return -1;
+    // EPSV only gives the port, the data connection goes to the address of the control connection
+    if (code == SV_EXT_PASSIVE) {
+        struct sockaddr_storage peer;
+        socklen_t peerLength = sizeof(peer);
+
+        if (sscanf(answer, EPSV_REGEX, port) != 1 ||
+            getpeername(socket, (struct sockaddr *) &peer, &peerLength) < 0 ||
+            getnameinfo((struct sockaddr *) &peer, peerLength, ip, MAX_LENGTH, NULL, 0, NI_NUMERICHOST) != 0) return -1;
+
+        return SV_PASSIVE;
+    }
 
     // Extract IP and port information from the PASV response
-    sscanf(answer, PASSIVE_REGEX, &ip1, &ip2, &ip3, &ip4, &port1, &port2);
+    if (code != SV_PASSIVE || sscanf(answer, PASSIVE_REGEX, &ip1, &ip2, &ip3, &ip4, &port1, &port2) != 6) return -1;
     *port = port1 * 256 + port2;
     sprintf(ip, "%d.%d.%d.%d", ip1, ip2, ip3, ip4);
 
     return SV_PASSIVE;
 }
 
+// Function to tell whether the control connection is over IPv4
+static int isIPv4(const int socket) {
+    struct sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+
+    return getpeername(socket, (struct sockaddr *) &peer, &peerLength) == 0 && peer.ss_family == AF_INET;
+}
+
+// Function to enter passive mode and get the data connection details
+int passiveMode(const int socket, char *ip, int *port) {
+    char answer[MAX_LENGTH];
+
+    if (socket >= MAX_SOCKETS || !noExtendedPassive[socket]) {
+        write(socket, "epsv\n", 5);
+        int code = readResponse(socket, answer);
+
+        if (code == SV_EXT_PASSIVE) return parsePassive(socket, code, answer, ip, port);
+        if (code < 500) return -1;
+        if (socket < MAX_SOCKETS) noExtendedPassive[socket] = 1;
+    }
+
+    // PASV can only describe IPv4 addresses
+    if (!isIPv4(socket)) return -1;
+
+    // Send PASV command and check the response
+    write(socket, "pasv\n", 5);
+    int code = readResponse(socket, answer);
+
+    return parsePassive(socket, code, answer, ip, port);
+}
+
+// Function to read one line of the control connection, without the line terminator
+// Lines longer than MAX_LENGTH - 1 are truncated. Returns the line length or -1 on EOF or error
+static int readLine(const int socket, char *line) {
+    struct LineReader *reader = lineReader(socket, 0);
+    if (reader == NULL) return -1;
+
+    int length = 0;
+    while (1) {
+        // Refill the buffer
+        if (reader->start == reader->end) {
+            ssize_t bytes = read(socket, reader->data, READER_SIZE);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) return -1;
+            reader->start = 0;
+            reader->end = bytes;
+        }
+
+        char *begin = reader->data + reader->start;
+        char *newline = memchr(begin, '\n', reader->end - reader->start);
+        int n = newline ? newline - begin : reader->end - reader->start;
+
+        int copy = n < MAX_LENGTH - 1 - length ? n : MAX_LENGTH - 1 - length;
+        memcpy(line + length, begin, copy);
+        length += copy;
+        reader->start += n;
+
+        if (newline) {
+            reader->start++;
+            break;
+        }
+    }
+
+    if (length > 0 && line[length - 1] == '\r') length--;
+    line[length] = '\0';
+    return length;
+}
+
 // Function to read server responses from the control connection
 int readResponse(const int socket, char* buffer) {
-    char byte;
-    int index = 0, responseCode;
-    ResponseState state = START;
+    int responseCode;
 
     // Initialize buffer and read server response
     memset(buffer, 0, MAX_LENGTH);
 
-    while (state != END) {
-        read(socket, &byte, 1);
-        switch (state) {
-            case START:
-                if (byte == ' ') state = SINGLE;
-                else if (byte == '-') state = MULTIPLE;
-                else if (byte == '\n') state = END;
-                else buffer[index++] = byte;
-                break;
-            case SINGLE:
-                if (byte == '\n') state = END;
-                else buffer[index++] = byte;
-                break;
-            case MULTIPLE:
-                if (byte == '\n') {
-                    memset(buffer, 0, MAX_LENGTH);
-                    state = START;
-                    index = 0;
-                }
-                else buffer[index++] = byte;
-                break;
-            case END:
-                break;
-            default:
-                break;
-        }
-    }
-
-    // Extract response code and return it
-    sscanf(buffer, RESPCODE_REGEX, &responseCode);
+    if (readLine(socket, buffer) < 3 || sscanf(buffer, "%3d", &responseCode) != 1) return -1;
+
+    // Multi-line response, ends with a line starting with the same code and a space
+    if (buffer[3] == '-') {
+        char last[5];
+        sprintf(last, "%03d ", responseCode);
+        do {
+            if (readLine(socket, buffer) < 0) return -1;
+        } while (strncmp(buffer, last, 4) != 0 && strcmp(buffer, last) != 0);
+    }
+
     return responseCode;
 }
 
+// Bytes received by every thread, and the reporter of the progress line
+static struct {
+    long long received;     // Updated atomically
+    long long total;        // Updated atomically when added up from RETR replies
+    long long firstByte;    // Monotonic nanoseconds of the first byte, 0 before it
+    int addTotals;          // TRUE if total is the sum of the sizes announced by the server
+    int running;            // TRUE while the reporter runs, protected by lock
+    pthread_t reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+} progress = {.lock = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER};
+
+// Function to count received bytes
+static void progressAdd(long long bytes) {
+    if (__atomic_load_n(&progress.firstByte, __ATOMIC_RELAXED) == 0) {
+        long long none = 0, now = (long long) (monotonicSeconds() * 1e9);
+        __atomic_compare_exchange_n(&progress.firstByte, &none, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&progress.received, bytes, __ATOMIC_RELAXED);
+}
+
+// Function to print a byte count with a binary unit
+static void printBytes(double bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    fprintf(stderr, "%7.1f %-3s", bytes, units[unit]);
+}
+
+// Function run by the reporter thread, prints the progress line every PROGRESS_INTERVAL
+static void *progressReporter(void *arg) {
+    double lastTime = monotonicSeconds();
+    long long lastBytes = 0;
+
+    pthread_mutex_lock(&progress.lock);
+    while (progress.running) {
+        // Wake up every PROGRESS_INTERVAL, or right away to print the last line
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long long nanoseconds = deadline.tv_nsec + (long long) (PROGRESS_INTERVAL * 1e9);
+        deadline.tv_sec += nanoseconds / 1000000000;
+        deadline.tv_nsec = nanoseconds % 1000000000;
+        pthread_cond_timedwait(&progress.stop, &progress.lock, &deadline);
+
+        double now = monotonicSeconds();
+        long long received = __atomic_load_n(&progress.received, __ATOMIC_RELAXED);
+        long long total = __atomic_load_n(&progress.total, __ATOMIC_RELAXED);
+        long long firstByte = __atomic_load_n(&progress.firstByte, __ATOMIC_RELAXED);
+
+        double instant = (received - lastBytes) / (now - lastTime);
+        double average = firstByte ? received / (now - firstByte / 1e9) : 0;
+        lastBytes = received;
+        lastTime = now;
+
+        fprintf(stderr, "\r");
+        printBytes(received);
+        if (total > 0) {
+            fprintf(stderr, " / ");
+            printBytes(total);
+            fprintf(stderr, " %3d%%", (int) (100.0 * received / total));
+        }
+        fprintf(stderr, "  %8.2f MB/s (avg %8.2f MB/s)", instant / 1e6, average / 1e6);
+        if (total > 0 && average > 0 && received < total) {
+            long long eta = (long long) ((total - received) / average);
+            fprintf(stderr, "  ETA %lld:%02lld:%02lld", eta / 3600, eta / 60 % 60, eta % 60);
+        }
+        fprintf(stderr, "\033[K");
+    }
+    pthread_mutex_unlock(&progress.lock);
+
+    fprintf(stderr, "\n");
+    return NULL;
+}
+
+// Function to start counting received bytes
+void progressStart(long long total) {
+    progress.received = 0;
+    progress.firstByte = 0;
+    progress.addTotals = total < 0;
+    progress.total = total < 0 ? 0 : total;
+
+    pthread_mutex_lock(&progress.lock);
+    progress.running = isatty(STDERR_FILENO) && pthread_create(&progress.reporter, NULL, progressReporter, NULL) == 0;
+    pthread_mutex_unlock(&progress.lock);
+}
+
+// Function to stop counting received bytes
+double progressStop(long long *bytes, long long *total) {
+    pthread_mutex_lock(&progress.lock);
+    int running = progress.running;
+    progress.running = 0;
+    pthread_cond_signal(&progress.stop);
+    pthread_mutex_unlock(&progress.lock);
+
+    if (running) pthread_join(progress.reporter, NULL);
+
+    *bytes = __atomic_load_n(&progress.received, __ATOMIC_RELAXED);
+    *total = (progress.addTotals && progress.total == 0) ? -1 : progress.total;
+    return progress.firstByte ? progress.firstByte / 1e9 : -1;
+}
+
+// Function to write a JSON string
+static void writeJsonString(FILE *file, const char *string) {
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char *) string; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+        else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+        else fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+// Function to write the metrics of a download as JSON
+void writeSummary(FILE *file, const struct URL *url, const struct Metrics *metrics) {
+    double total = monotonicSeconds() - metrics->start;
+    double transfer = metrics->firstByte >= 0 ? total - metrics->firstByte : 0;
+
+    fprintf(file, "{\"host\":");
+    writeJsonString(file, url->host);
+    fprintf(file, ",\"resource\":");
+    writeJsonString(file, url->resource);
+    fprintf(file, ",\"mode\":\"%s\",\"status\":\"%s\",\"bytes\":%lld,\"size\":%lld,",
+            metrics->mode, metrics->status == 0 ? "ok" : "failed", metrics->bytes, metrics->size);
+    fprintf(file, "\"phases_ms\":{\"dns\":%.3f,\"connect\":%.3f,\"auth\":%.3f,\"pasv\":%.3f,\"transfer\":%.3f},",
+            metrics->dns * 1e3, metrics->connect * 1e3, metrics->auth * 1e3, metrics->passive * 1e3, metrics->transfer * 1e3);
+    fprintf(file, "\"checksum\":%s,", metrics->checksum < 0 ? "null" : metrics->checksum ? "\"ok\"" : "\"mismatch\"");
+    fprintf(file, "\"ttfb_ms\":%.3f,\"total_ms\":%.3f,\"throughput_MBps\":%.3f}\n",
+            metrics->firstByte >= 0 ? metrics->firstByte * 1e3 : -1.0, total * 1e3,
+            transfer > 0 ? metrics->bytes / transfer / 1e6 : 0.0);
+}
+
 // Function to request a specific resource from the server
 int requestResource(const int socket, char *resource) {
-    char fileCommand[5+strlen(resource)+1], answer[MAX_LENGTH];
+    char fileCommand[5 + strlen(resource) + 2], answer[MAX_LENGTH];
 
     // Send RETR command for the requested resource
     sprintf(fileCommand, "retr %s\n", resource);
-    write(socket, fileCommand, sizeof(fileCommand));
+    write(socket, fileCommand, strlen(fileCommand));
+
+    // Most servers announce the size, '150 Opening BINARY mode data connection for <file> (<size> bytes).'
+    int code = readResponse(socket, answer);
+    long long size;
+    char *parenthesis = strrchr(answer, '(');
+    if (progress.addTotals && (code == SV_READY4TRANSFER || code == SV_READY4TRANSFER_ALT) &&
+        parenthesis != NULL && sscanf(parenthesis, "(%lld bytes", &size) == 1) {
+        __atomic_add_fetch(&progress.total, size, __ATOMIC_RELAXED);
+    }
 
     // Return the response code
-    return readResponse(socket, answer);
+    return code;
+}
+
+// Function to move data from the data connection into the file through a pipe, without copying it to user space
+// Returns the number of bytes received, -1 on error or SPLICE_UNSUPPORTED if nothing could be moved this way
+static long long spliceData(const int socket, const int fd, off_t offset, long long length) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) return SPLICE_UNSUPPORTED;
+    fcntl(pipefd[1], F_SETPIPE_SZ, DATA_BUFFER_SIZE);
+
+    long long received = 0;
+    while (length < 0 || received < length) {
+        size_t chunk = DATA_BUFFER_SIZE;
+        if (length >= 0 && length - received < (long long) chunk) chunk = length - received;
+
+        // Socket -> pipe
+        ssize_t bytes = splice(socket, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (bytes == 0) break;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (received == 0 && (errno == EINVAL || errno == ENOSYS)) received = SPLICE_UNSUPPORTED;
+            else {
+                perror("splice()");
+                received = -1;
+            }
+            break;
+        }
+
+        // Pipe -> file
+        while (bytes > 0) {
+            ssize_t written = splice(pipefd[0], NULL, fd, &offset, bytes, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                perror("splice()");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            bytes -= written;
+            received += written;
+            progressAdd(written);
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return received;
+}
+
+// Function to receive data from the data connection into a file
+long long receiveData(const int socket, const int fd, off_t offset, long long length) {
+    long long received = spliceData(socket, fd, offset, length);
+    if (received != SPLICE_UNSUPPORTED) return received;
+
+    // Fallback: recv into a large page aligned buffer
+    unsigned char *buffer;
+    if (posix_memalign((void **) &buffer, 4096, DATA_BUFFER_SIZE) != 0) return -1;
+
+    received = 0;
+    while (length < 0 || received < length) {
+        size_t chunk = DATA_BUFFER_SIZE;
+        if (length >= 0 && length - received < (long long) chunk) chunk = length - received;
+
+        ssize_t bytes = recv(socket, buffer, chunk, 0);
+        if (bytes == 0) break;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            perror("recv()");
+            free(buffer);
+            return -1;
+        }
+
+        if (pwrite(fd, buffer, bytes, offset + received) != bytes) {
+            perror("pwrite()");
+            free(buffer);
+            return -1;
+        }
+        received += bytes;
+        progressAdd(bytes);
+    }
+
+    free(buffer);
+    return received;
+}
+
+// Chunks handed by the receiving thread to the hashing thread, hashed in order
+struct Hasher {
+    struct Sha256 *hash;
+    unsigned char *buffers[HASH_BUFFERS];
+    ssize_t sizes[HASH_BUFFERS];
+    long long submitted, hashed;    // Chunk i is in buffers[i % HASH_BUFFERS]
+    int done;                       // No more chunks will be submitted
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// Function run by the hashing thread
+static void *hashWorker(void *arg) {
+    struct Hasher *hasher = (struct Hasher *) arg;
+
+    pthread_mutex_lock(&hasher->lock);
+    while (1) {
+        while (hasher->hashed == hasher->submitted && !hasher->done) pthread_cond_wait(&hasher->changed, &hasher->lock);
+        if (hasher->hashed == hasher->submitted) break;
+
+        int i = hasher->hashed % HASH_BUFFERS;
+        pthread_mutex_unlock(&hasher->lock);
+        sha256Update(hasher->hash, hasher->buffers[i], hasher->sizes[i]);
+        pthread_mutex_lock(&hasher->lock);
+
+        hasher->hashed++;
+        pthread_cond_signal(&hasher->changed);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+
+    return NULL;
+}
+
+// Function to receive data from the data connection into a file, hashing it on the way
+long long receiveDataHashed(const int socket, const int fd, off_t offset, long long length, struct Sha256 *hash) {
+    if (hash == NULL) return receiveData(socket, fd, offset, length);
+
+    struct Hasher hasher;
+    memset(&hasher, 0, sizeof(hasher));
+    hasher.hash = hash;
+    pthread_mutex_init(&hasher.lock, NULL);
+    pthread_cond_init(&hasher.changed, NULL);
+
+    // A helper thread only pays off with a spare CPU, otherwise each chunk is hashed after it is written
+    int threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    int nBuffers = threaded ? HASH_BUFFERS : 1;
+    long long received = 0;
+
+    // The buffers not allocated stay NULL, and without the thread there is nothing to join
+    for (int i = 0; i < nBuffers; i++) {
+        if (posix_memalign((void **) &hasher.buffers[i], 4096, DATA_BUFFER_SIZE) != 0) {
+            printf("Error allocating the receive buffers\n");
+            received = -1;
+            threaded = 0;
+            break;
+        }
+    }
+
+    pthread_t thread;
+    if (received == 0 && threaded && pthread_create(&thread, NULL, hashWorker, &hasher) != 0) threaded = 0;
+
+    while (received >= 0 && (length < 0 || received < length)) {
+        size_t chunk = DATA_BUFFER_SIZE;
+        if (length >= 0 && length - received < (long long) chunk) chunk = length - received;
+
+        // Wait for a buffer the hashing thread is done with
+        int i = 0;
+        if (threaded) {
+            pthread_mutex_lock(&hasher.lock);
+            while (hasher.submitted - hasher.hashed == HASH_BUFFERS) pthread_cond_wait(&hasher.changed, &hasher.lock);
+            i = hasher.submitted % HASH_BUFFERS;
+            pthread_mutex_unlock(&hasher.lock);
+        }
+
+        ssize_t bytes = recv(socket, hasher.buffers[i], chunk, 0);
+        if (bytes == 0) break;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            perror("recv()");
+            received = -1;
+            break;
+        }
+
+        if (pwrite(fd, hasher.buffers[i], bytes, offset + received) != bytes) {
+            perror("pwrite()");
+            received = -1;
+            break;
+        }
+        received += bytes;
+        progressAdd(bytes);
+
+        if (threaded) {
+            pthread_mutex_lock(&hasher.lock);
+            hasher.sizes[i] = bytes;
+            hasher.submitted++;
+            pthread_cond_signal(&hasher.changed);
+            pthread_mutex_unlock(&hasher.lock);
+        }
+        else sha256Update(hash, hasher.buffers[i], bytes);
+    }
+
+    // The thread hashes what is left and exits
+    if (threaded) {
+        pthread_mutex_lock(&hasher.lock);
+        hasher.done = 1;
+        pthread_cond_signal(&hasher.changed);
+        pthread_mutex_unlock(&hasher.lock);
+        pthread_join(thread, NULL);
+    }
+
+    for (int i = 0; i < nBuffers; i++) free(hasher.buffers[i]);
+    pthread_mutex_destroy(&hasher.lock);
+    pthread_cond_destroy(&hasher.changed);
+    return received;
+}
+
+// Function to hash the first bytes of a file
+int hashFile(const int fd, long long length, struct Sha256 *hash) {
+    unsigned char *buffer = malloc(DATA_BUFFER_SIZE);
+    if (buffer == NULL) return -1;
+
+    long long done = 0;
+    while (done < length) {
+        size_t chunk = DATA_BUFFER_SIZE;
+        if (length - done < (long long) chunk) chunk = length - done;
+
+        ssize_t bytes = pread(fd, buffer, chunk, done);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+
+        sha256Update(hash, buffer, bytes);
+        done += bytes;
+    }
+
+    free(buffer);
+    return done == length ? 0 : -1;
+}
+
+// Function to get the expected digest of a resource from its sibling '.sha256' resource
+int fetchDigest(const int socket, const char *resource, unsigned char *digest) {
+    char ip[MAX_LENGTH], answer[MAX_LENGTH], name[MAX_LENGTH + sizeof(DIGEST_SUFFIX)];
+    int port;
+
+    if (passiveMode(socket, ip, &port) != SV_PASSIVE) return -1;
+    int socketB = createSocket(ip, port);
+    if (socketB < 0) return -1;
+
+    snprintf(name, sizeof(name), "%s" DIGEST_SUFFIX, resource);
+    int code = requestResource(socket, name);
+    if (code != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT) {
+        printf("No digest for '%s' (%d)\n", resource, code);
+        close(socketB);
+        return -1;
+    }
+
+    // Only the start matters, '<hex digest>  <file name>'
+    char line[DIGEST_FILE_SIZE + 1];
+    size_t length = 0;
+    ssize_t bytes;
+    while (length < DIGEST_FILE_SIZE && (bytes = read(socketB, line + length, DIGEST_FILE_SIZE - length)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        length += bytes;
+    }
+    line[length] = '\0';
+    close(socketB);
+
+    if (readResponse(socket, answer) != SV_TRANSFER_COMPLETE) return -1;
+
+    const char *hex = line;
+    while (*hex == ' ' || *hex == '\t') hex++;
+    if (sha256FromHex(hex, digest) != 0) {
+        printf("'%s' does not hold a SHA-256 digest\n", name);
+        return -1;
+    }
+    return 0;
 }
 
 // Function to receive the requested resource from the data connection
 int getResource(const int socketA, const int socketB, char *filename) {
-    FILE *fd = fopen(filename, "wb");
+    return getResourceFrom(socketA, socketB, filename, 0, NULL);
+}
+
+// Function to receive the rest of the requested resource after the bytes already in the file
+int getResourceFrom(const int socketA, const int socketB, char *filename, long long offset, struct Sha256 *hash) {
+    int fd = open(filename, (hash != NULL ? O_RDWR : O_WRONLY) | O_CREAT, 0644);
 
     // Check if file can be opened or created
-    if (fd == NULL) {
+    if (fd < 0) {
         printf("Error opening or creating file '%s'\n", filename);
-        exit(-1);
+        return -1;
     }
 
-    char buffer[MAX_LENGTH];
-    int bytes;
+    // Drop whatever follows the offset, it is downloaded again
+    if (ftruncate(fd, offset) < 0) {
+        perror("ftruncate()");
+        close(fd);
+        return -1;
+    }
+
+    // The part already downloaded is only in the file
+    if (hash != NULL) {
+        sha256Init(hash);
+        if (hashFile(fd, offset, hash) != 0) {
+            printf("Error reading '%s'\n", filename);
+            close(fd);
+            return -1;
+        }
+    }
 
     // Read data from the data connection and write to the file
-    do {
-        bytes = read(socketB, buffer, MAX_LENGTH);
-        if (fwrite(buffer, bytes, 1, fd) < 0) return -1;
-    } while (bytes);
+    long long bytes = receiveDataHashed(socketB, fd, offset, -1, hash);
 
     // Close the file and return the response code
-    fclose(fd);
+    if (close(fd) < 0 || bytes < 0) return -1;
 
+    char buffer[MAX_LENGTH];
     return readResponse(socketA, buffer);
 }
 
-// Function to close both control and data connections
-int closeConnection(const int socketA, const int socketB) {
+// Function to switch the transfer type to binary
+int binaryMode(const int socket) {
     char answer[MAX_LENGTH];
 
-    // Send QUIT command and check the response
-    write(socketA, "quit\n", 5);
-    
-    if(readResponse(socketA, answer) != SV_GOODBYE) return -1;
+    write(socket, "type I\n", 7);
+    return readResponse(socket, answer);
+}
 
-    // Close both control and data connections
-    return close(socketA) || close(socketB);
+// Function to get the size of a resource
+int resourceSize(const int socket, char *resource, long long *size) {
+    char sizeCommand[5 + strlen(resource) + 2], answer[MAX_LENGTH];
+
+    sprintf(sizeCommand, "size %s\n", resource);
+    write(socket, sizeCommand, strlen(sizeCommand));
+
+    int code = readResponse(socket, answer);
+    if (code == SV_FILE_STATUS && sscanf(answer, SIZE_REGEX, size) != 1) return -1;
+
+    return code;
 }
 
-// Main function
-int main(int argc, char *argv[]) {
-    // Check if the correct number of arguments is provided
-    if (argc != 2) {
-        printf("Usage: ./download ftp://[<user>:<password>@]<host>/<url-path>\n");
-        exit(-1);
-    }
+// Function to get the modification time of a resource
+int resourceTime(const int socket, char *resource, time_t *mtime) {
+    char mdtmCommand[5 + strlen(resource) + 2], answer[MAX_LENGTH];
 
-    // Initialize URL structure
-    struct URL url;
-    memset(&url, 0, sizeof(url));
+    sprintf(mdtmCommand, "mdtm %s\n", resource);
+    write(socket, mdtmCommand, strlen(mdtmCommand));
 
-    // Parse the input URL
-    if (parse(argv[1], &url) != 0) {
-        printf("Parse error. Usage: ./download ftp://[<user>:<password>@]<host>/<url-path>\n");
-        exit(-1);
+    int code = readResponse(socket, answer);
+    if (code == SV_FILE_STATUS) {
+        // 'YYYYMMDDhhmmss', always UTC
+        struct tm time;
+        memset(&time, 0, sizeof(time));
+        if (sscanf(answer, MDTM_REGEX, &time.tm_year, &time.tm_mon, &time.tm_mday,
+                   &time.tm_hour, &time.tm_min, &time.tm_sec) != 6) return -1;
+        time.tm_year -= 1900;
+        time.tm_mon -= 1;
+        *mtime = timegm(&time);
     }
 
-    // Print parsed URL information
-    printf("Host: %s\nResource: %s\nFile: %s\nUser: %s\nPassword: %s\nIP Address: %s\n",
-           url.host, url.resource, url.file, url.user, url.password, url.ip);
+    return code;
+}
+
+// Function to set the offset of the next transfer
+int restartAt(const int socket, long long offset) {
+    char restCommand[32], answer[MAX_LENGTH];
+
+    sprintf(restCommand, "rest %lld\n", offset);
+    write(socket, restCommand, strlen(restCommand));
+
+    return readResponse(socket, answer);
+}
 
+// Function to download one byte range, run by each segment thread
+void *getSegment(void *arg) {
+    struct Segment *segment = (struct Segment *) arg;
+    struct URL *url = segment->url;
     char answer[MAX_LENGTH];
-    int socketA = createSocket(url.ip, FTP_PORT);
+    segment->status = -1;
 
-    // Check if control connection is successful
-    if (socketA < 0 || readResponse(socketA, answer) != SV_READY4AUTH) {
-        printf("Socket to '%s' and port %d failed\n", url.ip, FTP_PORT);
-        exit(-1);
+    // Open and authenticate a control connection of our own
+    int socketA = segment->socket;
+    if (socketA < 0 && (socketA = openSession(url->host, url->port, url->user, url->password)) < 0) {
+        printf("Segment at %lld: login failed\n", (long long) segment->offset);
+        return NULL;
     }
 
-    // Authenticate the connection
-    if (authConn(socketA, url.user, url.password) != SV_LOGINSUCCESS) {
-        printf("Authentication failed with username = '%s' and password = '%s'.\n", url.user, url.password);
-        exit(-1);
+    int port;
+    char ip[MAX_LENGTH];
+    if (passiveMode(socketA, ip, &port) != SV_PASSIVE) {
+        printf("Segment at %lld: passive mode failed\n", (long long) segment->offset);
+        if (segment->socket < 0) close(socketA);
+        return NULL;
     }
+    int socketB = createDataSocket(ip, port);
+    if (socketB < 0) {
+        if (segment->socket < 0) close(socketA);
+        return NULL;
+    }
+
+    // Start the transfer at the segment offset
+    int code;
+    if (restartAt(socketA, segment->offset) != SV_PENDING ||
+        ((code = requestResource(socketA, url->resource)) != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT)) {
+        printf("Segment at %lld: restart failed\n", (long long) segment->offset);
+        close(socketB);
+        if (segment->socket < 0) close(socketA);
+        return NULL;
+    }
+
+    // Read only this range and write it in place
+    long long bytes = receiveData(socketB, segment->fd, segment->offset, segment->length);
+    if (bytes > 0) segment->received = bytes;
 
+    // Closing the data connection early aborts the rest of the resource (the server answers 426 or 226)
+    close(socketB);
+    readResponse(socketA, answer);
+
+    if (segment->socket < 0) {
+        write(socketA, "quit\n", 5);
+        close(socketA);
+    }
+
+    if (segment->received == segment->length) segment->status = 0;
+    return NULL;
+}
+
+// Function to get the seconds elapsed since a start time
+static double elapsedSince(double start) {
+    return monotonicSeconds() - start;
+}
+
+// Function to download a resource with the commands pipelined
+int getResourcePipelined(struct URL *url, struct Timings *timings, struct Sha256 *hash) {
+    char answer[MAX_LENGTH], ip[MAX_LENGTH];
+    int port, code;
+    double start = elapsedSince(0);
+
+    memset(timings, 0, sizeof(*timings));
+    timings->size = -1;
+
+    int socketA = createSocket(url->host, url->port);
+    if (socketA < 0) return -1;
+    timings->connect = elapsedSince(start);
+
+    if (readResponse(socketA, answer) != SV_READY4AUTH) goto fail;
+    timings->greeting = elapsedSince(start);
+
+    // The user decides if a password follows (331) or not (230), so it is sent alone
+    char userCommand[MAX_LENGTH + 8];
+    sprintf(userCommand, "user %s\n", url->user);
+    write(socketA, userCommand, strlen(userCommand));
+    int needsPassword = (code = readResponse(socketA, answer)) == SV_READY4PASS;
+    if (!needsPassword && code != SV_LOGINSUCCESS) goto fail;
+    timings->user = elapsedSince(start);
+
+    // PASS, TYPE, SIZE and the passive mode command in one write, the replies come back in order
+    const char *passive = isIPv4(socketA) ? "pasv" : "epsv";
+    char commands[2 * MAX_LENGTH + 32];
+    int length = 0;
+    if (needsPassword) length += sprintf(commands + length, "pass %s\n", url->password);
+    length += sprintf(commands + length, "type I\nsize %s\n%s\n", url->resource, passive);
+    write(socketA, commands, length);
+
+    if (needsPassword && readResponse(socketA, answer) != SV_LOGINSUCCESS) goto fail;
+    if (readResponse(socketA, answer) != SV_COMMAND_OK) goto fail;
+    if (readResponse(socketA, answer) == SV_FILE_STATUS) sscanf(answer, SIZE_REGEX, &timings->size);
+    code = readResponse(socketA, answer);
+    if (parsePassive(socketA, code, answer, ip, &port) != SV_PASSIVE) goto fail;
+    timings->setup = elapsedSince(start);
+
+    // RETR travels while the data connection is being established
+    char fileCommand[MAX_LENGTH + 8];
+    sprintf(fileCommand, "retr %s\n", url->resource);
+    write(socketA, fileCommand, strlen(fileCommand));
+
+    int socketB = createDataSocket(ip, port);
+    if (socketB < 0) goto fail;
+
+    code = readResponse(socketA, answer);
+    if (code != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT) {
+        printf("Unknown resource '%s' (%d)\n", url->resource, code);
+        close(socketB);
+        goto fail;
+    }
+    timings->request = elapsedSince(start);
+
+    // Time to first byte
+    struct pollfd data = {.fd = socketB, .events = POLLIN};
+    while (poll(&data, 1, -1) < 0 && errno == EINTR);
+    timings->firstByte = elapsedSince(start);
+
+    code = getResourceFrom(socketA, socketB, url->file, 0, hash);
+    close(socketB);
+    if (code != SV_TRANSFER_COMPLETE) goto fail;
+    timings->transfer = elapsedSince(start);
+
+    write(socketA, "quit\n", 5);
+    close(socketA);
+    return 0;
+
+fail:
+    close(socketA);
+    return -1;
+}
+
+// Function to get the offset where an interrupted download continues, 0 to download it all again
+static long long resumeOffset(const int socket, struct URL *url, long long *size) {
+    struct stat local;
+    if (stat(url->file, &local) < 0) return 0;
+
+    if (resourceSize(socket, url->resource, size) != SV_FILE_STATUS) {
+        printf("Size of '%s' unknown, downloading it all again\n", url->resource);
+        *size = -1;
+        return 0;
+    }
+    if (local.st_size > *size) {
+        printf("'%s' is larger than '%s', downloading it all again\n", url->file, url->resource);
+        return 0;
+    }
+
+    // A resource modified after the last write to the partial file is not the one it came from
+    time_t mtime;
+    if (resourceTime(socket, url->resource, &mtime) != SV_FILE_STATUS) {
+        printf("Modification time of '%s' unknown, trusting its size\n", url->resource);
+    }
+    else if (mtime > local.st_mtime) {
+        printf("'%s' changed since '%s' was written, downloading it all again\n", url->resource, url->file);
+        return 0;
+    }
+
+    return local.st_size;
+}
+
+// Function to download a resource, continuing the partial local file
+int continueResource(struct URL *url, struct Timings *timings, struct Sha256 *hash) {
+    char answer[MAX_LENGTH], ip[MAX_LENGTH];
     int port;
-    char ip[MAX_LENGTH];
 
-    // Enter passive mode and get data connection details
-    if (passiveMode(socketA, ip, &port) != SV_PASSIVE) {
-        printf("Passive mode failed\n");
-        exit(-1);
+    for (int attempt = 1; attempt <= RESUME_ATTEMPTS; attempt++) {
+        if (attempt > 1) {
+            printf("Transfer interrupted, attempt %d of %d\n", attempt, RESUME_ATTEMPTS);
+            sleep(RESUME_DELAY);
+        }
+
+        // Only the steps of the last attempt are timed
+        double start = elapsedSince(0);
+        memset(timings, 0, sizeof(*timings));
+        timings->size = -1;
+
+        int socketA = createSocket(url->host, url->port);
+        if (socketA < 0) continue;
+        timings->connect = elapsedSince(start);
+
+        if (readResponse(socketA, answer) != SV_READY4AUTH ||
+            authConn(socketA, url->user, url->password) != SV_LOGINSUCCESS ||
+            binaryMode(socketA) != SV_COMMAND_OK) {
+            close(socketA);
+            continue;
+        }
+        timings->user = elapsedSince(start);
+
+        long long size = -1;
+        long long offset = resumeOffset(socketA, url, &size);
+        timings->size = size;
+
+        if (offset > 0 && offset == size) {
+            printf("'%s' is already complete\n", url->file);
+            write(socketA, "quit\n", 5);
+            close(socketA);
+
+            if (hash == NULL) return 0;
+            int fd = open(url->file, O_RDONLY);
+            sha256Init(hash);
+            int result = fd < 0 ? -1 : hashFile(fd, size, hash);
+            if (fd >= 0) close(fd);
+            return result;
+        }
+
+        if (passiveMode(socketA, ip, &port) != SV_PASSIVE) {
+            close(socketA);
+            continue;
+        }
+        timings->setup = elapsedSince(start);
+
+        int socketB = createDataSocket(ip, port);
+        if (socketB < 0) {
+            close(socketA);
+            continue;
+        }
+
+        // Servers without REST send the whole resource
+        if (offset > 0 && restartAt(socketA, offset) != SV_PENDING) {
+            printf("Restart not supported, downloading it all again\n");
+            offset = 0;
+        }
+
+        int code = requestResource(socketA, url->resource);
+        if (code != SV_READY4TRANSFER && code != SV_READY4TRANSFER_ALT) {
+            printf("Unknown resource '%s' (%d)\n", url->resource, code);
+            close(socketB);
+            close(socketA);
+
+            // Only a reply that is not a permanent error is worth another attempt
+            if (code >= 500) return -1;
+            continue;
+        }
+
+        if (offset > 0) printf("Continuing '%s' at byte %lld\n", url->file, offset);
+        timings->request = elapsedSince(start);
+
+        code = getResourceFrom(socketA, socketB, url->file, offset, hash);
+        close(socketB);
+        timings->transfer = elapsedSince(start);
+
+        if (code == SV_TRANSFER_COMPLETE) {
+            write(socketA, "quit\n", 5);
+            readResponse(socketA, answer);
+        }
+        close(socketA);
+
+        // A transfer cut short may still be answered with 226, the size tells
+        struct stat local;
+        if (code == SV_TRANSFER_COMPLETE && (size < 0 || (stat(url->file, &local) == 0 && local.st_size == size))) return 0;
     }
 
-    int socketB = createSocket(ip, port);
+    return -1;
+}
 
-    // Check if data connection is successful
-    if (socketB < 0) {
-        printf("Socket to '%s:%d' failed\n", ip, port);
+// Function to download a resource in parallel byte ranges
+int getResourceParallel(const int socketA, struct URL *url, long long size, int nSegments) {
+    int fd = open(url->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    // Check if file can be opened or created
+    if (fd < 0) {
+        printf("Error opening or creating file '%s'\n", url->file);
         exit(-1);
     }
 
-    // Request the specified resource from the server
-    if (requestResource(socketA, url.resource) != SV_READY4TRANSFER) {
-        printf("Unknown resouce '%s' in '%s:%d'\n", url.resource, ip, port);
-        exit(-1);
+    // Preallocate the whole file, segments are written in place
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate()");
+        close(fd);
+        return -1;
     }
 
-    // Receive the requested resource from the data connection
-    if (getResource(socketA, socketB, url.file) != SV_TRANSFER_COMPLETE) {
-        printf("Error transferring file '%s' from '%s:%d'\n", url.file, ip, port);
-        exit(-1);
+    struct Segment segments[MAX_SEGMENTS];
+    pthread_t threads[MAX_SEGMENTS];
+    long long segmentSize = size / nSegments;
+
+    for (int i = 0; i < nSegments; i++) {
+        segments[i].url = url;
+        segments[i].socket = (i == 0) ? socketA : -1;   // The first segment reuses the main connection
+        segments[i].fd = fd;
+        segments[i].offset = i * segmentSize;
+        segments[i].length = (i == nSegments - 1) ? size - segments[i].offset : segmentSize;
+        segments[i].received = 0;
+        segments[i].status = -1;
+
+        if (pthread_create(&threads[i], NULL, getSegment, &segments[i]) != 0) {
+            perror("pthread_create()");
+            nSegments = i;
+            break;
+        }
     }
 
-    // Close both control and data connections
-    if (closeConnection(socketA, socketB) != 0) {
-        printf("Sockets close error\n");
-        exit(-1);
+    int result = 0;
+    for (int i = 0; i < nSegments; i++) {
+        pthread_join(threads[i], NULL);
+        if (segments[i].status != 0) {
+            printf("Segment %d failed (%lld of %lld bytes)\n", i, (long long) segments[i].received, (long long) segments[i].length);
+            result = -1;
+        }
     }
 
-    return 0;
+    close(fd);
+    return result;
+}
+
+// Function to close both control and data connections
+int closeConnection(const int socketA, const int socketB) {
+    char answer[MAX_LENGTH];
+
+    // Send QUIT command and check the response
+    write(socketA, "quit\n", 5);
+    
+    if(readResponse(socketA, answer) != SV_GOODBYE) return -1;
+
+    // Close both control and data connections
+    return close(socketA) || close(socketB);
 }
@@ -0,0 +1,435 @@
+#include "../include/download.h"
+#include "../include/batch.h"
+
+// What the JSON summary written at exit describes
+static struct Metrics metrics;
+static struct URL summaryUrl;
+static const char *summaryPath = "-";
+
+// Checksum verification
+static unsigned char expectedDigest[SHA256_SIZE];
+static int keepCorrupt;
+
+// Function to write the JSON summary, run at exit so failed downloads are reported too
+static void summaryAtExit() {
+    long long total;
+    double firstByte = progressStop(&metrics.bytes, &total);
+    // The size of the resource, when known, rather than the bytes announced for this transfer (the rest after REST)
+    if (total >= 0 && metrics.size < 0) metrics.size = total;
+    metrics.firstByte = firstByte < 0 ? -1 : firstByte - metrics.start;
+
+    FILE *file = strcmp(summaryPath, "-") == 0 ? stdout : fopen(summaryPath, "w");
+    if (file == NULL) {
+        perror(summaryPath);
+        return;
+    }
+
+    writeSummary(file, &summaryUrl, &metrics);
+    if (file != stdout) fclose(file);
+}
+
+// Compare the digest of the downloaded file with the expected one, deleting (or flagging) the file on a mismatch
+static int checkDigest(const char *file, struct Sha256 *hash) {
+    unsigned char digest[SHA256_SIZE];
+    char hex[SHA256_HEX_SIZE], expected[SHA256_HEX_SIZE];
+
+    sha256Final(hash, digest);
+    sha256ToHex(digest, hex);
+    metrics.checksum = memcmp(digest, expectedDigest, SHA256_SIZE) == 0;
+    if (metrics.checksum) {
+        printf("SHA-256 %s OK\n", hex);
+        return 0;
+    }
+
+    sha256ToHex(expectedDigest, expected);
+    printf("SHA-256 mismatch for '%s': expected %s, got %s\n", file, expected, hex);
+
+    if (keepCorrupt) {
+        char corrupt[MAX_LENGTH + sizeof(CORRUPT_SUFFIX)];
+        snprintf(corrupt, sizeof(corrupt), "%s" CORRUPT_SUFFIX, file);
+        if (rename(file, corrupt) == 0) printf("Kept as '%s'\n", corrupt);
+        else perror(corrupt);
+    }
+    else if (unlink(file) == 0) printf("'%s' deleted\n", file);
+    else perror(file);
+
+    return -1;
+}
+
+// Get the expected digest from the sibling '.sha256' resource on a session of its own
+static void fetchDigestAlone(struct URL *url) {
+    int socket = openSession(url->host, url->port, url->user, url->password);
+    int result = socket < 0 ? -1 : fetchDigest(socket, url->resource, expectedDigest);
+
+    if (socket >= 0) {
+        write(socket, "quit\n", 5);
+        close(socket);
+    }
+    if (result != 0) {
+        printf("Not possible to get the digest of '%s'\n", url->resource);
+        exit(-1);
+    }
+}
+
+// Download every URL of a list (a file or '-' for stdin)
+static int batchMain(const char *urlList, int nTransfers) {
+    struct Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.lock, NULL);
+
+    FILE *input = strcmp(urlList, "-") == 0 ? stdin : fopen(urlList, "r");
+    if (input == NULL) {
+        printf("Error opening URL list '%s'\n", urlList);
+        exit(-1);
+    }
+
+    int added = readUrlList(&batch, input);
+    if (input != stdin) fclose(input);
+    if (added < 0) exit(-1);
+
+    double start = monotonicSeconds();
+    progressStart(-1);
+    int result = runBatch(&batch, nTransfers);
+    metrics.transfer = monotonicSeconds() - start;
+    free(batch.jobs);
+    return result == 0 ? 0 : -1;
+}
+
+// Mirror a remote directory recursively into a local directory with the same name
+static int mirrorMain(char *input, int nTransfers) {
+    // 'ftp://host/dir/' is handled as 'ftp://host/dir'
+    size_t length = strlen(input);
+    while (length > 0 && input[length - 1] == '/') input[--length] = '\0';
+
+    struct URL url;
+    memset(&url, 0, sizeof(url));
+    double start = monotonicSeconds();
+    if (parse(input, &url) != 0) {
+        printf("Parse error. " USAGE);
+        exit(-1);
+    }
+    metrics.dns = monotonicSeconds() - start;
+    summaryUrl = url;
+
+    start = monotonicSeconds();
+    int socketA = openSession(url.host, url.port, url.user, url.password);
+    if (socketA < 0) {
+        printf("Login to '%s' failed\n", url.host);
+        exit(-1);
+    }
+
+    struct Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.lock, NULL);
+
+    metrics.auth = monotonicSeconds() - start;
+
+    int listed = mirrorDirectory(socketA, &url, url.resource, url.file, &batch);
+    write(socketA, "quit\n", 5);
+    close(socketA);
+
+    if (listed != 0) printf("Some directories could not be listed\n");
+
+    start = monotonicSeconds();
+    progressStart(-1);
+    int result = runBatch(&batch, nTransfers);
+    metrics.transfer = monotonicSeconds() - start;
+    free(batch.jobs);
+    return (result == 0 && listed == 0) ? 0 : -1;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    int nSegments = 1, nTransfers = DEFAULT_TRANSFERS, mirror = 0, resume = 0, pipelined = 0;
+    int verify = 0, fetchSibling = 0;
+    char *urlList = NULL;
+    int option;
+
+    metrics.start = monotonicSeconds();
+    metrics.mode = "serial";
+    metrics.size = -1;
+    metrics.status = -1;
+    metrics.checksum = -1;
+
+    static const struct option longOptions[] = {
+        {"continue", no_argument, NULL, 'c'},
+        {"pipeline", no_argument, NULL, 'p'},
+        {"json", required_argument, NULL, 'J'},
+        {"sha256", required_argument, NULL, 'S'},
+        {"verify", no_argument, NULL, 'V'},
+        {"keep-corrupt", no_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Parse options
+    while ((option = getopt_long(argc, argv, "j:i:k:mcp", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'j':
+                nSegments = atoi(optarg);
+                if (nSegments < 1 || nSegments > MAX_SEGMENTS) {
+                    printf("The number of segments must be between 1 and %d\n", MAX_SEGMENTS);
+                    exit(-1);
+                }
+                break;
+            case 'i':
+                urlList = optarg;
+                break;
+            case 'k':
+                nTransfers = atoi(optarg);
+                if (nTransfers < 1 || nTransfers > MAX_TRANSFERS) {
+                    printf("The number of transfers must be between 1 and %d\n", MAX_TRANSFERS);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                mirror = 1;
+                break;
+            case 'c':
+                resume = 1;
+                break;
+            case 'p':
+                pipelined = 1;
+                break;
+            case 'J':
+                summaryPath = optarg;
+                break;
+            case 'S':
+                if (sha256FromHex(optarg, expectedDigest) != 0 || optarg[2 * SHA256_SIZE] != '\0') {
+                    printf("'%s' is not a SHA-256 digest (64 hexadecimal digits)\n", optarg);
+                    exit(-1);
+                }
+                verify = 1;
+                fetchSibling = 0;
+                break;
+            case 'V':
+                if (!verify) fetchSibling = verify = 1;
+                break;
+            case 'K':
+                keepCorrupt = 1;
+                break;
+            default:
+                printf(USAGE);
+                exit(-1);
+        }
+    }
+
+    // Batch mode: many files over persistent sessions
+    if (urlList != NULL) {
+        if (optind != argc || verify) {
+            printf(USAGE);
+            exit(-1);
+        }
+        metrics.mode = "batch";
+        snprintf(summaryUrl.resource, MAX_LENGTH, "%s", urlList);
+        atexit(summaryAtExit);
+
+        metrics.status = batchMain(urlList, nTransfers);
+        return metrics.status;
+    }
+
+    // Check if the correct number of arguments is provided
+    if (optind != argc - 1) {
+        printf(USAGE);
+        exit(-1);
+    }
+
+    atexit(summaryAtExit);
+
+    if (mirror) {
+        if (verify) {
+            printf(USAGE);
+            exit(-1);
+        }
+        metrics.mode = "mirror";
+        metrics.status = mirrorMain(argv[optind], nTransfers);
+        return metrics.status;
+    }
+
+    // Initialize URL structure
+    struct URL url;
+    memset(&url, 0, sizeof(url));
+
+    // Parse the input URL, resolving the host
+    double start = monotonicSeconds();
+    if (parse(argv[optind], &url) != 0) {
+        printf("Parse error. " USAGE);
+        exit(-1);
+    }
+    metrics.dns = monotonicSeconds() - start;
+    summaryUrl = url;
+
+    // Print parsed URL information, the password stays out of the logs
+    printf("Host: %s\nResource: %s\nFile: %s\nUser: %s\nPassword: %s\nIP Address: %s\n",
+           url.host, url.resource, url.file, url.user, "********", url.ip);
+
+    // Hash of the downloaded file, when it is verified
+    struct Sha256 hashState;
+    struct Sha256 *hash = verify ? &hashState : NULL;
+
+    // Latency optimized download: fewer round trips, with the time of every step
+    if (pipelined) {
+        struct Timings timings;
+        metrics.mode = "pipelined";
+        if (fetchSibling) fetchDigestAlone(&url);
+        progressStart(-1);
+
+        int result = getResourcePipelined(&url, &timings, hash);
+
+        // PASS travels with TYPE, SIZE and PASV, so it is counted with them
+        metrics.size = timings.size;
+        metrics.connect = timings.connect;
+        metrics.auth = timings.user - timings.connect;
+        metrics.passive = timings.setup > 0 ? timings.setup - timings.user : 0;
+        metrics.transfer = timings.transfer > 0 ? timings.transfer - timings.setup : 0;
+
+        if (result != 0) {
+            printf("Error transferring file '%s'\n", url.file);
+            exit(-1);
+        }
+
+        double transfer = timings.transfer - timings.firstByte;
+        printf("Connect %.3f ms, greeting %.3f ms, USER %.3f ms, PASS/TYPE/SIZE/PASV %.3f ms, RETR %.3f ms\n",
+               timings.connect * 1e3, (timings.greeting - timings.connect) * 1e3, (timings.user - timings.greeting) * 1e3,
+               (timings.setup - timings.user) * 1e3, (timings.request - timings.setup) * 1e3);
+        printf("Time to first byte %.3f ms, transfer %.3f ms", timings.firstByte * 1e3, transfer * 1e3);
+        if (timings.size >= 0 && transfer > 0) printf(" (%.2f MB/s)", timings.size / transfer / 1e6);
+        printf("\n");
+
+        if (hash != NULL && checkDigest(url.file, hash) != 0) exit(-1);
+        metrics.status = 0;
+        return 0;
+    }
+
+    // Resumed download: continue the partial file, reconnecting as needed
+    if (resume) {
+        metrics.mode = "continue";
+        if (fetchSibling) fetchDigestAlone(&url);
+        progressStart(-1);
+
+        struct Timings timings;
+        start = monotonicSeconds();
+        int result = continueResource(&url, &timings, hash);
+        double total = monotonicSeconds() - start;
+
+        // The steps of the last attempt, the interrupted ones before it are counted with the transfer
+        metrics.size = timings.size;
+        metrics.connect = timings.connect;
+        metrics.auth = timings.user > 0 ? timings.user - timings.connect : 0;
+        metrics.passive = timings.setup > 0 ? timings.setup - timings.user : 0;
+        metrics.transfer = total - (timings.setup > 0 ? timings.setup : timings.user > 0 ? timings.user : timings.connect);
+
+        if (result != 0) {
+            printf("Error transferring file '%s'\n", url.file);
+            exit(-1);
+        }
+        if (hash != NULL && checkDigest(url.file, hash) != 0) exit(-1);
+
+        metrics.status = 0;
+        return 0;
+    }
+
+    char answer[MAX_LENGTH];
+    start = monotonicSeconds();
+    int socketA = createSocket(url.host, url.port);
+    metrics.connect = monotonicSeconds() - start;
+
+    // Check if control connection is successful
+    if (socketA < 0 || readResponse(socketA, answer) != SV_READY4AUTH) {
+        printf("Socket to '%s' and port %d failed\n", url.host, url.port);
+        exit(-1);
+    }
+
+    // Authenticate the connection
+    if (authConn(socketA, url.user, url.password) != SV_LOGINSUCCESS) {
+        printf("Authentication failed with username = '%s'.\n", url.user);
+        exit(-1);
+    }
+    metrics.auth = monotonicSeconds() - start - metrics.connect;
+
+    // The digest comes first, over the same control connection
+    if (fetchSibling && fetchDigest(socketA, url.resource, expectedDigest) != 0) {
+        printf("Not possible to get the digest of '%s'\n", url.resource);
+        exit(-1);
+    }
+
+    // Segmented download: N connections, each fetching one byte range
+    long long size = 0;
+    start = monotonicSeconds();
+    if (nSegments > 1 && binaryMode(socketA) == SV_COMMAND_OK &&
+        resourceSize(socketA, url.resource, &size) == SV_FILE_STATUS && size >= MIN_SEGMENT_SIZE) {
+
+        metrics.mode = "segmented";
+        progressStart(size);
+        int result = getResourceParallel(socketA, &url, size, nSegments);
+        metrics.transfer = monotonicSeconds() - start;
+
+        if (result != 0) {
+            printf("Error transferring file '%s'\n", url.file);
+            exit(-1);
+        }
+
+        write(socketA, "quit\n", 5);
+        close(socketA);
+
+        // Segments arrive out of order, the file is hashed once it is complete
+        if (hash != NULL) {
+            int fd = open(url.file, O_RDONLY);
+            sha256Init(hash);
+            if (fd < 0 || hashFile(fd, size, hash) != 0) {
+                printf("Error reading '%s'\n", url.file);
+                exit(-1);
+            }
+            close(fd);
+            if (checkDigest(url.file, hash) != 0) exit(-1);
+        }
+
+        metrics.status = 0;
+        return 0;
+    }
+
+    int port;
+    char ip[MAX_LENGTH];
+
+    // Enter passive mode and get data connection details
+    if (passiveMode(socketA, ip, &port) != SV_PASSIVE) {
+        printf("Passive mode failed\n");
+        exit(-1);
+    }
+    metrics.passive = monotonicSeconds() - start;
+
+    start = monotonicSeconds();
+    progressStart(-1);
+    int socketB = createDataSocket(ip, port);
+
+    // Check if data connection is successful
+    if (socketB < 0) {
+        printf("Socket to '%s:%d' failed\n", ip, port);
+        exit(-1);
+    }
+
+    // Request the specified resource from the server
+    if (requestResource(socketA, url.resource) != SV_READY4TRANSFER) {
+        printf("Unknown resouce '%s' in '%s:%d'\n", url.resource, ip, port);
+        exit(-1);
+    }
+
+    // Receive the requested resource from the data connection
+    int code = getResourceFrom(socketA, socketB, url.file, 0, hash);
+    metrics.transfer = monotonicSeconds() - start;
+
+    if (code != SV_TRANSFER_COMPLETE) {
+        printf("Error transferring file '%s' from '%s:%d'\n", url.file, ip, port);
+        exit(-1);
+    }
+
+    // Close both control and data connections
+    if (closeConnection(socketA, socketB) != 0) {
+        printf("Sockets close error\n");
+        exit(-1);
+    }
+
+    if (hash != NULL && checkDigest(url.file, hash) != 0) exit(-1);
+
+    metrics.status = 0;
+    return 0;
+}
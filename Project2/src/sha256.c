@@ -0,0 +1,143 @@
+#include "../include/sha256.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+// Round constants, first 32 bits of the fractional parts of the cube roots of the first 64 primes
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Function to hash one 64 byte block
+static void sha256Block(uint32_t *state, const unsigned char *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | (uint32_t) block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        uint32_t choose = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choose + K[i] + w[i];
+        uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Function to start a new hash
+void sha256Init(struct Sha256 *hash) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(hash->state, initial, sizeof(initial));
+    hash->length = 0;
+    hash->used = 0;
+}
+
+// Function to add bytes to the hash
+void sha256Update(struct Sha256 *hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    hash->length += size;
+
+    // Complete the pending block
+    if (hash->used > 0) {
+        size_t copy = 64 - hash->used < size ? 64 - hash->used : size;
+        memcpy(hash->block + hash->used, bytes, copy);
+        hash->used += copy;
+        bytes += copy;
+        size -= copy;
+
+        if (hash->used < 64) return;
+        sha256Block(hash->state, hash->block);
+        hash->used = 0;
+    }
+
+    // Whole blocks straight from the input
+    for (; size >= 64; bytes += 64, size -= 64) sha256Block(hash->state, bytes);
+
+    memcpy(hash->block, bytes, size);
+    hash->used = size;
+}
+
+// Function to finish the hash
+void sha256Final(struct Sha256 *hash, unsigned char *digest) {
+    uint64_t bits = hash->length * 8;
+
+    // Padding: 0x80, zeros up to 56 bytes of the last block, then the length in bits
+    hash->block[hash->used++] = 0x80;
+    if (hash->used > 56) {
+        memset(hash->block + hash->used, 0, 64 - hash->used);
+        sha256Block(hash->state, hash->block);
+        hash->used = 0;
+    }
+    memset(hash->block + hash->used, 0, 56 - hash->used);
+    for (int i = 0; i < 8; i++) hash->block[56 + i] = bits >> (56 - 8 * i);
+    sha256Block(hash->state, hash->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = hash->state[i] >> 24;
+        digest[4 * i + 1] = hash->state[i] >> 16;
+        digest[4 * i + 2] = hash->state[i] >> 8;
+        digest[4 * i + 3] = hash->state[i];
+    }
+}
+
+// Function to write a digest in hexadecimal
+void sha256ToHex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < SHA256_SIZE; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+// Function to read a digest written in hexadecimal
+int sha256FromHex(const char *hex, unsigned char *digest) {
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        if (!isxdigit((unsigned char) hex[2 * i]) || !isxdigit((unsigned char) hex[2 * i + 1])) return -1;
+
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        digest[i] = byte;
+    }
+
+    // The digest must be a whole word
+    char next = hex[2 * SHA256_SIZE];
+    return (next == '\0' || isspace((unsigned char) next)) ? 0 : -1;
+}
@@ -0,0 +1,277 @@
+// Microbenchmark of the link-layer framing primitives.
+// Times stuffData, destuffData, BCC2, stateMachine (per byte and scanning) and full frame encode/decode,
+// with the encode also from a scatter-gather list,
+// over synthetic payloads of several sizes and reports ns/byte and cycles/byte.
+//
+// Usage: ./bin/bench [compressed-sample-file] [repetitions]
+
+#include "macros.h"
+#include "state_machine.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define DEFAULT_SAMPLE "penguin.gif"
+#define DEFAULT_REPETITIONS 20
+#define WARMUP_REPETITIONS 3
+#define MIN_BYTES_PER_RUN (1 << 18)   // Every measurement processes at least 256 KiB
+
+typedef enum {
+    PAYLOAD_RANDOM,
+    PAYLOAD_FLAGS,
+    PAYLOAD_TEXT,
+    PAYLOAD_COMPRESSED,
+    PAYLOAD_COUNT
+} PayloadKind;
+
+static const char *payloadNames[PAYLOAD_COUNT] = {"random", "all-0x7E", "text", "compressed"};
+
+static const int payloadSizes[] = {64, 256, 996, 4096, 65536};
+#define N_SIZES (int)(sizeof(payloadSizes) / sizeof(payloadSizes[0]))
+
+// Shared buffers, sized for the largest payload
+static unsigned char payload[65536];
+static unsigned char stuffed[2 * 65536 + 16];
+static unsigned char destuffed[2 * 65536 + 16];
+static unsigned char frame[2 * 65536 + 16];
+
+// Keeps results alive so the compiler can not drop the measured calls
+static volatile unsigned long sink;
+
+static double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long long nowCycles() {
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void fillPayload(PayloadKind kind, unsigned char *buf, int size, const unsigned char *sample, long sampleSize) {
+    static const char text[] =
+        "The quick brown fox jumps over the lazy dog. "
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+
+    switch (kind) {
+        case PAYLOAD_RANDOM:
+            for (int i = 0; i < size; i++) {
+                buf[i] = rand() & 0xFF;
+            }
+            break;
+        case PAYLOAD_FLAGS:
+            memset(buf, FLAG, size);
+            break;
+        case PAYLOAD_TEXT:
+            for (int i = 0; i < size; i++) {
+                buf[i] = text[i % (sizeof(text) - 1)];
+            }
+            break;
+        case PAYLOAD_COMPRESSED:
+            for (int i = 0; i < size; i++) {
+                buf[i] = sample[i % sampleSize];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Each primitive is wrapped so the timing loop is the same for all of them
+typedef void (*BenchFn)(int size);
+
+static int stuffedSize;
+static int frameSize;
+
+static void benchStuff(int size) {
+    sink += stuffData(payload, size, stuffed);
+}
+
+static void benchDestuff(int size) {
+    sink += destuffData(stuffed, stuffedSize, destuffed);
+}
+
+static void benchBCC2(int size) {
+    sink += BCC2(payload, size);
+}
+
+static void benchStateMachine(int size) {
+    StateMachine sm;
+    stateMachineReset(&sm);
+    for (int i = 0; i < frameSize; i++) {
+        stateMachineStep(&sm, frame[i]);
+    }
+    sink += sm.state;
+}
+
+static void benchStateMachineScan(int size) {
+    StateMachine sm;
+    stateMachineReset(&sm);
+    sink += stateMachineScan(&sm, frame, frameSize);
+}
+
+static void benchEncode(int size) {
+    sink += encodeFrame(A_T, C_INF0, payload, size, frame);
+}
+
+static void benchEncodeV(int size) {
+    // A data packet as the application sends it: the 4 byte header and the data in separate buffers
+    struct iovec iov[2] = {
+        {.iov_base = payload, .iov_len = 4},
+        {.iov_base = payload + 4, .iov_len = size - 4}
+    };
+    sink += encodeFrameV(A_T, C_INF0, iov, 2, frame);
+}
+
+static void benchDecode(int size) {
+    // Same steps as readFrame + llread: delimit the frame, destuff, check BCC2
+    StateMachine sm;
+    stateMachineReset(&sm);
+    int i = stateMachineScan(&sm, frame, frameSize);
+    int dataSize = destuffData(frame + 4, i - 5, destuffed);
+    sink += (destuffed[dataSize - 1] == BCC2(destuffed, dataSize - 1));
+}
+
+typedef struct {
+    const char *name;
+    BenchFn fn;
+    int onFrame; // TRUE if the bytes processed are the framed bytes instead of the payload
+} Bench;
+
+static const Bench benches[] = {
+    {"stuffData", benchStuff, FALSE},
+    {"destuffData", benchDestuff, TRUE},
+    {"BCC2", benchBCC2, FALSE},
+    {"stateMachine", benchStateMachine, TRUE},
+    {"smScan", benchStateMachineScan, TRUE},
+    {"encodeFrame", benchEncode, FALSE},
+    {"encodeFrameV", benchEncodeV, FALSE},
+    {"decodeFrame", benchDecode, TRUE},
+};
+#define N_BENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+static void runBench(const Bench *bench, PayloadKind kind, int size, int repetitions) {
+    int bytes = size;
+    if (bench->fn == benchDestuff) {
+        bytes = stuffedSize;
+    }
+    else if (bench->onFrame) {
+        bytes = frameSize;
+    }
+
+    // Repeat the call enough times for a measurement to be well above the timer resolution
+    int inner = MIN_BYTES_PER_RUN / bytes + 1;
+
+    for (int r = 0; r < WARMUP_REPETITIONS; r++) {
+        for (int i = 0; i < inner; i++) {
+            bench->fn(size);
+        }
+    }
+
+    double bestNs = 0;
+    unsigned long long bestCycles = 0;
+    for (int r = 0; r < repetitions; r++) {
+        double startNs = nowNs();
+        unsigned long long startCycles = nowCycles();
+        for (int i = 0; i < inner; i++) {
+            bench->fn(size);
+        }
+        unsigned long long cycles = nowCycles() - startCycles;
+        double ns = nowNs() - startNs;
+
+        // Keep the best run, which is the one least disturbed by the rest of the system
+        if (r == 0 || ns < bestNs) {
+            bestNs = ns;
+            bestCycles = cycles;
+        }
+    }
+
+    double totalBytes = (double)bytes * inner;
+    printf("  %-13s %-11s %6d  %10.3f  ", bench->name, payloadNames[kind], size, bestNs / totalBytes);
+    if (HAVE_TSC) {
+        printf("%11.3f  ", (double)bestCycles / totalBytes);
+    }
+    else {
+        printf("%11s  ", "n/a");
+    }
+    printf("%10.1f\n", totalBytes / bestNs * 1e3);
+}
+
+static unsigned char *loadSample(const char *filename, long *sampleSize) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *sample = malloc(size > 0 ? size : 1);
+    if (sample == NULL || size <= 0 || fread(sample, 1, size, file) != (size_t)size) {
+        free(sample);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *sampleSize = size;
+    return sample;
+}
+
+int main(int argc, char *argv[]) {
+    const char *sampleFile = argc > 1 ? argv[1] : DEFAULT_SAMPLE;
+    int repetitions = argc > 2 ? atoi(argv[2]) : DEFAULT_REPETITIONS;
+    if (repetitions <= 0) {
+        repetitions = DEFAULT_REPETITIONS;
+    }
+
+    // Already compressed data (the GIF is LZW) stands in for a typical binary transfer
+    long sampleSize = 0;
+    unsigned char *sample = loadSample(sampleFile, &sampleSize);
+    if (sample == NULL) {
+        printf("Warning - Not possible to read '%s', compressed payload will be skipped\n", sampleFile);
+    }
+
+    srand(42);
+
+    printf("Framing microbenchmark (%d repetitions, %d warmup, best run reported)\n\n", repetitions, WARMUP_REPETITIONS);
+    printf("  %-13s %-11s %6s  %10s  %11s  %10s\n", "primitive", "payload", "size", "ns/byte", "cycles/byte", "MB/s");
+
+    for (int k = 0; k < PAYLOAD_COUNT; k++) {
+        if (k == PAYLOAD_COMPRESSED && sample == NULL) {
+            continue;
+        }
+
+        for (int s = 0; s < N_SIZES; s++) {
+            int size = payloadSizes[s];
+            fillPayload(k, payload, size, sample, sampleSize);
+
+            // Prepare the inputs of destuffData, stateMachine and decodeFrame
+            stuffedSize = stuffData(payload, size, stuffed);
+            frameSize = encodeFrame(A_T, C_INF0, payload, size, frame);
+
+            for (int b = 0; b < N_BENCHES; b++) {
+                runBench(&benches[b], k, size, repetitions);
+            }
+        }
+        printf("\n");
+    }
+
+    free(sample);
+    return 0;
+}
@@ -0,0 +1,524 @@
+// Benchmark of the link layer over an emulated noisy serial line.
+// Two pseudo terminals are joined by a channel that flips bits at a given bit error rate (BER),
+// limits the throughput to a baudrate and adds a propagation delay. A transmitter and a receiver
+// thread move the same data with plain stop-and-wait ARQ and with FEC groups, for several BERs.
+// A full-duplex run then moves the same data both ways at once, over one session.
+//
+// Usage: ./bin/link_bench [-n packets] [-b baudrate] [-d delay-ms] [-k fec-group] [ber ...]
+
+#define _GNU_SOURCE
+
+#include "link_layer.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PACKETS 32
+#define DEFAULT_BAUDRATE 230400
+#define DEFAULT_DELAY_MS 50
+#define DEFAULT_FEC_GROUP 4
+
+static const double defaultBers[] = {0, 1e-5, 3e-5, 1e-4};
+#define N_DEFAULT_BERS (int)(sizeof(defaultBers) / sizeof(defaultBers[0]))
+#define MAX_BERS 16
+
+#define LINK_TIMEOUT 1          // Seconds, the smallest time out of the link layer
+#define LINK_RETRANSMISSIONS 30
+#define CHUNK_SIZE 256          // Bytes the channel moves at once
+#define START_DELAY_US 100000   // The receiver opens its port first
+#define JOIN_POLL_US 10000      // Period to check whether an end failed
+
+// Modes compared for each BER
+#define MODE_ARQ 0
+#define MODE_FEC 1
+#define MODE_DUPLEX 2
+#define N_MODES 3
+
+// Bytes on their way through one direction of the channel
+typedef struct Chunk {
+    struct Chunk *next;
+    double due;                 // Time the last byte reaches the other end
+    int size;
+    unsigned char data[CHUNK_SIZE];
+} Chunk;
+
+typedef struct {
+    int from;                   // Master side of the sending pseudo terminal
+    int to;                     // Master side of the receiving pseudo terminal
+    double lineFree;            // Time the line is done sending what was queued
+    long bitsToError;           // Bits left before the next flipped one
+    long flipped;
+    Chunk *head;
+    Chunk *tail;
+} Direction;
+
+typedef struct {
+    Direction directions[2];
+    double ber;
+    int baudRate;
+    double delay;
+    volatile int stop;
+} Channel;
+
+// One end of a transfer
+typedef struct {
+    LinkLayer layer;
+    unsigned char *data;
+    unsigned char *received;    // Full-duplex: data received from the other end
+    int packets;
+    int result;
+    double seconds;
+    LinkStatistics stats;
+    volatile int done;
+} Endpoint;
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bits until the next error, geometrically distributed
+static long nextError(double ber) {
+    if (ber <= 0) {
+        return LONG_MAX / 2;
+    }
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return (long)(log(u) / log1p(-ber));
+}
+
+// Flips the bits of the chunk that the BER says are received wrong
+static void addNoise(Channel *channel, Direction *direction, Chunk *chunk) {
+    long bits = 8L * chunk->size;
+    long position = direction->bitsToError;
+
+    while (position < bits) {
+        chunk->data[position / 8] ^= 1 << (position % 8);
+        direction->flipped++;
+        position += 1 + nextError(channel->ber);
+    }
+    direction->bitsToError = position - bits;
+}
+
+// Moves bytes between the two pseudo terminals until stopped
+static void *channelThread(void *arg) {
+    Channel *channel = (Channel *)arg;
+    double byteTime = 10.0 / channel->baudRate;    // Start, 8 data and stop bits
+
+    while (!channel->stop) {
+        double now = nowSeconds();
+
+        // Wake up for the next chunk due, or every 10 ms to check stop
+        int timeout = 10;
+        for (int d = 0; d < 2; d++) {
+            Chunk *head = channel->directions[d].head;
+            if (head != NULL) {
+                int ms = (int)((head->due - now) * 1000);
+                if (ms < timeout) {
+                    timeout = ms > 0 ? ms : 0;
+                }
+            }
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = channel->directions[0].from, .events = POLLIN},
+            {.fd = channel->directions[1].from, .events = POLLIN},
+        };
+        poll(fds, 2, timeout);
+        now = nowSeconds();
+
+        for (int d = 0; d < 2; d++) {
+            Direction *direction = &channel->directions[d];
+
+            if (fds[d].revents & POLLIN) {
+                Chunk *chunk = malloc(sizeof(Chunk));
+                if (chunk != NULL) {
+                    chunk->size = read(direction->from, chunk->data, CHUNK_SIZE);
+                }
+                if (chunk != NULL && chunk->size > 0) {
+                    addNoise(channel, direction, chunk);
+
+                    // Serialized after what is already on the line, then delayed
+                    double start = direction->lineFree > now ? direction->lineFree : now;
+                    direction->lineFree = start + chunk->size * byteTime;
+                    chunk->due = direction->lineFree + channel->delay;
+                    chunk->next = NULL;
+
+                    if (direction->tail != NULL) {
+                        direction->tail->next = chunk;
+                    }
+                    else {
+                        direction->head = chunk;
+                    }
+                    direction->tail = chunk;
+                }
+                else {
+                    free(chunk);
+                }
+            }
+
+            // Deliver what arrived
+            while (direction->head != NULL && direction->head->due <= now) {
+                Chunk *chunk = direction->head;
+                if (write(direction->to, chunk->data, chunk->size) != chunk->size) {
+                    perror("Channel write");
+                }
+                direction->head = chunk->next;
+                if (direction->head == NULL) {
+                    direction->tail = NULL;
+                }
+                free(chunk);
+            }
+        }
+    }
+
+    for (int d = 0; d < 2; d++) {
+        while (channel->directions[d].head != NULL) {
+            Chunk *chunk = channel->directions[d].head;
+            channel->directions[d].head = chunk->next;
+            free(chunk);
+        }
+    }
+    return NULL;
+}
+
+// Opens a pseudo terminal, returning its master side and the raw slave kept open (so its settings stay)
+static int openPseudoTerminal(char *slaveName, int size, int *slave) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, slaveName, size) != 0) {
+        perror("Pseudo terminal");
+        return -1;
+    }
+
+    *slave = open(slaveName, O_RDWR | O_NOCTTY);
+    if (*slave < 0) {
+        perror(slaveName);
+        close(master);
+        return -1;
+    }
+
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+
+    return master;
+}
+
+static void *transmitterThread(void *arg) {
+    Endpoint *endpoint = (Endpoint *)arg;
+    double start = nowSeconds();
+    endpoint->result = -1;
+
+    LinkConnection *link = ll_open(endpoint->layer);
+    if (link == NULL) {
+        endpoint->done = TRUE;
+        return NULL;
+    }
+
+    endpoint->result = 0;
+    for (int i = 0; i < endpoint->packets; i++) {
+        if (ll_write(link, endpoint->data + i * MAX_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE) == -1) {
+            endpoint->result = -1;
+            break;
+        }
+    }
+
+    ll_statistics(link, &endpoint->stats);
+    if (ll_close(link, FALSE) == -1) {
+        endpoint->result = -1;
+    }
+    endpoint->seconds = nowSeconds() - start;
+    endpoint->done = TRUE;
+    return NULL;
+}
+
+static void *receiverThread(void *arg) {
+    Endpoint *endpoint = (Endpoint *)arg;
+    endpoint->result = -1;
+
+    LinkConnection *link = ll_open(endpoint->layer);
+    if (link == NULL) {
+        endpoint->done = TRUE;
+        return NULL;
+    }
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    long received = 0, total = (long)endpoint->packets * MAX_PAYLOAD_SIZE;
+
+    while (received < total) {
+        int size = ll_read(link, packet);
+        if (size == -1 || received + size > total) {
+            break;
+        }
+        memcpy(endpoint->data + received, packet, size);
+        received += size;
+    }
+
+    ll_statistics(link, &endpoint->stats);
+    ll_close(link, FALSE);
+    endpoint->result = received == total ? 0 : -1;
+    endpoint->done = TRUE;
+    return NULL;
+}
+
+// Full-duplex end: sends one packet, reads those received meanwhile, and once all were sent waits for the rest
+static void *duplexThread(void *arg) {
+    Endpoint *endpoint = (Endpoint *)arg;
+    double start = nowSeconds();
+    endpoint->result = -1;
+
+    LinkConnection *link = ll_open(endpoint->layer);
+    if (link == NULL) {
+        endpoint->done = TRUE;
+        return NULL;
+    }
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    long received = 0, total = (long)endpoint->packets * MAX_PAYLOAD_SIZE;
+    int sent = 0, failed = FALSE;
+
+    while (!failed && (sent < endpoint->packets || received < total)) {
+        if (sent < endpoint->packets) {
+            if (ll_write(link, endpoint->data + sent * MAX_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE) == -1) {
+                failed = TRUE;
+                break;
+            }
+            sent++;
+        }
+
+        while (received < total && (ll_pending(link) > 0 || sent == endpoint->packets)) {
+            int size = ll_read(link, packet);
+            if (size == -1 || received + size > total) {
+                failed = TRUE;
+                break;
+            }
+            memcpy(endpoint->received + received, packet, size);
+            received += size;
+        }
+    }
+
+    ll_statistics(link, &endpoint->stats);
+    if (ll_close(link, FALSE) == -1) {
+        failed = TRUE;
+    }
+    endpoint->seconds = nowSeconds() - start;
+    endpoint->result = failed ? -1 : 0;
+    endpoint->done = TRUE;
+    return NULL;
+}
+
+// Runs one transfer. Returns 0 if every byte arrived intact, 1 if some arrived corrupted
+// (errors the XOR BCC2 can not detect, like two flipped bits in the same column) or -1 if it failed
+static int runTransfer(Channel *channel, int mode, int fecGroup, int packets, const unsigned char *data, Endpoint *tx, Endpoint *rx) {
+    char names[2][sizeof(tx->layer.serialPort)];
+    int masters[2], slaves[2];
+
+    for (int i = 0; i < 2; i++) {
+        masters[i] = openPseudoTerminal(names[i], sizeof(names[i]), &slaves[i]);
+        if (masters[i] < 0) {
+            return -1;
+        }
+    }
+
+    memset(&channel->directions, 0, sizeof(channel->directions));
+    for (int d = 0; d < 2; d++) {
+        channel->directions[d].from = masters[d];
+        channel->directions[d].to = masters[1 - d];
+        channel->directions[d].bitsToError = nextError(channel->ber);
+    }
+    channel->stop = FALSE;
+
+    LinkLayer layer = {.baudRate = 38400, .nRetransmissions = LINK_RETRANSMISSIONS, .timeout = LINK_TIMEOUT,
+                       .fecGroup = mode == MODE_FEC ? fecGroup : 0, .duplex = mode == MODE_DUPLEX};
+
+    memset(tx, 0, sizeof(*tx));
+    tx->layer = layer;
+    tx->layer.role = LlTx;
+    snprintf(tx->layer.serialPort, sizeof(tx->layer.serialPort), "%s", names[0]);
+    tx->data = (unsigned char *)data;
+    tx->packets = packets;
+
+    memset(rx, 0, sizeof(*rx));
+    rx->layer = layer;
+    rx->layer.role = LlRx;
+    snprintf(rx->layer.serialPort, sizeof(rx->layer.serialPort), "%s", names[1]);
+    rx->data = calloc(packets, MAX_PAYLOAD_SIZE);
+    rx->packets = packets;
+
+    // Full-duplex: both ends send the same data and receive it from the other
+    if (mode == MODE_DUPLEX) {
+        memcpy(rx->data, data, (size_t)packets * MAX_PAYLOAD_SIZE);
+        tx->received = calloc(packets, MAX_PAYLOAD_SIZE);
+        rx->received = calloc(packets, MAX_PAYLOAD_SIZE);
+    }
+
+    pthread_t channelId, txId, rxId;
+    pthread_create(&channelId, NULL, channelThread, channel);
+    pthread_create(&rxId, NULL, mode == MODE_DUPLEX ? duplexThread : receiverThread, rx);
+    usleep(START_DELAY_US);
+    pthread_create(&txId, NULL, mode == MODE_DUPLEX ? duplexThread : transmitterThread, tx);
+
+    // Once an end failed, the other one may be blocked waiting for frames that will not come
+    while (!tx->done || !rx->done) {
+        if ((tx->done && tx->result != 0) || (rx->done && rx->result != 0)) {
+            if (!tx->done) {
+                pthread_cancel(txId);
+            }
+            if (!rx->done) {
+                pthread_cancel(rxId);
+            }
+            break;
+        }
+        usleep(JOIN_POLL_US);
+    }
+    pthread_join(txId, NULL);
+    pthread_join(rxId, NULL);
+
+    channel->stop = TRUE;
+    pthread_join(channelId, NULL);
+
+    int result = -1;
+    size_t size = (size_t)packets * MAX_PAYLOAD_SIZE;
+    if (tx->result == 0 && rx->result == 0 && mode == MODE_DUPLEX) {
+        result = memcmp(tx->received, data, size) == 0 && memcmp(rx->received, data, size) == 0 ? 0 : 1;
+    }
+    else if (tx->result == 0 && rx->result == 0) {
+        result = memcmp(rx->data, data, size) == 0 ? 0 : 1;
+    }
+
+    free(rx->data);
+    free(tx->received);
+    free(rx->received);
+    for (int i = 0; i < 2; i++) {
+        close(slaves[i]);
+        close(masters[i]);
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int packets = DEFAULT_PACKETS, fecGroup = DEFAULT_FEC_GROUP, option;
+    Channel channel = {.baudRate = DEFAULT_BAUDRATE, .delay = DEFAULT_DELAY_MS / 1e3};
+
+    while ((option = getopt(argc, argv, "n:b:d:k:")) != -1) {
+        switch (option) {
+            case 'n':
+                packets = atoi(optarg);
+                break;
+            case 'b':
+                channel.baudRate = atoi(optarg);
+                break;
+            case 'd':
+                channel.delay = atof(optarg) / 1e3;
+                break;
+            case 'k':
+                fecGroup = atoi(optarg);
+                break;
+            default:
+                packets = 0;
+                break;
+        }
+    }
+
+    if (packets <= 0 || channel.baudRate <= 0 || channel.delay < 0 || fecGroup < 1 || fecGroup > MAX_FEC_GROUP) {
+        printf("Usage: %s [-n packets] [-b baudrate] [-d delay-ms] [-k fec-group (1-%d)] [ber ...]\n", argv[0], MAX_FEC_GROUP);
+        return 1;
+    }
+
+    double bers[MAX_BERS];
+    int nBers = 0;
+    for (int i = optind; i < argc && nBers < MAX_BERS; i++) {
+        bers[nBers++] = atof(argv[i]);
+    }
+    if (nBers == 0) {
+        memcpy(bers, defaultBers, sizeof(defaultBers));
+        nBers = N_DEFAULT_BERS;
+    }
+
+    srand(42);
+    unsigned char *data = malloc((size_t)packets * MAX_PAYLOAD_SIZE);
+    for (long i = 0; i < (long)packets * MAX_PAYLOAD_SIZE; i++) {
+        data[i] = rand() & 0xFF;
+    }
+
+    // The link layer reports every frame error on stdout, the table is printed once the runs are over
+    fflush(stdout);
+    int console = dup(STDOUT_FILENO);
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        return 1;
+    }
+
+    typedef struct {
+        double ber;
+        int mode;
+        int result;
+        Endpoint tx, rx;
+        long flipped;
+    } Run;
+    Run runs[N_MODES * MAX_BERS];
+    int nRuns = 0;
+    const char *modeNames[N_MODES] = {"ARQ", "FEC", "full-duplex"};
+
+    for (int b = 0; b < nBers; b++) {
+        for (int mode = 0; mode < N_MODES; mode++) {
+            Run *run = &runs[nRuns++];
+            run->ber = bers[b];
+            run->mode = mode;
+
+            fprintf(stderr, "BER %g, %s...\n", run->ber, modeNames[mode]);
+            channel.ber = run->ber;
+            srand(1000 + b);    // Same noise pattern for every mode
+            run->result = runTransfer(&channel, mode, fecGroup, packets, data, &run->tx, &run->rx);
+            run->flipped = channel.directions[0].flipped + channel.directions[1].flipped;
+        }
+    }
+
+    fflush(stdout);
+    dup2(console, STDOUT_FILENO);
+    close(console);
+
+    printf("Link layer benchmark: %d packets of %d bytes, %d baud, %.0f ms delay, %d s time out\n\n",
+           packets, MAX_PAYLOAD_SIZE, channel.baudRate, channel.delay * 1e3, LINK_TIMEOUT);
+    printf("  %-8s %-11s %9s %12s %8s %8s %8s %8s %8s\n",
+           "BER", "mode", "time (s)", "goodput B/s", "frames", "retrans", "timeouts", "rebuilt", "flipped");
+
+    // Counters of both ends, the receiver sends I frames too in full-duplex mode
+    for (int r = 0; r < nRuns; r++) {
+        Run *run = &runs[r];
+        char mode[16];
+        if (run->mode == MODE_FEC) {
+            snprintf(mode, sizeof(mode), "FEC k=%d", fecGroup);
+        }
+        else {
+            snprintf(mode, sizeof(mode), "%s", modeNames[run->mode]);
+        }
+
+        if (run->result == -1) {
+            printf("  %-8g %-11s %9s\n", run->ber, mode, "failed");
+            continue;
+        }
+
+        LinkStatistics *tx = &run->tx.stats, *rx = &run->rx.stats;
+        long bytes = (long)packets * MAX_PAYLOAD_SIZE * (run->mode == MODE_DUPLEX ? 2 : 1);
+        printf("  %-8g %-11s %9.2f %12.0f %8ld %8ld %8ld %8ld %8ld\n",
+               run->ber, mode, run->tx.seconds, bytes / run->tx.seconds,
+               tx->framesSent + tx->paritySent + rx->framesSent, tx->retransmissions + rx->retransmissions,
+               tx->timeouts + rx->timeouts, rx->rebuilt, run->flipped);
+        if (run->result == 1) {
+            printf("  %-8s %-11s %9s\n", "", "", "(corrupted data delivered)");
+        }
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,376 @@
+// Receiver gateway daemon.
+// Serves inbound link sessions on many serial ports at once from a single epoll loop,
+// writing every received file into a spool directory and reporting per-port throughput
+// into a statistics file.
+//
+// Usage: ./bin/gateway <spool-dir> <stats-file> /dev/ttySxx [/dev/ttySyy ...]
+
+#include "link_layer.h"
+#include "packet.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BAUDRATE 9600
+#define N_TRIES 3
+#define TIMEOUT 4
+
+#define MAX_PORTS 64
+#define STATS_INTERVAL 1.0     // Seconds between statistics reports
+#define TRACE_ENV "LL_TRACE"    // File the trace of the link layer and spool writes is dumped to, on exit or SIGUSR1
+
+typedef struct {
+    LinkConnection *link;
+    char serialPort[50];
+    int failed;                 // TRUE after an unrecoverable serial port error
+
+    // Current transfer
+    int fileFd;                 // -1 if no file is being received
+    char partPath[PATH_MAX];    // File while it is being received
+    char filePath[PATH_MAX];    // File once complete
+
+    // Statistics
+    long sessions;
+    long files;
+    long long totalBytes;
+    long long intervalBytes;    // Bytes received since the last report
+    double activeTime;          // Seconds spent in open sessions (closed ones)
+    double sessionStart;
+    int inSession;
+} Port;
+
+static volatile sig_atomic_t running = TRUE;
+
+static void stopHandler(int signal) {
+    running = FALSE;
+}
+
+static double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keeps only the last path component of a received file name, so it can not escape the spool
+static int sanitizeFilename(const unsigned char *name, int length, char *out, int outSize) {
+    int start = 0;
+    for (int i = 0; i < length; i++) {
+        if (name[i] == '/') {
+            start = i + 1;
+        }
+    }
+
+    int size = length - start;
+    if (size <= 0 || size >= outSize) {
+        return -1;
+    }
+    memcpy(out, name + start, size);
+    out[size] = '\0';
+
+    if (strcmp(out, ".") == 0 || strcmp(out, "..") == 0 || strchr(out, '\0') != out + size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void abortTransfer(Port *port) {
+    if (port->fileFd != -1) {
+        printf("[%s] Transfer of '%s' incomplete, kept as '%s'\n", port->serialPort, port->filePath, port->partPath);
+        close(port->fileFd);
+        port->fileFd = -1;
+    }
+}
+
+static void startTransfer(Port *port, const char *spool, const unsigned char *packet, int size) {
+    abortTransfer(port);
+
+    // Find the file name parameter
+    char name[NAME_MAX + 1] = "";
+    int i = 1;
+    while (i + 2 <= size) {
+        int type = packet[i];
+        int length = packet[i + 1];
+        if (i + 2 + length > size) {
+            break;
+        }
+        if (type == FILE_NAME && sanitizeFilename(&packet[i + 2], length, name, sizeof(name)) == -1) {
+            name[0] = '\0';
+        }
+        i += 2 + length;
+    }
+
+    if (name[0] == '\0') {
+        printf("[%s] Error - Starting packet without a valid file name\n", port->serialPort);
+        return;
+    }
+
+    snprintf(port->filePath, sizeof(port->filePath), "%s/%s", spool, name);
+    snprintf(port->partPath, sizeof(port->partPath), "%s/.%s.part", spool, name);
+
+    port->fileFd = open(port->partPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (port->fileFd == -1) {
+        perror(port->partPath);
+        return;
+    }
+    printf("[%s] Receiving '%s'\n", port->serialPort, port->filePath);
+}
+
+static void endTransfer(Port *port) {
+    if (port->fileFd == -1) {
+        return;
+    }
+
+    close(port->fileFd);
+    port->fileFd = -1;
+
+    if (rename(port->partPath, port->filePath) == -1) {
+        perror(port->filePath);
+        return;
+    }
+    port->files++;
+    printf("[%s] Received '%s' ✓\n", port->serialPort, port->filePath);
+}
+
+static void handlePacket(Port *port, const char *spool, const unsigned char *packet, int size) {
+    switch (packet[0]) {
+        case STARTING_PACKET:
+            startTransfer(port, spool, packet, size);
+            break;
+
+        case MIDDLE_PACKET:
+            if (port->fileFd != -1 && size >= 4) {
+                traceBegin(TRACE_DISK_WRITE, ll_fd(port->link), size - 4);
+                ssize_t written = write(port->fileFd, &packet[4], size - 4);
+                traceEnd(TRACE_DISK_WRITE, ll_fd(port->link), 0);
+                if (written != size - 4) {
+                    perror(port->partPath);
+                    abortTransfer(port);
+                }
+            }
+            break;
+
+        case ENDING_PACKET:
+            endTransfer(port);
+            break;
+
+        case MESSAGE_PACKET:
+            // Telemetry sent between the packets of the file, logged as is
+            if (size >= MESSAGE_HEADER_SIZE && ((packet[2] << 8) | packet[3]) == size - MESSAGE_HEADER_SIZE) {
+                printf("[%s] Channel %d: %.*s\n", port->serialPort, packet[1], size - MESSAGE_HEADER_SIZE, (const char *)&packet[MESSAGE_HEADER_SIZE]);
+            }
+            break;
+
+        default:
+            // Stripe packets belong to bonded transfers, which need all their links in one receiver
+            printf("[%s] Error - Unsupported packet 0x%02x\n", port->serialPort, packet[0]);
+            break;
+    }
+}
+
+static void handleEvents(Port *port, const char *spool) {
+    unsigned char packet[MAX_PAYLOAD_SIZE + 4];
+    int size;
+
+    while (TRUE) {
+        LinkEvent event = ll_poll(port->link, packet, &size);
+
+        switch (event) {
+            case LlEventNone:
+                return;
+
+            case LlEventOpen:
+                port->sessions++;
+                port->inSession = TRUE;
+                port->sessionStart = monotonicSeconds();
+                printf("[%s] Connection established ✓\n", port->serialPort);
+                break;
+
+            case LlEventData:
+                port->totalBytes += size;
+                port->intervalBytes += size;
+                handlePacket(port, spool, packet, size);
+                break;
+
+            case LlEventClose:
+                abortTransfer(port);
+                if (port->inSession) {
+                    port->activeTime += monotonicSeconds() - port->sessionStart;
+                    port->inSession = FALSE;
+                }
+                printf("[%s] Connection Closed ✓\n", port->serialPort);
+                break;
+
+            case LlEventError:
+                printf("[%s] Error - Serial port failed, no longer served\n", port->serialPort);
+                abortTransfer(port);
+                port->failed = TRUE;
+                return;
+        }
+    }
+}
+
+// Writes the statistics of every port, replacing the file atomically
+static void writeStats(const char *statsFile, Port *ports, int nPorts, double interval) {
+    char tmpFile[PATH_MAX];
+    snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", statsFile);
+
+    FILE *file = fopen(tmpFile, "w");
+    if (file == NULL) {
+        perror(tmpFile);
+        return;
+    }
+
+    double now = monotonicSeconds();
+    fprintf(file, "%-20s %-10s %8s %8s %14s %14s %14s\n",
+            "port", "state", "sessions", "files", "bytes", "rate(B/s)", "avg-rate(B/s)");
+
+    for (int i = 0; i < nPorts; i++) {
+        Port *port = &ports[i];
+
+        double active = port->activeTime + (port->inSession ? now - port->sessionStart : 0);
+        const char *state = port->failed ? "failed" : (port->inSession ? "session" : "idle");
+
+        fprintf(file, "%-20s %-10s %8ld %8ld %14lld %14.1f %14.1f\n",
+                port->serialPort, state, port->sessions, port->files, port->totalBytes,
+                port->intervalBytes / interval, active > 0 ? port->totalBytes / active : 0.0);
+
+        port->intervalBytes = 0;
+    }
+
+    fclose(file);
+    if (rename(tmpFile, statsFile) == -1) {
+        perror(statsFile);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <spool-dir> <stats-file> /dev/ttySxx [/dev/ttySyy ...]\n", argv[0]);
+        exit(1);
+    }
+
+    // Line buffered log, also when redirected to a file
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    const char *spool = argv[1];
+    const char *statsFile = argv[2];
+    int nPorts = argc - 3;
+
+    if (nPorts > MAX_PORTS) {
+        printf("Error - At most %d serial ports\n", MAX_PORTS);
+        exit(1);
+    }
+
+    if (mkdir(spool, 0755) == -1 && errno != EEXIST) {
+        perror(spool);
+        exit(1);
+    }
+
+    // Stop cleanly on SIGINT / SIGTERM (no SA_RESTART, so epoll_wait returns)
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopHandler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    const char *traceFilename = getenv(TRACE_ENV);
+    if (traceFilename != NULL && traceStart(traceFilename) == -1) {
+        printf("Error - Not possible to start tracing to %s\n", traceFilename);
+    }
+
+    int epollFd = epoll_create1(0);
+    if (epollFd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    Port *ports = calloc(nPorts, sizeof(Port));
+    if (ports == NULL) {
+        printf("Error - Not possible to allocate ports\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < nPorts; i++) {
+        Port *port = &ports[i];
+        snprintf(port->serialPort, sizeof(port->serialPort), "%s", argv[3 + i]);
+        port->fileFd = -1;
+
+        LinkLayer layer;
+        memset(&layer, 0, sizeof(layer));
+        sprintf(layer.serialPort, "%s", port->serialPort);
+        layer.role = LlRx;
+        layer.baudRate = BAUDRATE;
+        layer.nRetransmissions = N_TRIES;
+        layer.timeout = TIMEOUT;
+        layer.fecGroup = MAX_FEC_GROUP;     // Whatever group size the transmitter asks for
+
+        port->link = ll_listen(layer);
+        if (port->link == NULL) {
+            printf("Error - Not possible to open %s\n", port->serialPort);
+            port->failed = TRUE;
+            continue;
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = port};
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ll_fd(port->link), &event) == -1) {
+            perror("epoll_ctl");
+            port->failed = TRUE;
+        }
+    }
+
+    printf("Gateway serving %d serial ports, spool '%s', statistics '%s'\n", nPorts, spool, statsFile);
+
+    double lastReport = monotonicSeconds();
+    writeStats(statsFile, ports, nPorts, STATS_INTERVAL);
+
+    struct epoll_event events[MAX_PORTS];
+    while (running) {
+        int nEvents = epoll_wait(epollFd, events, MAX_PORTS, (int)(STATS_INTERVAL * 1000));
+        if (nEvents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            Port *port = events[i].data.ptr;
+            handleEvents(port, spool);
+
+            if (port->failed) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, ll_fd(port->link), NULL);
+            }
+        }
+
+        double now = monotonicSeconds();
+        if (now - lastReport >= STATS_INTERVAL) {
+            writeStats(statsFile, ports, nPorts, now - lastReport);
+            lastReport = now;
+        }
+    }
+
+    printf("\nGateway stopping\n");
+
+    for (int i = 0; i < nPorts; i++) {
+        if (ports[i].link != NULL) {
+            abortTransfer(&ports[i]);
+            ll_close(ports[i].link, FALSE);
+        }
+    }
+    writeStats(statsFile, ports, nPorts, monotonicSeconds() - lastReport);
+
+    free(ports);
+    close(epollFd);
+    return 0;
+}
@@ -1,11 +0,0 @@
-#ifndef ALARM_H
-#define ALARM_H
-
-#include "macros.h"
-
-extern int alarmEnabled;
-
-// Alarm handler for the alarm() function.
-void alarmHandler(int signal);
-
-#endif // ALARM_H
\ No newline at end of file
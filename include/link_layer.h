@@ -3,6 +3,8 @@
 
 #include "macros.h"
 
+#include <sys/uio.h>
+
 typedef enum
 {
     LlTx,
@@ -13,11 +15,55 @@ typedef struct
 {
     char serialPort[50];
     LinkLayerRole role;
-    int baudRate;
+    int baudRate;   // Bits per second every session starts at
     int nRetransmissions;
     int timeout;
+    int fecGroup;   // I frames per XOR parity frame (forward error correction), 0 for plain stop-and-wait ARQ
+    int duplex;     // TRUE for a full-duplex session: both ends send I frames, acknowledgements piggybacked on them
+    int recoveryTime;   // Seconds to resume the session (re-SET/UA) once the retransmissions run out, 0 to give up at once. Plain ARQ only
+    int maxBaudRate;    // Fastest baudrate offered at llopen, if the serial port supports it, 0 to stay at baudRate
 } LinkLayer;
 
+// Packets a full-duplex connection keeps received and not yet read. Further I frames are not acknowledged until read.
+#define DUPLEX_INBOX_SIZE 8
+
+// Largest FEC group. The group size used is negotiated at llopen: the smallest of both ends, 0 if either has none.
+#define MAX_FEC_GROUP 16
+
+// Logical channels sharing the I frames of a connection, channel 0 first. When packets of several channels wait to be
+// sent, the lowest channel goes next, so a packet only waits for the packet (or FEC group) already being sent.
+// Channels are not sent on the wire: the application tells the packets of each channel apart.
+#define LL_CHANNELS 4
+
+// Channel of llwrite and llwritev, the last one
+#define LL_BULK_CHANNEL (LL_CHANNELS - 1)
+
+// Counters kept by each connection, printed on close when requested.
+typedef struct
+{
+    long framesSent;        // I frames written (retransmissions included)
+    long retransmissions;   // I frames written again after a time out or reject
+    long timeouts;          // Acknowledgements not received in time
+    long framesReceived;    // I frames accepted
+    long duplicates;        // I frames received again and acknowledged without delivering
+    long rejects;           // I frames received with BCC errors
+    long bytesSent;         // Payload bytes acknowledged by the receiver
+    long bytesReceived;     // Payload bytes delivered to the application
+    long paritySent;        // FEC parity frames written (retransmissions included)
+    long rebuilt;           // I frames lost or corrupted and rebuilt from the parity of their group
+    long piggybacked;       // Full-duplex: acknowledgements carried by an I frame instead of a RR
+    long resumes;           // Sessions resumed after the link was lost
+    long paced;             // I frames held back until the transmit queue drained
+    long channelPackets[LL_CHANNELS];       // Packets written on each channel
+    long channelWaitUs[LL_CHANNELS];        // Microseconds they waited for the packets of other channels
+    long channelLatencyUs[LL_CHANNELS];     // Microseconds from the write to the acknowledgement, waits included.
+                                            // FEC and full-duplex writes return before it: only until the frame is sent
+    long channelMaxLatencyUs[LL_CHANNELS];  // Longest of those latencies
+} LinkStatistics;
+
+// Handle of an open connection. All link state lives in it, so several links can be open at once.
+typedef struct LinkConnection LinkConnection;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
@@ -30,6 +76,15 @@ int llopen(LinkLayer connectionParameters);
 // Return number of chars written, or "-1" on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
+// Send the data gathered from the iovcnt buffers of iov as one packet, framed without joining the buffers first.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt);
+
+// Send the data gathered from the iovcnt buffers of iov as one packet of channel (0 to LL_CHANNELS - 1).
+// Safe to call from several threads at once, the packets of lower channels are sent first.
+// Return number of chars written, or "-1" on error.
+int llwritech(int channel, const struct iovec *iov, int iovcnt);
+
 // Receive data in packet.
 // Return number of chars read, or "-1" on error.
 int llread(unsigned char *packet);
@@ -39,4 +94,68 @@ int llread(unsigned char *packet);
 // Return "1" on success or "-1" on error.
 int llclose(int showStatistics);
 
+// Full-duplex sessions: number of packets already received, that llread returns without waiting.
+int llpending();
+
+// Copy the current statistics of the connection into stats.
+void llstatistics(LinkStatistics *stats);
+
+// Re-entrant API: the same operations as above on an explicit connection handle.
+// llopen, llwrite, llread and llclose are wrappers of these on a single default connection.
+
+// Open a connection using the "port" parameters defined in struct linkLayer.
+// Return the connection handle on success or NULL on error.
+LinkConnection *ll_open(LinkLayer connectionParameters);
+
+// Send data in buf with size bufSize through link.
+// Return number of chars written, or "-1" on error.
+int ll_write(LinkConnection *link, const unsigned char *buf, int bufSize);
+
+// Send the data gathered from the iovcnt buffers of iov through link as one packet.
+// Return number of chars written, or "-1" on error.
+int ll_writev(LinkConnection *link, const struct iovec *iov, int iovcnt);
+
+// Send the data gathered from the iovcnt buffers of iov through link as one packet of channel.
+// Return number of chars written, or "-1" on error.
+int ll_writech(LinkConnection *link, int channel, const struct iovec *iov, int iovcnt);
+
+// Receive data in packet from link.
+// Return number of chars read, or "-1" on error.
+int ll_read(LinkConnection *link, unsigned char *packet);
+
+// Full-duplex sessions: number of packets already received from link, that ll_read returns without waiting.
+// I frames of the other direction are received (and acknowledged) while ll_write waits for its own acknowledgement.
+int ll_pending(const LinkConnection *link);
+
+// Copy the current statistics of link into stats.
+void ll_statistics(const LinkConnection *link, LinkStatistics *stats);
+
+// Close link and release the handle.
+// if showStatistics == TRUE, link layer should print statistics in the console on close.
+// Return "1" on success or "-1" on error.
+int ll_close(LinkConnection *link, int showStatistics);
+
+// Event-driven receiver, so one process can serve many serial ports from an event loop.
+
+typedef enum
+{
+    LlEventNone,    // Nothing more can be processed without waiting
+    LlEventOpen,    // A transmitter started a session (SET/UA)
+    LlEventData,    // A packet was received and acknowledged
+    LlEventClose,   // The transmitter ended the session (DISC/DISC/UA), or a new SET replaced it (LlEventOpen follows)
+    LlEventError,   // The serial port failed
+} LinkEvent;
+
+// Open the serial port as a receiver without waiting for a transmitter.
+// Sessions are then accepted and served by ll_poll, one after the other.
+// Return the connection handle on success or NULL on error.
+LinkConnection *ll_listen(LinkLayer connectionParameters);
+
+// Return the file descriptor of the serial port of link, to wait on it with poll/epoll.
+int ll_fd(const LinkConnection *link);
+
+// Process the frames of link that are available without blocking, until one produces an event.
+// On LlEventData, packet is filled and packetSize is set to its size.
+LinkEvent ll_poll(LinkConnection *link, unsigned char *packet, int *packetSize);
+
 #endif // _LINK_LAYER_H_
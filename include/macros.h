@@ -13,6 +13,7 @@
 
 #define C_INF0  0x00        // Information Frame 0
 #define C_INF1  0x40        // Information Frame 1
+#define C_NR    0x80        // Information Frame flag of full-duplex sessions: acknowledges the I frame 1 received (0 if clear)
 
 #define C_SET   0x03        // Set Up
 #define C_UA    0x07        // Unnumbered Acknowledgement
@@ -0,0 +1,38 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "link_layer.h"
+
+// Packets
+#define MIDDLE_PACKET 1
+#define STARTING_PACKET 2
+#define ENDING_PACKET 3
+#define STRIPE_PACKET 4     // Middle packet of a bonded transfer, carries its file offset
+#define SIGNATURE_PACKET 5  // Delta transfer: signatures of the blocks of the receiver's copy, sent to the transmitter
+#define BLOCK_PACKET 6      // Delta transfer: runs of blocks of the receiver's copy, in place of their data
+#define MESSAGE_PACKET 7    // Message of a logical channel of the link, sent between the packets of the file
+
+// Starting / Ending packet parameters
+#define FILE_SIZE 0
+#define FILE_NAME 1
+#define FILE_HASH 2         // Ending packet of a delta transfer: SHA-256 of the file, to check the file rebuilt
+
+// Stripe packets
+#define STRIPE_HEADER_SIZE 11                                   // C (1) + Offset (8) + Size (2)
+#define STRIPE_DATA_SIZE (MAX_PAYLOAD_SIZE - STRIPE_HEADER_SIZE)
+
+// Message packets
+#define MESSAGE_HEADER_SIZE 4                                   // C (1) + Channel (1) + Size (2)
+#define MESSAGE_DATA_SIZE (MAX_PAYLOAD_SIZE - MESSAGE_HEADER_SIZE)
+
+// Delta transfers: the receiver's copy is split in blocks, a shorter last block has no signature
+#define DELTA_BLOCK_SIZE 1024
+#define SIGNATURE_SIZE 12                                       // Rolling checksum (4) + Start of the SHA-256 (8)
+#define STRONG_SIGNATURE_SIZE 8
+#define SIGNATURE_HEADER_SIZE 3                                 // C (1) + Signatures (2)
+#define SIGNATURES_PER_PACKET ((MAX_PAYLOAD_SIZE - SIGNATURE_HEADER_SIZE) / SIGNATURE_SIZE)
+#define BLOCK_RUN_SIZE 6                                        // First block (4) + Blocks (2)
+#define BLOCK_HEADER_SIZE 3                                     // C (1) + Runs (2)
+#define BLOCK_RUNS_PER_PACKET ((MAX_PAYLOAD_SIZE - BLOCK_HEADER_SIZE) / BLOCK_RUN_SIZE)
+
+#endif // PACKET_H
@@ -0,0 +1,30 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bytes of a digest
+#define SHA256_SIZE 32
+
+// Incremental SHA-256 (FIPS 180-4)
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                // Bytes hashed so far
+    unsigned char block[64];        // Bytes waiting for a full block
+    size_t used;
+} Sha256;
+
+// Starts a new hash.
+void sha256Init(Sha256 *hash);
+
+// Adds size bytes of data to the hash.
+void sha256Update(Sha256 *hash, const void *data, size_t size);
+
+// Finishes the hash, filling digest with its SHA256_SIZE bytes. The hash must be started again to be reused.
+void sha256Final(Sha256 *hash, unsigned char *digest);
+
+// Hashes size bytes of data at once, filling digest with its SHA256_SIZE bytes.
+void sha256(const void *data, size_t size, unsigned char *digest);
+
+#endif // SHA256_H
@@ -13,15 +13,34 @@ typedef enum {
     A_TX,
     A_RCV,
 
+    // Control (waiting for BCC1)
+    C_RCV,
+
     // Receving Data
     RECEIVE,
 
 } State;
 
-extern State currentState; // Current state of the state machine
-
-// Changes the currentState of the state machine according to the received byte.
-// Returns 0 if everything went well.
-int stateMachine(unsigned char receivedByte);
-
-#endif // STATE_MACHINE_H
\ No newline at end of file
+// Re-entrant state machine context, one per connection.
+// Besides the state, it keeps the header of the frame being received so BCC1 is checked inline.
+typedef struct {
+    State state;
+    unsigned char address;      // Address field of the current frame
+    unsigned char control;      // Control field of the current frame
+    int bcc1Ok;                 // TRUE if the BCC1 of the current frame matched
+    int length;                 // Number of bytes of the current frame consumed so far (starting FLAG included)
+} StateMachine;
+
+// Resets the state machine context to START.
+void stateMachineReset(StateMachine *sm);
+
+// Advances the state machine context with one received byte.
+// Returns the new state.
+State stateMachineStep(StateMachine *sm, unsigned char receivedByte);
+
+// Advances the state machine context over a whole buffer, stopping right after a frame ends (STOP).
+// While in RECEIVE, the closing FLAG is searched with memchr instead of stepping byte by byte.
+// Returns the number of bytes consumed.
+int stateMachineScan(StateMachine *sm, const unsigned char *buffer, int length);
+
+#endif // STATE_MACHINE_H
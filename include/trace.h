@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Events kept in memory until dumped, the oldest ones are overwritten
+#define TRACE_RING_SIZE 65536
+
+// Events recorded. Durations have a begin and an end event, the others are instants.
+typedef enum {
+    // Durations
+    TRACE_LLWRITE,          // llwrite / llwritev: payload size, then the result
+    TRACE_LLREAD,           // llread: the result
+    TRACE_READ_FRAME,       // Waiting for a frame: the frame size, -1 on time out
+    TRACE_DISK_READ,        // Application layer: bytes read from the file
+    TRACE_DISK_WRITE,       // Application layer: bytes written to the file
+    TRACE_DISK_STALL,       // Application layer: the receiver waits for the disk (write-behind queue full)
+
+    // Instants
+    TRACE_FRAME_TX,         // Frame written: control, size
+    TRACE_FRAME_RX,         // Frame received: control, size
+    TRACE_STUFFING,         // I frame built: payload size, frame size once stuffed
+    TRACE_ACK,              // RR of the I frame in flight: sequence
+    TRACE_REJ,              // REJ of the I frame in flight: sequence
+    TRACE_REJECTED,         // I frame rejected by the receiver (BCC errors): sequence
+    TRACE_TIMEOUT,          // No answer to the I frame in flight: sequence
+    TRACE_RETRANSMIT,       // I frame written again: sequence
+    TRACE_RESUME,           // Session resumed after the link was lost
+    TRACE_BAD_HEADER,       // State machine: header with a wrong BCC1: address, control
+    TRACE_RESYNC,           // State machine: a frame header was dropped halfway: state, bytes dropped
+
+    TRACE_EVENT_COUNT
+} TraceEvent;
+
+// Starts recording events, to be dumped to filename as Chrome trace-event JSON (Perfetto, chrome://tracing).
+// The dump is written on exit, on SIGUSR1 (recording goes on) and on SIGINT / SIGTERM if the program does not handle them.
+// Returns 0 on success or "-1" on error.
+int traceStart(const char *filename);
+
+// Records the start of a duration event of link (its file descriptor, -1 if none) with one argument.
+void traceBegin(TraceEvent event, int link, long arg);
+
+// Records the end of a duration event of link with one argument.
+void traceEnd(TraceEvent event, int link, long arg);
+
+// Records an instant event of link with two arguments.
+void traceInstant(TraceEvent event, int link, long arg1, long arg2);
+
+// Writes every event still in memory to the file given to traceStart. Async-signal-safe.
+// Returns 0 on success or "-1" on error.
+int traceDump();
+
+// Call in a child process right after fork: drops the events of the parent and dumps the child's to <filename>.<pid>.
+// A child that ends with _exit must call traceDump itself, atexit handlers do not run.
+// Returns 0 on success (or if not tracing) or "-1" on error.
+int traceFork();
+
+#endif // TRACE_H
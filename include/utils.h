@@ -1,6 +1,34 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "link_layer.h"
+#include "state_machine.h"
+
+#include <sys/uio.h>
+#include <time.h>
+
+// Size of the buffer used to read from the serial port
+#define RX_BUFFER_SIZE 4096
+
+// Header of the I frames of a FEC group: index in the group (or FEC_PARITY), frames in the group, XOR of their sizes (2)
+#define FEC_HEADER_SIZE 4
+#define FEC_PARITY 0xFF
+
+// Largest frame on the wire: every data byte (FEC header included) and BCC2 stuffed, plus FLAGs, A, C and BCC1
+#define MAX_FRAME_SIZE (2 * (MAX_PAYLOAD_SIZE + FEC_HEADER_SIZE + 1) + 5)
+
+// Buffered, incremental reader of frames from one serial port.
+// Bytes read past the end of a frame are kept for the next one, and a partial frame survives between calls.
+typedef struct {
+    int fd;
+    unsigned char buffer[RX_BUFFER_SIZE];
+    int start;                              // First byte not yet consumed
+    int end;                                // End of the bytes read
+    StateMachine sm;                        // State of the frame being assembled
+    unsigned char frame[MAX_FRAME_SIZE];    // Frame being assembled
+    int frameSize;
+} FrameReader;
+
 // Calculates the XOR of a array of bytes with a given length
 // Returns the result of the XOR
 unsigned char BCC2(const unsigned char *buffer, int length);
@@ -9,9 +37,25 @@ unsigned char BCC2(const unsigned char *buffer, int length);
 // Returns 0 on success, -1 otherwise
 int sendSupervisionFrame(int fd, unsigned char a, unsigned char c);
 
-// Reads a frame from the serial port. If timeout is 0, it will wait forever for a frame.
-// Returns the size of the frame read, -1 otherwise
-int readFrame(int fd, unsigned int timeout, unsigned char* data);
+// Writes a whole frame to the serial port fd, opened non-blocking: partial writes are resumed, waiting for POLLOUT
+// while the transmit queue is full.
+// Returns 0 on success, -1 otherwise
+int writeFrame(int fd, const unsigned char *frame, int frameSize);
+
+// Initializes a frame reader for the serial port fd.
+void frameReaderInit(FrameReader *reader, int fd);
+
+// Returns the next complete frame of at most maxSize bytes using only what can be read without waiting.
+// Bigger frames are dropped. Returns the size of the frame, 0 if there is no complete frame yet, -1 on error
+int frameReaderNext(FrameReader *reader, unsigned char* data, int maxSize);
+
+// Reads a frame of at most maxSize bytes with the given reader, waiting until deadline (CLOCK_MONOTONIC) or forever if NULL.
+// Returns the size of the frame read, -1 on error or time out
+int readFrameUntil(FrameReader *reader, const struct timespec *deadline, unsigned char* data, int maxSize);
+
+// Reads a frame of at most maxSize bytes with the given reader. If timeout is 0, it will wait forever for a frame.
+// Returns the size of the frame read, -1 on error or time out
+int readFrameFrom(FrameReader *reader, unsigned int timeout, unsigned char* data, int maxSize);
 
 // Stuffes the data with the byte stuffing technique. Only FLAG and ESCAPE equal bytes are stuffed.
 // Returns the size of the stuffed data
@@ -21,5 +65,16 @@ int stuffData(const unsigned char* data, int dataSize, unsigned char* stuffedDat
 // Returns the size of the destuffed data
 int destuffData(const unsigned char* stuffedData, int stuffedDataSize, unsigned char* destuffedData);
 
+// Builds a complete Information Frame (FLAG, A, C, BCC1, stuffed data, stuffed BCC2, FLAG) into frame.
+// frame must have room for at least 2 * dataSize + 7 bytes.
+// Returns the size of the frame
+int encodeFrame(unsigned char a, unsigned char c, const unsigned char* data, int dataSize, unsigned char* frame);
+
+// Builds a complete Information Frame like encodeFrame, with the data gathered from iovcnt buffers.
+// The data is stuffed and its BCC2 computed in one pass, without joining the buffers first.
+// frame must have room for at least 2 * (total data size) + 7 bytes.
+// Returns the size of the frame
+int encodeFrameV(unsigned char a, unsigned char c, const struct iovec *iov, int iovcnt, unsigned char* frame);
+
 
 #endif // UTILS_H
\ No newline at end of file
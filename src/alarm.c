@@ -1,5 +0,0 @@
-#include "../include/alarm.h"
-
-void alarmHandler(int signal) {
-    alarmEnabled = FALSE;
-}
\ No newline at end of file
@@ -1,20 +1,199 @@
 #include "application_layer.h"
 #include "link_layer.h"
+#include "packet.h"
+#include "sha256.h"
+#include "trace.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
-// Packets
-#define MIDDLE_PACKET 1
-#define STARTING_PACKET 2
-#define ENDING_PACKET 3
+// Bonded mode
+#define MAX_BONDED_LINKS 8
 
-#define FILE_SIZE 0
-#define FILE_NAME 1
+// Forward error correction: LL_FEC=K sends a parity frame every K frames (transmitter) or caps the size accepted (receiver)
+#define FEC_ENV "LL_FEC"
 
-int TransmitterApp(const char *filename) {
+// Full-duplex: LL_DUPLEX=<file> also sends that file from the receiver and writes it on the transmitter, over the same link
+#define DUPLEX_ENV "LL_DUPLEX"
+
+// Delta transfer: LL_DELTA set on both ends only sends what changed from the receiver's copy of the file
+#define DELTA_ENV "LL_DELTA"
+
+// Telemetry: LL_TELEMETRY=<milliseconds> sends the progress of the transfer at that interval, on a channel of its own
+#define TELEMETRY_ENV "LL_TELEMETRY"
+#define TELEMETRY_CHANNEL 0
+
+// Tracing: LL_TRACE=<file> records the link layer and disk events, dumped as Chrome trace-event JSON on exit or SIGUSR1
+#define TRACE_ENV "LL_TRACE"
+
+// Session recovery: LL_RECOVERY=<seconds> the link keeps trying to resume the session once the retransmissions
+// of a frame ran out (0 gives up at once). Plain ARQ only, not with FEC, full-duplex or delta.
+#define RECOVERY_ENV "LL_RECOVERY"
+#define DEFAULT_RECOVERY_TIME 0
+
+// Baudrate negotiation: LL_MAX_BAUDRATE=<bits/s> is the fastest baudrate offered at llopen (0 stays at the initial one)
+#define MAX_BAUDRATE_ENV "LL_MAX_BAUDRATE"
+#define DEFAULT_MAX_BAUDRATE 0
+
+// Write-behind: packets received that may wait for the disk
+#define WRITE_QUEUE_SIZE 64
+
+// Wall clock time in seconds, from a monotonic clock (clock() only counts CPU time)
+static double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////
+// TELEMETRY CHANNEL
+////////////////////////////////////////////////
+// While the file is sent on the bulk channel of the link, a thread sends the progress of the transfer on a higher
+// priority channel, so each message goes out right after the packet of the file being sent instead of queuing
+// behind the rest of the file.
+
+typedef struct {
+    int interval;               // Milliseconds between messages
+    long fileSize;
+    long bytesSent;             // Bytes of the file sent so far
+    double start;
+    int stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+} Telemetry;
+
+typedef struct {
+    long sent;                  // Messages sent by the transmitter
+    long received;              // Messages received by the receiver
+    char last[MESSAGE_DATA_SIZE + 1];   // Last message received
+} TelemetryStatistics;
+
+static TelemetryStatistics telemetryStats;
+
+// Sends the progress of the transfer every interval milliseconds, until stopped.
+static void *telemetryThread(void *arg) {
+    Telemetry *telemetry = arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    pthread_mutex_lock(&telemetry->lock);
+    while (!telemetry->stopped) {
+        next.tv_nsec += (long)telemetry->interval * 1000000;
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        while (!telemetry->stopped && pthread_cond_timedwait(&telemetry->wake, &telemetry->lock, &next) != ETIMEDOUT) {
+            // Woken up before the time of the next message
+        }
+        if (telemetry->stopped) {
+            break;
+        }
+
+        char text[MESSAGE_DATA_SIZE];
+        int size = snprintf(text, sizeof(text), "%ld/%ld bytes sent after %.3f seconds",
+                            telemetry->bytesSent, telemetry->fileSize, monotonicSeconds() - telemetry->start);
+        pthread_mutex_unlock(&telemetry->lock);
+
+        unsigned char header[MESSAGE_HEADER_SIZE];
+        header[0] = MESSAGE_PACKET;                 // Control field for messages
+        header[1] = TELEMETRY_CHANNEL;              // Channel of the message
+        header[2] = (size >> 8) & 0xFF;             // High byte of size
+        header[3] = size & 0xFF;                    // Low byte of size
+        struct iovec messagePacket[2] = {
+            {.iov_base = header, .iov_len = sizeof(header)},
+            {.iov_base = text, .iov_len = size}
+        };
+        int result = llwritech(TELEMETRY_CHANNEL, messagePacket, 2);
+
+        pthread_mutex_lock(&telemetry->lock);
+        if (result == -1) {
+            printf("Error - Not possible to send telemetry message\n");
+            break;
+        }
+        telemetryStats.sent++;
+    }
+    pthread_mutex_unlock(&telemetry->lock);
+    return NULL;
+}
+
+// Starts sending the progress of the transfer of fileSize bytes, if telemetry->interval is not 0.
+// Returns 0 on success or "-1" on error.
+static int startTelemetry(Telemetry *telemetry, long fileSize) {
+    if (telemetry->interval <= 0) {
+        return 0;
+    }
+    telemetry->fileSize = fileSize;
+    telemetry->bytesSent = 0;
+    telemetry->start = monotonicSeconds();
+    telemetry->stopped = FALSE;
+
+    // The interval is measured on the monotonic clock
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&telemetry->lock, NULL);
+    pthread_cond_init(&telemetry->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    if (pthread_create(&telemetry->thread, NULL, telemetryThread, telemetry) != 0) {
+        printf("Error - Not possible to start the telemetry thread\n");
+        pthread_cond_destroy(&telemetry->wake);
+        pthread_mutex_destroy(&telemetry->lock);
+        telemetry->interval = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void telemetryProgress(Telemetry *telemetry, long bytes) {
+    if (telemetry->interval <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&telemetry->lock);
+    telemetry->bytesSent += bytes;
+    pthread_mutex_unlock(&telemetry->lock);
+}
+
+// Stops the telemetry thread, once the message being sent (if any) was acknowledged.
+static void stopTelemetry(Telemetry *telemetry) {
+    if (telemetry->interval <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&telemetry->lock);
+    telemetry->stopped = TRUE;
+    pthread_cond_signal(&telemetry->wake);
+    pthread_mutex_unlock(&telemetry->lock);
+
+    pthread_join(telemetry->thread, NULL);
+    pthread_cond_destroy(&telemetry->wake);
+    pthread_mutex_destroy(&telemetry->lock);
+}
+
+// Receiver: keeps a message received on the telemetry channel.
+// Returns 0 on success or "-1" for an invalid packet.
+static int receiveMessage(const unsigned char *packet, int packetSize) {
+    int size = packetSize >= MESSAGE_HEADER_SIZE ? (packet[2] << 8) | packet[3] : -1;
+    if (size != packetSize - MESSAGE_HEADER_SIZE || packet[1] != TELEMETRY_CHANNEL) {
+        return -1;
+    }
+
+    memcpy(telemetryStats.last, &packet[MESSAGE_HEADER_SIZE], size);
+    telemetryStats.last[size] = '\0';
+    telemetryStats.received++;
+    return 0;
+}
+
+int TransmitterApp(const char *filename, int telemetryInterval) {
     // Get file information
     struct stat file_stat;
     if (stat(filename, &file_stat) < 0) {
@@ -48,29 +227,41 @@ int TransmitterApp(const char *filename) {
         printf("Error - Not possible to send starting packet\n");
         return -1;
     }
-    
+
+    // Progress on the telemetry channel, between the Middle packets
+    Telemetry telemetry = {.interval = telemetryInterval};
+    if (startTelemetry(&telemetry, file_stat.st_size) == -1) {
+        return -1;
+    }
+
     // Send Middle packets
     unsigned sequenceNumber = 0;
     unsigned char buf[MAX_PAYLOAD_SIZE];
 
     while (TRUE) {
         // Read data from the file
+        traceBegin(TRACE_DISK_READ, -1, 0);
         unsigned bytes_to_send = fread(buf, sizeof(unsigned char), MAX_PAYLOAD_SIZE - 4, file);
+        traceEnd(TRACE_DISK_READ, -1, bytes_to_send);
 
-        // Create the data packet
-        unsigned int dataPacketSize = 4 + bytes_to_send;  // Data packet size
-        unsigned char dataPacket[dataPacketSize];         // Data packet
-        dataPacket[0] = MIDDLE_PACKET;                  // Control field for data
-        dataPacket[1] = sequenceNumber;                 // Sequence number (0 or 1)
-        dataPacket[2] = (bytes_to_send >> 8) & 0xFF;    // High byte of size
-        dataPacket[3] = bytes_to_send & 0xFF;           // Low byte of size
-        memcpy(&dataPacket[4], buf, bytes_to_send);     // Copy data into the packet
+        // Create the data packet header, the data is framed straight from buf
+        unsigned char header[4];
+        header[0] = MIDDLE_PACKET;                  // Control field for data
+        header[1] = sequenceNumber;                 // Sequence number (0 or 1)
+        header[2] = (bytes_to_send >> 8) & 0xFF;    // High byte of size
+        header[3] = bytes_to_send & 0xFF;           // Low byte of size
+        struct iovec dataPacket[2] = {
+            {.iov_base = header, .iov_len = sizeof(header)},
+            {.iov_base = buf, .iov_len = bytes_to_send}
+        };
 
         // Send the data packet
-        if (llwrite(dataPacket, dataPacketSize) == -1) {
+        if (llwritev(dataPacket, 2) == -1) {
             printf("Error - Not possible to send data packet\n");
+            stopTelemetry(&telemetry);
             return -1;
         }
+        telemetryProgress(&telemetry, bytes_to_send);
 
         sequenceNumber = 1 - sequenceNumber;  // Toggle sequence number (0 or 1)
 
@@ -80,6 +271,9 @@ int TransmitterApp(const char *filename) {
         }
     }
 
+    // No message may follow the Ending packet
+    stopTelemetry(&telemetry);
+
     // Ending packet
     packet[0] = ENDING_PACKET;
 
@@ -94,119 +288,1309 @@ int TransmitterApp(const char *filename) {
     return 0;
 }
 
-int ReceiverApp(const char *filename) {
+////////////////////////////////////////////////
+// WRITE-BEHIND DISK STAGE
+////////////////////////////////////////////////
+// The receiver reads every packet straight into a bounded queue and a writer thread drains it to the file,
+// so a slow disk does not keep the receiver from reading (and acknowledging) frames until the queue fills up.
+
+typedef struct {
     FILE *file;
-    unsigned char dataPacket[MAX_PAYLOAD_SIZE + 4];
+    unsigned char packets[WRITE_QUEUE_SIZE][MAX_PAYLOAD_SIZE + 4];
+    int sizes[WRITE_QUEUE_SIZE];
+    int first;                  // Oldest packet not written yet
+    int count;                  // Packets waiting to be written
+    int closed;                 // No more packets will be queued
+    int failed;                 // A write to the file failed
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} WriteQueue;
+
+typedef struct {
+    long packets;               // Packets queued
+    long depthSum;              // Sum of the queue depth each packet found, for the mean
+    int maxDepth;
+    long stalls;                // Times the receiver found the queue full
+    double stallTime;           // Seconds the receiver waited for room in the queue
+    double diskTime;            // Seconds the writer spent writing to the file
+} WriteBehindStatistics;
+
+static WriteBehindStatistics writeBehindStats;
+
+// Writes the queued packets to the file until the queue is closed and empty.
+static void *writerThread(void *arg) {
+    WriteQueue *queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    while (TRUE) {
+        while (queue->count == 0 && !queue->closed) {
+            pthread_cond_wait(&queue->notEmpty, &queue->lock);
+        }
+        if (queue->count == 0) {
+            break;
+        }
+        int index = queue->first;
+        int failed = queue->failed;
+        pthread_mutex_unlock(&queue->lock);
+
+        // The slot is not reused until it is released below; after a failure the rest is only drained
+        if (!failed) {
+            double start = monotonicSeconds();
+            size_t size = queue->sizes[index] - 4;
+            traceBegin(TRACE_DISK_WRITE, -1, size);
+            failed = fwrite(&queue->packets[index][4], 1, size, queue->file) != size;
+            traceEnd(TRACE_DISK_WRITE, -1, 0);
+            writeBehindStats.diskTime += monotonicSeconds() - start;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->failed = failed;
+        queue->first = (index + 1) % WRITE_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Waits for a free slot in the queue.
+// Returns its index, or "-1" if a write to the file failed.
+static int reserveSlot(WriteQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == WRITE_QUEUE_SIZE && !queue->failed) {
+        double start = monotonicSeconds();
+        writeBehindStats.stalls++;
+        traceBegin(TRACE_DISK_STALL, -1, queue->count);
+        while (queue->count == WRITE_QUEUE_SIZE && !queue->failed) {
+            pthread_cond_wait(&queue->notFull, &queue->lock);
+        }
+        traceEnd(TRACE_DISK_STALL, -1, 0);
+        writeBehindStats.stallTime += monotonicSeconds() - start;
+    }
+    int index = queue->failed ? -1 : (queue->first + queue->count) % WRITE_QUEUE_SIZE;
+    pthread_mutex_unlock(&queue->lock);
+    return index;
+}
+
+// Hands the packet read into the reserved slot to the writer.
+static void queuePacket(WriteQueue *queue, int size) {
+    pthread_mutex_lock(&queue->lock);
+    queue->sizes[(queue->first + queue->count) % WRITE_QUEUE_SIZE] = size;
+    queue->count++;
+
+    writeBehindStats.packets++;
+    writeBehindStats.depthSum += queue->count;
+    if (queue->count > writeBehindStats.maxDepth) {
+        writeBehindStats.maxDepth = queue->count;
+    }
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Closes the queue and waits for the writer to drain it.
+// Returns 0 if every packet was written, or "-1" on error.
+static int closeWriteQueue(WriteQueue *queue, pthread_t writer) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = TRUE;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(writer, NULL);
+    return queue->failed ? -1 : 0;
+}
+
+int ReceiverApp(const char *filename) {
+    WriteQueue *queue = calloc(1, sizeof(WriteQueue));
+    if (queue == NULL) {
+        printf("Error - Not possible to allocate the write queue\n");
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+
+    pthread_t writer;
+    int result = -1;
 
     // Receive Packets
     while (TRUE) {
-        size_t bytesRead = llread(dataPacket);
+        int index = reserveSlot(queue);
+        if (index == -1) {
+            printf("Error - Not possible to write data to file.\n");
+            break;
+        }
+        unsigned char *dataPacket = queue->packets[index];
+
+        int bytesRead = llread(dataPacket);
         if (bytesRead == -1) {
             printf("Error - Not possible to read data packet.\n");
-            fclose(file);
-            return -1;
+            break;
         }
         if (bytesRead == 0) {
             continue;
         }
         else {
             if (dataPacket[0] == STARTING_PACKET) {
-                file = fopen(filename, "wb");
-                if (file == NULL) {
+                if (queue->file != NULL) {
+                    continue;
+                }
+                queue->file = fopen(filename, "wb");
+                if (queue->file == NULL) {
                     printf("Error - Not possible to open file\n");
-                    return -1;
+                    break;
+                }
+                if (pthread_create(&writer, NULL, writerThread, queue) != 0) {
+                    printf("Error - Not possible to start the writer thread\n");
+                    fclose(queue->file);
+                    queue->file = NULL;
+                    break;
                 }
             }
-            else if (dataPacket[0] == MIDDLE_PACKET) {
-                // Write the data to the file
-                if (fwrite(&dataPacket[4], 1, bytesRead - 4, file) != bytesRead - 4) {
-                    printf("Error - Not possible to write data to file.\n");
-                    fclose(file);
-                    return -1;
+            else if (dataPacket[0] == MIDDLE_PACKET && queue->file != NULL) {
+                // Written by the writer thread
+                queuePacket(queue, bytesRead);
+            }
+            else if (dataPacket[0] == MESSAGE_PACKET && queue->file != NULL) {
+                // Not queued, the slot is read into again
+                if (receiveMessage(dataPacket, bytesRead) == -1) {
+                    printf("Error - Invalid packet.\n");
+                    break;
                 }
             }
-            else if (dataPacket[0] == ENDING_PACKET) {
-                fclose(file);
+            else if (dataPacket[0] == ENDING_PACKET && queue->file != NULL) {
+                result = 0;
                 break;
             }
             else {
                 printf("Error - Invalid packet.\n");
-                fclose(file);
+                break;
+            }
+        }
+    }
+
+    if (queue->file != NULL) {
+        if (closeWriteQueue(queue, writer) == -1 && result == 0) {
+            printf("Error - Not possible to write data to file.\n");
+            result = -1;
+        }
+        fclose(queue->file);
+    }
+
+    pthread_cond_destroy(&queue->notFull);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+    return result;
+}
+
+////////////////////////////////////////////////
+// FULL-DUPLEX MODE
+////////////////////////////////////////////////
+// Both ends send a file at the same time: each one sends its next packet, then reads the packets
+// received meanwhile, and once its own file was sent, waits for the rest of the other one.
+
+// Stores a packet of the file received in full-duplex mode, opening *file on the Starting packet and closing it on the Ending one.
+// Returns TRUE after the Ending packet, FALSE before it or "-1" on error.
+static int storeDuplexPacket(FILE **file, const char *filename, const unsigned char *dataPacket, int bytesRead) {
+    if (dataPacket[0] == STARTING_PACKET) {
+        *file = fopen(filename, "wb");
+        if (*file == NULL) {
+            printf("Error - Not possible to open file\n");
+            return -1;
+        }
+    }
+    else if (dataPacket[0] == MIDDLE_PACKET && *file != NULL) {
+        // Write the data to the file
+        traceBegin(TRACE_DISK_WRITE, -1, bytesRead - 4);
+        size_t written = fwrite(&dataPacket[4], 1, bytesRead - 4, *file);
+        traceEnd(TRACE_DISK_WRITE, -1, 0);
+        if (written != bytesRead - 4) {
+            printf("Error - Not possible to write data to file.\n");
+            return -1;
+        }
+    }
+    else if (dataPacket[0] == ENDING_PACKET && *file != NULL) {
+        fclose(*file);
+        *file = NULL;
+        return TRUE;
+    }
+    else {
+        printf("Error - Invalid packet.\n");
+        return -1;
+    }
+
+    return FALSE;
+}
+
+int DuplexApp(const char *sendFilename, const char *receiveFilename) {
+    struct stat file_stat;
+    if (stat(sendFilename, &file_stat) < 0) {
+        perror("Error getting file information.");
+        return -1;
+    }
+
+    FILE *file = fopen(sendFilename, "rb");
+    if (file == NULL) {
+        printf("Error - Not possible to open file\n");
+        return -1;
+    }
+    FILE *receivedFile = NULL;
+
+    // Starting / Ending packet (file size and name)
+    unsigned int fileSize = sizeof(file_stat.st_size);
+    unsigned int filenameSize = strlen(sendFilename);
+    unsigned int packet_size = 5 + fileSize + filenameSize;
+
+    unsigned char packet[packet_size];
+    packet[0] = STARTING_PACKET;
+    packet[1] = FILE_SIZE;
+    packet[2] = fileSize;
+    memcpy(&packet[3], &file_stat.st_size, fileSize);
+    packet[3 + fileSize] = FILE_NAME;
+    packet[4 + fileSize] = filenameSize;
+    memcpy(&packet[5 + fileSize], sendFilename, filenameSize);
+
+    int nextPacket = STARTING_PACKET;   // Type of the next packet to send, 0 once the Ending packet was sent
+    int received = FALSE;               // TRUE once the Ending packet of the other file arrived
+    unsigned sequenceNumber = 0;
+    unsigned char dataPacket[MAX_PAYLOAD_SIZE];
+    int result = 0;
+
+    while (result == 0 && (nextPacket != 0 || !received)) {
+        // Send the next packet
+        if (nextPacket == STARTING_PACKET || nextPacket == ENDING_PACKET) {
+            packet[0] = nextPacket;
+            if (llwrite(packet, packet_size) == -1) {
+                printf("Error - Not possible to send %s packet\n", nextPacket == STARTING_PACKET ? "starting" : "ending");
+                result = -1;
+                break;
+            }
+            nextPacket = (nextPacket == STARTING_PACKET) ? MIDDLE_PACKET : 0;
+        }
+        else if (nextPacket == MIDDLE_PACKET) {
+            traceBegin(TRACE_DISK_READ, -1, 0);
+            unsigned bytes_to_send = fread(&dataPacket[4], sizeof(unsigned char), MAX_PAYLOAD_SIZE - 4, file);
+            traceEnd(TRACE_DISK_READ, -1, bytes_to_send);
+
+            dataPacket[0] = MIDDLE_PACKET;                  // Control field for data
+            dataPacket[1] = sequenceNumber;                 // Sequence number (0 or 1)
+            dataPacket[2] = (bytes_to_send >> 8) & 0xFF;    // High byte of size
+            dataPacket[3] = bytes_to_send & 0xFF;           // Low byte of size
+
+            if (llwrite(dataPacket, 4 + bytes_to_send) == -1) {
+                printf("Error - Not possible to send data packet\n");
+                result = -1;
+                break;
+            }
+
+            sequenceNumber = 1 - sequenceNumber;  // Toggle sequence number (0 or 1)
+            if (bytes_to_send < (MAX_PAYLOAD_SIZE - 4)) {
+                nextPacket = ENDING_PACKET;
+            }
+        }
+
+        // Packets received meanwhile, or all the rest once everything was sent
+        while (!received && (llpending() > 0 || nextPacket == 0)) {
+            int bytesRead = llread(dataPacket);
+            if (bytesRead == -1) {
+                printf("Error - Not possible to read data packet.\n");
+                result = -1;
+                break;
+            }
+            if (bytesRead == 0) {
+                continue;
+            }
+
+            received = storeDuplexPacket(&receivedFile, receiveFilename, dataPacket, bytesRead);
+            if (received == -1) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    fclose(file);
+    if (receivedFile != NULL) {
+        fclose(receivedFile);
+    }
+    return result;
+}
+
+////////////////////////////////////////////////
+// DELTA MODE
+////////////////////////////////////////////////
+// The receiver already has a copy of the file, maybe an older version. Over a full-duplex session it first sends
+// the signatures of the blocks of that copy: a rolling checksum and the start of their SHA-256. The transmitter
+// looks for those blocks at every offset of the file and sends runs of matching blocks (BLOCK_PACKET) and the data
+// between them (Middle packets). The receiver rebuilds the file next to its copy, and replaces it once the SHA-256
+// in the Ending packet matches.
+
+typedef struct {
+    long signatures;            // Blocks of the receiver's copy
+    long literalBytes;          // Bytes sent as data
+    long matchedBytes;          // Bytes sent as references to blocks of the receiver's copy
+} DeltaStatistics;
+
+static DeltaStatistics deltaStats;
+
+// Rolling checksum of a block (rsync): a is the sum of its bytes, b the sum of the prefix sums, both mod 2^16
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+} RollingChecksum;
+
+static void rollingInit(RollingChecksum *sum, const unsigned char *block, int size) {
+    sum->a = 0;
+    sum->b = 0;
+    for (int i = 0; i < size; i++) {
+        sum->a += block[i];
+        sum->b += (uint32_t)(size - i) * block[i];
+    }
+}
+
+// Moves the block one byte forward: out leaves it and in enters it
+static void rollingRoll(RollingChecksum *sum, unsigned char out, unsigned char in, int size) {
+    sum->a += in - out;
+    sum->b += sum->a - (uint32_t)size * out;
+}
+
+static uint32_t rollingValue(const RollingChecksum *sum) {
+    return (sum->a & 0xFFFF) | (sum->b << 16);
+}
+
+// Signatures received by the transmitter, with a hash table on the rolling checksum
+typedef struct {
+    uint32_t *weak;
+    unsigned char (*strong)[STRONG_SIGNATURE_SIZE];
+    int count;
+    int *buckets;               // First block of each bucket, -1 if none
+    int *next;                  // Next block of the same bucket, -1 if none
+    uint32_t mask;              // Buckets - 1
+} SignatureTable;
+
+static void freeSignatures(SignatureTable *table) {
+    free(table->weak);
+    free(table->strong);
+    free(table->buckets);
+    free(table->next);
+}
+
+// Receiver: sends the signatures of every full block of its copy of the file, none if there is no copy.
+// A packet with less than SIGNATURES_PER_PACKET signatures ends them.
+// Returns 0 on success or "-1" on error.
+static int sendSignatures(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    unsigned char block[DELTA_BLOCK_SIZE];
+    int count = 0;
+
+    while (TRUE) {
+        int full = file != NULL && fread(block, 1, DELTA_BLOCK_SIZE, file) == DELTA_BLOCK_SIZE;
+        if (full) {
+            RollingChecksum sum;
+            rollingInit(&sum, block, DELTA_BLOCK_SIZE);
+            uint32_t weak = rollingValue(&sum);
+            unsigned char digest[SHA256_SIZE];
+            sha256(block, DELTA_BLOCK_SIZE, digest);
+
+            unsigned char *signature = &packet[SIGNATURE_HEADER_SIZE + count * SIGNATURE_SIZE];
+            for (int i = 0; i < 4; i++) {
+                signature[i] = (weak >> (24 - 8 * i)) & 0xFF;       // Rolling checksum (big endian)
+            }
+            memcpy(&signature[4], digest, STRONG_SIGNATURE_SIZE);
+            count++;
+            deltaStats.signatures++;
+        }
+
+        if (count == SIGNATURES_PER_PACKET || !full) {
+            packet[0] = SIGNATURE_PACKET;
+            packet[1] = (count >> 8) & 0xFF;
+            packet[2] = count & 0xFF;
+            if (llwrite(packet, SIGNATURE_HEADER_SIZE + count * SIGNATURE_SIZE) == -1) {
+                printf("Error - Not possible to send signature packet\n");
+                if (file != NULL) {
+                    fclose(file);
+                }
                 return -1;
             }
+            if (!full) {
+                break;
+            }
+            count = 0;
         }
     }
 
+    if (file != NULL) {
+        fclose(file);
+    }
     return 0;
 }
 
-void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename) {
-    // Create link layer
-    LinkLayer layer;
+// Transmitter: receives the signatures of the receiver's copy into table.
+// Returns 0 on success or "-1" on error.
+static int receiveSignatures(SignatureTable *table) {
+    memset(table, 0, sizeof(SignatureTable));
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int capacity = 0;
 
-    layer.baudRate = baudRate;
-    layer.nRetransmissions = nTries;
+    while (TRUE) {
+        int bytesRead = llread(packet);
+        if (bytesRead == -1) {
+            printf("Error - Not possible to read signature packet.\n");
+            return -1;
+        }
+        if (bytesRead == 0) {
+            continue;
+        }
 
-    if (strcmp(role, "tx") == 0) {
-        layer.role = LlTx;
+        int count = bytesRead >= SIGNATURE_HEADER_SIZE ? (packet[1] << 8) | packet[2] : -1;
+        if (packet[0] != SIGNATURE_PACKET || count < 0 || count > SIGNATURES_PER_PACKET ||
+            bytesRead != SIGNATURE_HEADER_SIZE + count * SIGNATURE_SIZE) {
+            printf("Error - Invalid packet.\n");
+            return -1;
+        }
+
+        if (table->count + count > capacity) {
+            capacity = 2 * capacity + SIGNATURES_PER_PACKET;
+            uint32_t *weak = realloc(table->weak, capacity * sizeof(uint32_t));
+            if (weak != NULL) {
+                table->weak = weak;
+            }
+            unsigned char (*strong)[STRONG_SIGNATURE_SIZE] = realloc(table->strong, capacity * STRONG_SIGNATURE_SIZE);
+            if (strong != NULL) {
+                table->strong = strong;
+            }
+            if (weak == NULL || strong == NULL) {
+                printf("Error - Not possible to allocate signatures\n");
+                return -1;
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            const unsigned char *signature = &packet[SIGNATURE_HEADER_SIZE + i * SIGNATURE_SIZE];
+            table->weak[table->count] = (uint32_t)signature[0] << 24 | signature[1] << 16 | signature[2] << 8 | signature[3];
+            memcpy(table->strong[table->count], &signature[4], STRONG_SIGNATURE_SIZE);
+            table->count++;
+        }
+
+        if (count < SIGNATURES_PER_PACKET) {
+            break;
+        }
     }
-    if (strcmp(role, "rx") == 0) {
-        layer.role = LlRx;
+    deltaStats.signatures = table->count;
+
+    // Hash table with at least twice as many buckets as blocks
+    uint32_t buckets = 1;
+    while (buckets < 2 * (uint32_t)table->count) {
+        buckets <<= 1;
+    }
+    table->mask = buckets - 1;
+    table->buckets = malloc(buckets * sizeof(int));
+    table->next = malloc((table->count + 1) * sizeof(int));
+    if (table->buckets == NULL || table->next == NULL) {
+        printf("Error - Not possible to allocate signatures\n");
+        return -1;
     }
+    memset(table->buckets, 0xFF, buckets * sizeof(int));
 
-    sprintf(layer.serialPort, "%s", serialPort);
-    layer.timeout = timeout;
+    // Inserted backwards, so the first block with a signature is found first
+    for (int i = table->count - 1; i >= 0; i--) {
+        uint32_t bucket = table->weak[i] & table->mask;
+        table->next[i] = table->buckets[bucket];
+        table->buckets[bucket] = i;
+    }
+    return 0;
+}
 
-    // Open link layer
-    clock_t start_t_open, end_t_open; // Time variables
-    start_t_open = clock(); // Start time
-    if (llopen(layer) == -1) {
-        perror("Error - Not possible to open link layer.");
+// Returns the block of the receiver's copy equal to the DELTA_BLOCK_SIZE bytes of data, whose rolling checksum
+// is weak, or "-1" if there is none. The SHA-256 is only computed if some block has the same rolling checksum.
+static int findBlock(const SignatureTable *table, uint32_t weak, const unsigned char *data) {
+    unsigned char digest[SHA256_SIZE];
+    int hashed = FALSE;
+
+    for (int i = table->buckets[weak & table->mask]; i != -1; i = table->next[i]) {
+        if (table->weak[i] != weak) {
+            continue;
+        }
+        if (!hashed) {
+            sha256(data, DELTA_BLOCK_SIZE, digest);
+            hashed = TRUE;
+        }
+        if (memcmp(table->strong[i], digest, STRONG_SIGNATURE_SIZE) == 0) {
+            return i;
+        }
     }
-    end_t_open = clock();   // End time
-    printf("\nConnection established ✓\n");
-    
-    // Run application layer
-    clock_t start_t, end_t; // Time variables
-    if (layer.role == LlTx) {
-        start_t = clock(); // Start time
+    return -1;
+}
 
-        TransmitterApp(filename);  // Main App
+// What the transmitter has yet to send: block runs are gathered in packet until it is full or data follows
+typedef struct {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int runs;                   // Runs in packet
+    uint32_t first;             // Run being extended
+    int length;                 // Blocks of the run being extended, 0 if none
+    unsigned sequenceNumber;    // Of the next Middle packet (0 or 1)
+} DeltaSender;
 
-        end_t = clock();   // End time
+// Adds the run being extended, if any, to the runs gathered in the packet
+static void closeBlockRun(DeltaSender *sender) {
+    if (sender->length == 0) {
+        return;
+    }
+    unsigned char *run = &sender->packet[BLOCK_HEADER_SIZE + sender->runs * BLOCK_RUN_SIZE];
+    for (int i = 0; i < 4; i++) {
+        run[i] = (sender->first >> (24 - 8 * i)) & 0xFF;       // First block (big endian)
+    }
+    run[4] = (sender->length >> 8) & 0xFF;
+    run[5] = sender->length & 0xFF;
+    sender->runs++;
+    sender->length = 0;
+}
 
-        printf("All data Sent ✓\n");
+// Sends the block runs gathered, the run being extended included.
+// Returns 0 on success or "-1" on error.
+static int flushBlockRuns(DeltaSender *sender) {
+    closeBlockRun(sender);
+    if (sender->runs == 0) {
+        return 0;
     }
-    if (layer.role == LlRx) {
-        start_t = clock(); // Start time
 
-        ReceiverApp(filename);     // Main App
+    sender->packet[0] = BLOCK_PACKET;
+    sender->packet[1] = (sender->runs >> 8) & 0xFF;
+    sender->packet[2] = sender->runs & 0xFF;
+    if (llwrite(sender->packet, BLOCK_HEADER_SIZE + sender->runs * BLOCK_RUN_SIZE) == -1) {
+        printf("Error - Not possible to send block packet\n");
+        return -1;
+    }
+    sender->runs = 0;
+    return 0;
+}
 
-        end_t = clock();   // End time
+// Adds a block of the receiver's copy to the file sent, extending the current run if it follows it.
+// Returns 0 on success or "-1" on error.
+static int sendBlock(DeltaSender *sender, uint32_t block) {
+    deltaStats.matchedBytes += DELTA_BLOCK_SIZE;
 
-        printf("All data Received ✓\n");
+    if (sender->length > 0 && block == sender->first + sender->length && sender->length < 0xFFFF) {
+        sender->length++;
+        return 0;
     }
 
-    // Close link layer
-    clock_t start_t_close, end_t_close; // Time variables
-    start_t_close = clock(); // Start time
-    llclose(FALSE);
-    end_t_close = clock();   // End time
-    printf("Connection Closed ✓\n");
+    // The packet is sent once the current run fills it
+    if (sender->length > 0 && sender->runs + 1 == BLOCK_RUNS_PER_PACKET) {
+        if (flushBlockRuns(sender) == -1) {
+            return -1;
+        }
+    }
+    closeBlockRun(sender);
 
-    // Print statistics
-    struct stat file_stat;
+    sender->first = block;
+    sender->length = 1;
+    return 0;
+}
+
+// Sends size bytes of data of the file in Middle packets, after the block runs gathered before them.
+// Returns 0 on success or "-1" on error.
+static int sendLiteral(DeltaSender *sender, const unsigned char *data, long size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (flushBlockRuns(sender) == -1) {
+        return -1;
+    }
+    deltaStats.literalBytes += size;
+
+    while (size > 0) {
+        unsigned bytes_to_send = size < MAX_PAYLOAD_SIZE - 4 ? size : MAX_PAYLOAD_SIZE - 4;
+
+        unsigned char header[4];
+        header[0] = MIDDLE_PACKET;                  // Control field for data
+        header[1] = sender->sequenceNumber;         // Sequence number (0 or 1)
+        header[2] = (bytes_to_send >> 8) & 0xFF;    // High byte of size
+        header[3] = bytes_to_send & 0xFF;           // Low byte of size
+        struct iovec dataPacket[2] = {
+            {.iov_base = header, .iov_len = sizeof(header)},
+            {.iov_base = (void *)data, .iov_len = bytes_to_send}
+        };
+
+        if (llwritev(dataPacket, 2) == -1) {
+            printf("Error - Not possible to send data packet\n");
+            return -1;
+        }
+
+        sender->sequenceNumber = 1 - sender->sequenceNumber;
+        data += bytes_to_send;
+        size -= bytes_to_send;
+    }
+    return 0;
+}
+
+int DeltaTransmitterApp(const char *filename) {
+    struct stat file_stat;
+    if (stat(filename, &file_stat) < 0) {
+        perror("Error getting file information.");
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error - Not possible to open file\n");
+        return -1;
+    }
+    long size = file_stat.st_size;
+    const unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Error mapping file");
+            close(fd);
+            return -1;
+        }
+    }
+
+    SignatureTable table;
+    DeltaSender *sender = calloc(1, sizeof(DeltaSender));
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int result = -1;
+    if (sender == NULL || receiveSignatures(&table) == -1) {
+        goto cleanup;
+    }
+
+    // Starting / Ending packet (file size and name), the Ending one also carries the SHA-256 of the file
+    unsigned int fileSize = sizeof(file_stat.st_size);
+    unsigned int filenameSize = strlen(filename);
+    unsigned int packet_size = 5 + fileSize + filenameSize;
+
+    if (packet_size + 2 + SHA256_SIZE > MAX_PAYLOAD_SIZE) {
+        printf("Error - File name too long\n");
+        goto cleanup;
+    }
+    packet[0] = STARTING_PACKET;
+    packet[1] = FILE_SIZE;
+    packet[2] = fileSize;
+    memcpy(&packet[3], &file_stat.st_size, fileSize);
+    packet[3 + fileSize] = FILE_NAME;
+    packet[4 + fileSize] = filenameSize;
+    memcpy(&packet[5 + fileSize], filename, filenameSize);
+
+    if (llwrite(packet, packet_size) == -1) {
+        printf("Error - Not possible to send starting packet\n");
+        goto cleanup;
+    }
+
+    // Look for a block of the receiver's copy at every offset, the data before a match is sent as is
+    long position = 0;
+    long literalStart = 0;
+    int rolling = FALSE;        // TRUE if sum is the checksum of the block at position
+    RollingChecksum sum;
+
+    while (table.count > 0 && position + DELTA_BLOCK_SIZE <= size) {
+        if (!rolling) {
+            rollingInit(&sum, data + position, DELTA_BLOCK_SIZE);
+            rolling = TRUE;
+        }
+
+        int block = findBlock(&table, rollingValue(&sum), data + position);
+        if (block != -1) {
+            if (sendLiteral(sender, data + literalStart, position - literalStart) == -1 || sendBlock(sender, block) == -1) {
+                goto cleanup;
+            }
+            position += DELTA_BLOCK_SIZE;
+            literalStart = position;
+            rolling = FALSE;
+        }
+        else {
+            if (position + DELTA_BLOCK_SIZE < size) {
+                rollingRoll(&sum, data[position], data[position + DELTA_BLOCK_SIZE], DELTA_BLOCK_SIZE);
+            }
+            position++;
+        }
+    }
+    if (sendLiteral(sender, data + literalStart, size - literalStart) == -1 || flushBlockRuns(sender) == -1) {
+        goto cleanup;
+    }
+
+    // Ending packet
+    packet[0] = ENDING_PACKET;
+    packet[packet_size] = FILE_HASH;
+    packet[packet_size + 1] = SHA256_SIZE;
+    sha256(data, size, &packet[packet_size + 2]);
+    if (llwrite(packet, packet_size + 2 + SHA256_SIZE) == -1) {
+        printf("Error - Not possible to send ending packet\n");
+        goto cleanup;
+    }
+    result = 0;
+
+cleanup:
+    if (sender != NULL) {
+        freeSignatures(&table);
+    }
+    free(sender);
+    if (data != NULL) {
+        munmap((void *)data, size);
+    }
+    close(fd);
+    return result;
+}
+
+// Returns the SHA-256 in the parameters of an Ending packet, or NULL if it has none.
+static const unsigned char *packetHash(const unsigned char *packet, int size) {
+    int i = 1;
+    while (i + 2 <= size && i + 2 + packet[i + 1] <= size) {
+        if (packet[i] == FILE_HASH && packet[i + 1] == SHA256_SIZE) {
+            return &packet[i + 2];
+        }
+        i += 2 + packet[i + 1];
+    }
+    return NULL;
+}
+
+int DeltaReceiverApp(const char *filename) {
+    if (sendSignatures(filename) == -1) {
+        return -1;
+    }
+
+    // The file is rebuilt next to the copy, which replaces once complete
+    char rebuiltFilename[strlen(filename) + sizeof(".delta")];
+    sprintf(rebuiltFilename, "%s.delta", filename);
+
+    int copy = open(filename, O_RDONLY);
+    FILE *file = NULL;
+    Sha256 hash;
+    unsigned char dataPacket[MAX_PAYLOAD_SIZE];
+    unsigned char block[DELTA_BLOCK_SIZE];
+    int result = -1;
+
+    while (TRUE) {
+        int bytesRead = llread(dataPacket);
+        if (bytesRead == -1) {
+            printf("Error - Not possible to read data packet.\n");
+            break;
+        }
+        if (bytesRead == 0) {
+            continue;
+        }
+
+        if (dataPacket[0] == STARTING_PACKET && file == NULL) {
+            file = fopen(rebuiltFilename, "wb");
+            if (file == NULL) {
+                printf("Error - Not possible to open file\n");
+                break;
+            }
+            sha256Init(&hash);
+        }
+        else if (dataPacket[0] == MIDDLE_PACKET && file != NULL) {
+            if (fwrite(&dataPacket[4], 1, bytesRead - 4, file) != bytesRead - 4) {
+                printf("Error - Not possible to write data to file.\n");
+                break;
+            }
+            sha256Update(&hash, &dataPacket[4], bytesRead - 4);
+            deltaStats.literalBytes += bytesRead - 4;
+        }
+        else if (dataPacket[0] == BLOCK_PACKET && file != NULL && bytesRead >= BLOCK_HEADER_SIZE) {
+            int runs = (dataPacket[1] << 8) | dataPacket[2];
+            if (bytesRead != BLOCK_HEADER_SIZE + runs * BLOCK_RUN_SIZE) {
+                printf("Error - Invalid packet.\n");
+                break;
+            }
+
+            // Copy every block of every run from the copy
+            int failed = FALSE;
+            for (int r = 0; r < runs && !failed; r++) {
+                const unsigned char *run = &dataPacket[BLOCK_HEADER_SIZE + r * BLOCK_RUN_SIZE];
+                uint32_t first = (uint32_t)run[0] << 24 | run[1] << 16 | run[2] << 8 | run[3];
+                int length = (run[4] << 8) | run[5];
+
+                for (int b = 0; b < length && !failed; b++) {
+                    off_t offset = (off_t)(first + b) * DELTA_BLOCK_SIZE;
+                    if (copy < 0 || pread(copy, block, DELTA_BLOCK_SIZE, offset) != DELTA_BLOCK_SIZE) {
+                        printf("Error - Block %u is not in the copy of the file\n", first + b);
+                        failed = TRUE;
+                    }
+                    else if (fwrite(block, 1, DELTA_BLOCK_SIZE, file) != DELTA_BLOCK_SIZE) {
+                        printf("Error - Not possible to write data to file.\n");
+                        failed = TRUE;
+                    }
+                    else {
+                        sha256Update(&hash, block, DELTA_BLOCK_SIZE);
+                        deltaStats.matchedBytes += DELTA_BLOCK_SIZE;
+                    }
+                }
+            }
+            if (failed) {
+                break;
+            }
+        }
+        else if (dataPacket[0] == ENDING_PACKET && file != NULL) {
+            unsigned char digest[SHA256_SIZE];
+            sha256Final(&hash, digest);
+
+            const unsigned char *expected = packetHash(dataPacket, bytesRead);
+            if (expected == NULL || memcmp(expected, digest, SHA256_SIZE) != 0) {
+                printf("Error - The file rebuilt does not match the file sent\n");
+                break;
+            }
+            if (fclose(file) != 0 || rename(rebuiltFilename, filename) != 0) {
+                file = NULL;
+                printf("Error - Not possible to replace the copy of the file\n");
+                break;
+            }
+            file = NULL;
+            result = 0;
+            break;
+        }
+        else {
+            printf("Error - Invalid packet.\n");
+            break;
+        }
+    }
+
+    // The copy is kept as it was on error
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (result == -1) {
+        remove(rebuiltFilename);
+    }
+    if (copy >= 0) {
+        close(copy);
+    }
+    return result;
+}
+
+////////////////////////////////////////////////
+// BONDED MODE
+////////////////////////////////////////////////
+// One transfer is striped across several serial ports: data chunk k goes through link k % nLinks.
+// Each link runs in its own process, since the link layer keeps one connection per process.
+
+int TransmitterStripe(const char *filename, int linkIndex, int nLinks) {
+    struct stat file_stat;
+    if (stat(filename, &file_stat) < 0) {
+        perror("Error getting file information.");
+        return -1;
+    }
+
+    int fileFd = open(filename, O_RDONLY);
+    if (fileFd < 0) {
+        printf("Error - Not possible to open file\n");
+        return -1;
+    }
+
+    // Every link announces the whole file, so each receiver can preallocate it
+    unsigned int fileSize = sizeof(file_stat.st_size);
+    unsigned int filenameSize = strlen(filename);
+    unsigned int packet_size = 5 + fileSize + filenameSize;
+
+    unsigned char packet[packet_size];
+    packet[0] = STARTING_PACKET;
+    packet[1] = FILE_SIZE;
+    packet[2] = fileSize;
+    memcpy(&packet[3], &file_stat.st_size, fileSize);
+    packet[3 + fileSize] = FILE_NAME;
+    packet[4 + fileSize] = filenameSize;
+    memcpy(&packet[5 + fileSize], filename, filenameSize);
+
+    if (llwrite(packet, packet_size) == -1) {
+        printf("Error - Not possible to send starting packet\n");
+        close(fileFd);
+        return -1;
+    }
+
+    // Send this link's share of the chunks, each one tagged with its offset
+    unsigned char dataPacket[MAX_PAYLOAD_SIZE];
+    for (off_t offset = (off_t)linkIndex * STRIPE_DATA_SIZE; offset < file_stat.st_size; offset += (off_t)nLinks * STRIPE_DATA_SIZE) {
+        traceBegin(TRACE_DISK_READ, -1, 0);
+        ssize_t bytes_to_send = pread(fileFd, &dataPacket[STRIPE_HEADER_SIZE], STRIPE_DATA_SIZE, offset);
+        traceEnd(TRACE_DISK_READ, -1, bytes_to_send);
+        if (bytes_to_send <= 0) {
+            printf("Error - Not possible to read file\n");
+            close(fileFd);
+            return -1;
+        }
+
+        dataPacket[0] = STRIPE_PACKET;
+        for (int i = 0; i < 8; i++) {
+            dataPacket[1 + i] = ((unsigned long long)offset >> (56 - 8 * i)) & 0xFF;   // Offset (big endian)
+        }
+        dataPacket[9] = (bytes_to_send >> 8) & 0xFF;    // High byte of size
+        dataPacket[10] = bytes_to_send & 0xFF;          // Low byte of size
+
+        if (llwrite(dataPacket, STRIPE_HEADER_SIZE + bytes_to_send) == -1) {
+            printf("Error - Not possible to send data packet\n");
+            close(fileFd);
+            return -1;
+        }
+    }
+
+    packet[0] = ENDING_PACKET;
+    if (llwrite(packet, packet_size) == -1) {
+        printf("Error - Not possible to send ending packet\n");
+        close(fileFd);
+        return -1;
+    }
+
+    close(fileFd);
+    return 0;
+}
+
+int ReceiverStripe(const char *filename) {
+    // The file was already created (and truncated) by the parent process
+    int fileFd = open(filename, O_WRONLY);
+    if (fileFd < 0) {
+        printf("Error - Not possible to open file\n");
+        return -1;
+    }
+
+    unsigned char dataPacket[MAX_PAYLOAD_SIZE + 4];
+
+    while (TRUE) {
+        int bytesRead = llread(dataPacket);
+        if (bytesRead == -1) {
+            printf("Error - Not possible to read data packet.\n");
+            close(fileFd);
+            return -1;
+        }
+        if (bytesRead == 0) {
+            continue;
+        }
+
+        if (dataPacket[0] == STARTING_PACKET) {
+            // Preallocate the whole file, chunks from the other links land in the holes
+            off_t fileSize;
+            memcpy(&fileSize, &dataPacket[3], sizeof(fileSize));
+            if (ftruncate(fileFd, fileSize) == -1) {
+                perror("Error - Not possible to preallocate file");
+            }
+        }
+        else if (dataPacket[0] == STRIPE_PACKET && bytesRead >= STRIPE_HEADER_SIZE) {
+            unsigned long long offset = 0;
+            for (int i = 0; i < 8; i++) {
+                offset = (offset << 8) | dataPacket[1 + i];
+            }
+            int size = (dataPacket[9] << 8) | dataPacket[10];
+
+            ssize_t written = -1;
+            if (size == bytesRead - STRIPE_HEADER_SIZE) {
+                traceBegin(TRACE_DISK_WRITE, -1, size);
+                written = pwrite(fileFd, &dataPacket[STRIPE_HEADER_SIZE], size, offset);
+                traceEnd(TRACE_DISK_WRITE, -1, 0);
+            }
+            if (written != size) {
+                printf("Error - Not possible to write data to file.\n");
+                close(fileFd);
+                return -1;
+            }
+        }
+        else if (dataPacket[0] == ENDING_PACKET) {
+            break;
+        }
+        else {
+            printf("Error - Invalid packet.\n");
+            close(fileFd);
+            return -1;
+        }
+    }
+
+    close(fileFd);
+    return 0;
+}
+
+int BondedApp(LinkLayer layer, const char *serialPorts, const char *filename) {
+    // Split the comma separated list of serial ports
+    char ports[MAX_BONDED_LINKS][sizeof(layer.serialPort)];
+    int nLinks = 0;
+
+    const char *port = serialPorts;
+    while (*port != '\0' && nLinks < MAX_BONDED_LINKS) {
+        size_t length = strcspn(port, ",");
+        if (length > 0 && length < sizeof(layer.serialPort)) {
+            memcpy(ports[nLinks], port, length);
+            ports[nLinks][length] = '\0';
+            nLinks++;
+        }
+        port += length;
+        if (*port == ',') {
+            port++;
+        }
+    }
+
+    if (nLinks == 0) {
+        printf("Error - No serial ports given\n");
+        return -1;
+    }
+
+    // Create (and truncate) the output file once, before the links start writing to it
+    if (layer.role == LlRx) {
+        int fileFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileFd < 0) {
+            printf("Error - Not possible to open file\n");
+            return -1;
+        }
+        close(fileFd);
+    }
+
+    double start = monotonicSeconds();
+
+    pid_t pids[MAX_BONDED_LINKS];
+    for (int i = 0; i < nLinks; i++) {
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            perror("Error - Not possible to start link process");
+            nLinks = i;
+            break;
+        }
+
+        if (pids[i] == 0) {
+            LinkLayer link = layer;
+            sprintf(link.serialPort, "%s", ports[i]);
+
+            // Each link is traced to <LL_TRACE>.<pid>, dumped before _exit as atexit does not run
+            if (traceFork() == -1) {
+                printf("Error - Not possible to trace the link on %s\n", link.serialPort);
+            }
+
+            if (llopen(link) == -1) {
+                printf("Error - Not possible to open link layer on %s.\n", link.serialPort);
+                traceDump();
+                _exit(1);
+            }
+
+            int result = (layer.role == LlTx) ? TransmitterStripe(filename, i, nLinks) : ReceiverStripe(filename);
+
+            llclose(FALSE);
+            traceDump();
+            _exit(result == 0 ? 0 : 1);
+        }
+    }
+
+    // Wait for every link
+    int failed = 0;
+    for (int i = 0; i < nLinks; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("Error - Link %d (%s) failed\n", i, ports[i]);
+            failed++;
+        }
+    }
+
+    double elapsed = monotonicSeconds() - start;
+
+    if (failed) {
+        return -1;
+    }
+
+    printf("All data %s over %d links ✓\n", layer.role == LlTx ? "Sent" : "Received", nLinks);
+
+    struct stat file_stat;
+    if (stat(filename, &file_stat) == 0) {
+        printf("\nStatistics:\n");
+        printf("  -Time elapsed: %f seconds\n", elapsed);
+        printf("  -Size transfered: %ld bytes\n", file_stat.st_size);
+        printf("  -Aggregate transfer rate: %f bytes/second\n", (double)file_stat.st_size / elapsed);
+    }
+
+    return 0;
+}
+
+// FEC group size asked for: transmitters use plain ARQ and receivers accept any size unless LL_FEC says otherwise
+static int fecGroupSize(LinkLayerRole role) {
+    const char *value = getenv(FEC_ENV);
+    if (value != NULL) {
+        return atoi(value);
+    }
+    return role == LlRx ? MAX_FEC_GROUP : 0;
+}
+
+void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename) {
+    // Create link layer
+    LinkLayer layer;
+
+    layer.baudRate = baudRate;
+    layer.nRetransmissions = nTries;
+
+    if (strcmp(role, "tx") == 0) {
+        layer.role = LlTx;
+    }
+    if (strcmp(role, "rx") == 0) {
+        layer.role = LlRx;
+    }
+
+    layer.timeout = timeout;
+    layer.fecGroup = fecGroupSize(layer.role);
+
+    const char *recoveryTime = getenv(RECOVERY_ENV);
+    layer.recoveryTime = recoveryTime != NULL ? atoi(recoveryTime) : DEFAULT_RECOVERY_TIME;
+
+    const char *maxBaudRate = getenv(MAX_BAUDRATE_ENV);
+    layer.maxBaudRate = maxBaudRate != NULL ? atoi(maxBaudRate) : DEFAULT_MAX_BAUDRATE;
+
+    const char *traceFilename = getenv(TRACE_ENV);
+    if (traceFilename != NULL && traceStart(traceFilename) == -1) {
+        printf("Error - Not possible to start tracing to %s\n", traceFilename);
+    }
+
+    // Full-duplex mode: the other file, sent by the receiver to the transmitter
+    const char *duplexFilename = getenv(DUPLEX_ENV);
+
+    // Delta mode: the receiver sends the signatures of its copy back, over a full-duplex session
+    int delta = (getenv(DELTA_ENV) != NULL);
+    if (delta && duplexFilename != NULL) {
+        printf("Error - Delta mode can not send a file the other way\n");
+        return;
+    }
+    layer.duplex = (duplexFilename != NULL) || delta;
+
+    // Only plain ARQ resumes a lost session, FEC groups and full-duplex windows can not be rewound
+    if (layer.recoveryTime > 0 && (getenv(FEC_ENV) != NULL || layer.duplex)) {
+        printf("Error - Session recovery is not available in FEC, full-duplex and delta modes\n");
+        return;
+    }
+
+    // Telemetry: messages on a channel of their own, between the packets of a plain transfer
+    const char *telemetryInterval = getenv(TELEMETRY_ENV);
+    int telemetry = telemetryInterval != NULL ? atoi(telemetryInterval) : 0;
+    if (telemetry > 0 && (layer.duplex || strchr(serialPort, ',') != NULL)) {
+        printf("Error - Telemetry is not available in full-duplex, delta and bonded modes\n");
+        return;
+    }
+
+    // Bonded mode: several serial ports separated by ',' share one transfer
+    if (strchr(serialPort, ',') != NULL) {
+        if (layer.duplex) {
+            printf("Error - Full-duplex and delta modes are not available over bonded links\n");
+            return;
+        }
+        BondedApp(layer, serialPort, filename);
+        return;
+    }
+
+    sprintf(layer.serialPort, "%s", serialPort);
+
+    // Open link layer
+    double start_t_open, end_t_open; // Time variables
+    start_t_open = monotonicSeconds(); // Start time
+    if (llopen(layer) == -1) {
+        printf("Error - Not possible to open link layer.\n");
+        return;
+    }
+    end_t_open = monotonicSeconds();   // End time
+    printf("\nConnection established ✓\n");
+    
+    // Run application layer
+    double start_t = 0, end_t = 0; // Time variables
+    if (delta) {
+        start_t = monotonicSeconds(); // Start time
+
+        if (layer.role == LlTx) {
+            DeltaTransmitterApp(filename);
+        }
+        else {
+            DeltaReceiverApp(filename);
+        }
+
+        end_t = monotonicSeconds();   // End time
+
+        printf("All changes Sent ✓\n");
+    }
+    else if (layer.duplex) {
+        start_t = monotonicSeconds(); // Start time
+
+        // Transmitter sends filename, receiver writes it
+        if (layer.role == LlTx) {
+            DuplexApp(filename, duplexFilename);
+        }
+        else {
+            DuplexApp(duplexFilename, filename);
+        }
+
+        end_t = monotonicSeconds();   // End time
+
+        printf("All data Sent and Received ✓\n");
+    }
+    else if (layer.role == LlTx) {
+        start_t = monotonicSeconds(); // Start time
+
+        TransmitterApp(filename, telemetry);  // Main App
+
+        end_t = monotonicSeconds();   // End time
+
+        printf("All data Sent ✓\n");
+    }
+    else if (layer.role == LlRx) {
+        start_t = monotonicSeconds(); // Start time
+
+        ReceiverApp(filename);     // Main App
+
+        end_t = monotonicSeconds();   // End time
+
+        printf("All data Received ✓\n");
+    }
+
+    // Latency of each channel, the connection is gone after llclose
+    LinkStatistics linkStats;
+    llstatistics(&linkStats);
+
+    // Close link layer
+    double start_t_close, end_t_close; // Time variables
+    start_t_close = monotonicSeconds(); // Start time
+    llclose(FALSE);
+    end_t_close = monotonicSeconds();   // End time
+    printf("Connection Closed ✓\n");
+
+    // Print statistics
+    struct stat file_stat;
     if (stat(filename, &file_stat) < 0) {
         perror("Error - Not possible to get file info (Stats will not be printed).");
     }
     else {
         printf("\nStatistics:\n");
-        printf("  -Total time elapsed: %f seconds\n", (double)(end_t_close - start_t_open) / CLOCKS_PER_SEC);
-        printf("  -Time elapsed (llopen): %f seconds\n", (double)(end_t_open - start_t_open) / CLOCKS_PER_SEC);
-        printf("  -Time elapsed transfering data: %f seconds\n", (double)(end_t - start_t) / CLOCKS_PER_SEC);
-        printf("  -Time elapsed (llclose): %f seconds\n", (double)(end_t_close - start_t_close) / CLOCKS_PER_SEC);
+        printf("  -Total time elapsed: %f seconds\n", end_t_close - start_t_open);
+        printf("  -Time elapsed (llopen): %f seconds\n", end_t_open - start_t_open);
+        printf("  -Time elapsed transfering data: %f seconds\n", end_t - start_t);
+        printf("  -Time elapsed (llclose): %f seconds\n", end_t_close - start_t_close);
         printf("  -Size transfered: %ld bytes\n", file_stat.st_size);
-        printf("  -Transfer rate: %f bytes/second\n", (double)file_stat.st_size / ((double)(end_t - start_t) / CLOCKS_PER_SEC));
+        printf("  -Transfer rate: %f bytes/second\n", (double)file_stat.st_size / (end_t - start_t));
+
+        struct stat duplex_stat;
+        if (duplexFilename != NULL && stat(duplexFilename, &duplex_stat) == 0) {
+            printf("  -Size transfered the other way: %ld bytes\n", duplex_stat.st_size);
+            printf("  -Aggregate transfer rate: %f bytes/second\n", (double)(file_stat.st_size + duplex_stat.st_size) / (end_t - start_t));
+        }
+
+        if (delta) {
+            printf("  -Blocks of the receiver's copy: %ld (%d bytes each)\n", deltaStats.signatures, DELTA_BLOCK_SIZE);
+            printf("  -Bytes sent as data: %ld\n", deltaStats.literalBytes);
+            printf("  -Bytes sent as block references: %ld\n", deltaStats.matchedBytes);
+        }
+
+        if (telemetryStats.sent > 0) {
+            printf("  -Telemetry messages sent: %ld\n", telemetryStats.sent);
+
+            // FEC groups are acknowledged after the write returns, the latency then only lasts until the frame was sent
+            const char *latency = linkStats.paritySent > 0 ? "time to send" : "latency";
+            for (int i = 0; i < LL_CHANNELS; i++) {
+                long packets = linkStats.channelPackets[i];
+                if (packets > 0) {
+                    printf("  -Channel %d%s: %ld packets, %s %.3f ms average (%.3f ms waiting for other channels), %.3f ms max\n",
+                           i, i == TELEMETRY_CHANNEL ? " (telemetry)" : i == LL_BULK_CHANNEL ? " (file)" : "", packets, latency,
+                           linkStats.channelLatencyUs[i] / 1000.0 / packets, linkStats.channelWaitUs[i] / 1000.0 / packets,
+                           linkStats.channelMaxLatencyUs[i] / 1000.0);
+                }
+            }
+        }
+        if (telemetryStats.received > 0) {
+            printf("  -Telemetry messages received: %ld (last: %s)\n", telemetryStats.received, telemetryStats.last);
+        }
+
+        if (writeBehindStats.packets > 0) {
+            printf("  -Write-behind queue depth: %.1f mean, %d max (of %d packets)\n",
+                   (double)writeBehindStats.depthSum / writeBehindStats.packets, writeBehindStats.maxDepth, WRITE_QUEUE_SIZE);
+            printf("  -Time elapsed writing to disk: %f seconds\n", writeBehindStats.diskTime);
+            printf("  -Receiver stalled on a full queue: %ld times, %f seconds\n", writeBehindStats.stalls, writeBehindStats.stallTime);
+        }
     }
 
 }
@@ -1,9 +1,13 @@
 #include "link_layer.h"
 
+#include "../include/trace.h"
 #include "../include/utils.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,32 +15,511 @@
 
 #define _POSIX_SOURCE 1     // POSIX compliant source
 
-LinkLayer layer;            // Link layer connection parameters
-int fd;                     // File descriptor for serial port
-struct termios oldtio;      // Old Terminal I/O structure
-struct termios newtio;      // New Terminal I/O structure
+// FEC group: up to fecGroup I frames followed by one parity frame, the XOR of their payloads.
+// The receiver rebuilds one lost or corrupted frame of a group from the others and the parity,
+// and acknowledges (RR) or rejects (REJ) the group as a whole, once.
+typedef struct {
+    int sequence;                                           // Sequence of the group (0 or 1), in the control field of its frames
+    int count;                                              // Frames in the group (the parity announces the final count)
+    unsigned char payloads[MAX_FEC_GROUP][MAX_PAYLOAD_SIZE];
+    int sizes[MAX_FEC_GROUP];
+    int received[MAX_FEC_GROUP];                            // Receiver: TRUE once the frame arrived or was rebuilt
+    int delivered;                                          // Receiver: frames handed to the application, in order
+    unsigned char parity[MAX_PAYLOAD_SIZE];                 // XOR of the payloads, padded with zeros
+    int paritySize;                                         // Size of the largest payload
+    int sizesXor;                                           // XOR of the payload sizes
+    int hasParity;                                          // Receiver: TRUE once the parity arrived
+} FecGroup;
+
+// Packets received by a full-duplex session and not yet read, in order.
+typedef struct {
+    unsigned char packets[DUPLEX_INBOX_SIZE][MAX_PAYLOAD_SIZE];
+    int sizes[DUPLEX_INBOX_SIZE];
+    int first;                                              // Oldest packet
+    int count;
+} DuplexInbox;
+
+struct LinkConnection {
+    LinkLayer layer;            // Link layer connection parameters
+    int fd;                     // File descriptor for serial port
+    struct termios oldtio;      // Old Terminal I/O structure
+    struct termios newtio;      // New Terminal I/O structure
+    FrameReader reader;         // Buffered frame reader of the serial port
+    int lastSequence;           // Sequence of the last I frame sent (0 or 1)
+    int lastReceivedSequence;   // Sequence of the last I frame accepted (0, 1 or -1 if none)
+    LinkStatistics stats;       // Counters shown on close
+    int passive;                // TRUE if opened with ll_listen
+    int session;                // LINK_SESSION_* state of the peer session
+    int fecGroup;               // Negotiated FEC group size, 0 for plain stop-and-wait ARQ
+    FecGroup *group;            // Group being sent or received, only with FEC
+    DuplexInbox *inbox;         // Packets received and not yet read, only in full-duplex sessions
+    int ackPending;             // Full-duplex: the last I frame received waits for an I frame to carry its acknowledgement
+    int baseSpeed;              // Index in speeds of layer.baudRate, the baudrate every session starts at
+    int speed;                  // Index in speeds of the current baudrate
+    int speedOffer;             // Index in speeds of the fastest baudrate this end accepts to switch to
+    pthread_mutex_t writeLock;  // Turns of the writers of the channels
+    pthread_cond_t writeTurn;
+    int writing;                // TRUE while a packet is being sent
+    int waiting[LL_CHANNELS];   // Writers waiting for their turn, per channel
+};
+
+// Session states
+#define LINK_SESSION_IDLE       0   // Waiting for SET
+#define LINK_SESSION_OPEN       1   // SET/UA exchanged
+#define LINK_SESSION_CLOSING    2   // DISC answered, waiting for UA
+#define LINK_SESSION_REOPENED   3   // SET/UA of a new session exchanged while one was open, not reported yet
+
+static LinkConnection *defaultLink = NULL;  // Connection used by llopen, llwrite, llread and llclose
+
+////////////////////////////////////////////////
+// BAUDRATE
+////////////////////////////////////////////////
+// Sessions start at layer.baudRate. The SET offers the fastest baudrate the transmitter accepts and the UA
+// answers the fastest both ends accept. Both ends then switch, and the transmitter confirms the new baudrate
+// with a test frame; if it is not answered, both ends go back to the initial baudrate. Later in the session,
+// the transmitter asks for the initial baudrate again with a SET once a frame runs out of retransmissions.
+static const struct {
+    int baudRate;
+    speed_t speed;
+} speeds[] = {
+    {1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400},
+    {57600, B57600}, {115200, B115200}, {230400, B230400}, {460800, B460800}, {500000, B500000},
+    {576000, B576000}, {921600, B921600}, {1000000, B1000000}, {1152000, B1152000}, {1500000, B1500000},
+    {2000000, B2000000}, {2500000, B2500000}, {3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+};
+#define N_SPEEDS (int)(sizeof(speeds) / sizeof(speeds[0]))
+
+// Test frame confirming a new baudrate: a SET carrying every byte value, stuffed ones included
+#define SPEED_TEST_SIZE 256
+
+// Transmit queue left when an I frame is written, in milliseconds of the line, and at least MIN_TX_QUEUE bytes
+#define TX_QUEUE_MS     10
+#define MIN_TX_QUEUE    64
+
+// Returns the index in speeds of baudRate, or "-1" if it is not supported.
+static int speedIndex(int baudRate) {
+    for (int i = 0; i < N_SPEEDS; i++) {
+        if (speeds[i].baudRate == baudRate) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Switches the serial port to the baudrate of index in speeds, once the frames already written were sent.
+// Returns 0 on success or "-1" on error.
+static int setSpeed(LinkConnection *link, int index) {
+    tcdrain(link->fd);
+
+    cfsetispeed(&link->newtio, speeds[index].speed);
+    cfsetospeed(&link->newtio, speeds[index].speed);
+    if (tcsetattr(link->fd, TCSANOW, &link->newtio) == -1) {
+        printf("ERROR - Not possible to set the baudrate to %d\n", speeds[index].baudRate);
+        return -1;
+    }
+
+    link->speed = index;
+    return 0;
+}
+
+// Returns the index in speeds of the fastest baudrate up to maxBaudRate that the serial port keeps when set.
+// The port is left at the initial baudrate.
+static int probeSpeeds(LinkConnection *link, int maxBaudRate) {
+    int fastest = link->baseSpeed;
+
+    for (int i = N_SPEEDS - 1; i > link->baseSpeed; i--) {
+        if (speeds[i].baudRate > maxBaudRate || setSpeed(link, i) == -1) {
+            continue;
+        }
+
+        struct termios current;
+        if (tcgetattr(link->fd, &current) == 0 && cfgetospeed(&current) == speeds[i].speed) {
+            fastest = i;
+            break;
+        }
+    }
+
+    setSpeed(link, link->baseSpeed);
+    return fastest;
+}
+
+// Goes back to the initial baudrate after errors at a negotiated one, until the next session.
+// Returns 0 on success or "-1" on error.
+static int fallBackSpeed(LinkConnection *link) {
+    printf("Falling back from %d to %d baud\n", speeds[link->speed].baudRate, speeds[link->baseSpeed].baudRate);
+    link->speedOffer = link->baseSpeed;
+    return setSpeed(link, link->baseSpeed);
+}
+
+// Returns the nanoseconds bytes take on the line at the current baudrate (10 bits per byte: start, 8 data and stop).
+static long lineTime(const LinkConnection *link, int bytes) {
+    return (long long)bytes * 10 * 1000000000LL / speeds[link->speed].baudRate;
+}
+
+// Sets deadline to the time out of the answer to the frame just written. The frames are written without waiting
+// for them to leave, so the time out starts once the bytes still in the transmit queue (TIOCOUTQ) would be sent.
+static void answerDeadline(const LinkConnection *link, struct timespec *deadline) {
+    int queued;
+    long delay = ioctl(link->fd, TIOCOUTQ, &queued) == 0 && queued > 0 ? lineTime(link, queued) : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += link->layer.timeout + delay / 1000000000;
+    deadline->tv_nsec += delay % 1000000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Writes an I frame once the transmit queue (TIOCOUTQ) is down to TX_QUEUE_MS of the line: deep enough to keep it
+// busy, short enough not to delay the frames written next (acknowledgements of the other direction) much longer.
+// Returns 0 on success or "-1" on error.
+static int sendInformationFrame(LinkConnection *link, const unsigned char *frame, int frameSize) {
+    int baudRate = speeds[link->speed].baudRate;
+    int maxQueued = baudRate / 10 * TX_QUEUE_MS / 1000;     // 10 bits per byte: start, 8 data and stop
+    if (maxQueued < MIN_TX_QUEUE) {
+        maxQueued = MIN_TX_QUEUE;
+    }
+
+    int queued;
+    if (ioctl(link->fd, TIOCOUTQ, &queued) == 0 && queued > maxQueued) {
+        link->stats.paced++;
+
+        // Sleep for as long as the bytes over the limit take on the line
+        while (queued > maxQueued) {
+            long delay = lineTime(link, queued - maxQueued);
+            struct timespec ts = {.tv_sec = delay / 1000000000, .tv_nsec = delay % 1000000000};
+            nanosleep(&ts, NULL);
+
+            if (ioctl(link->fd, TIOCOUTQ, &queued) == -1) {
+                break;
+            }
+        }
+    }
+
+    if (writeFrame(link->fd, frame, frameSize) == -1) {
+        printf("ERROR - Not possible to write to Serial Port\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns TRUE if the frame is the test frame of a new baudrate, received intact.
+static int isSpeedTest(const unsigned char *frame, int frameSize) {
+    if (frameSize < SPEED_TEST_SIZE + 6 || frame[2] != C_SET || frame[3] != BCC1(A_T, C_SET)) {
+        return FALSE;
+    }
+
+    unsigned char data[frameSize];
+    int dataSize = destuffData(frame + 4, frameSize - 5, data);
+    if (dataSize != SPEED_TEST_SIZE + 1 || data[SPEED_TEST_SIZE] != BCC2(data, SPEED_TEST_SIZE)) {
+        return FALSE;
+    }
+    for (int i = 0; i < SPEED_TEST_SIZE; i++) {
+        if (data[i] != i) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Transmitter: switches to the baudrate of index, agreed in the UA, and sends the test frame until it is answered.
+// Otherwise goes back to the initial baudrate, where the receiver also returns once the test frame does not arrive.
+// Returns TRUE if confirmed, FALSE after falling back or "-1" on error.
+static int confirmSpeed(LinkConnection *link, int index) {
+    if (setSpeed(link, index) == -1) {
+        return -1;
+    }
+
+    unsigned char data[SPEED_TEST_SIZE];
+    for (int i = 0; i < SPEED_TEST_SIZE; i++) {
+        data[i] = i;
+    }
+    unsigned char test[2 * SPEED_TEST_SIZE + 7];
+    int testSize = encodeFrame(A_T, C_SET, data, SPEED_TEST_SIZE, test);
+
+    for (int tries = 0; tries < link->layer.nRetransmissions; tries++) {
+        if (writeFrame(link->fd, test, testSize) == -1) {
+            return -1;
+        }
+
+        // Receive UA
+        unsigned char frame[MAX_FRAME_SIZE];
+        struct timespec deadline;
+        answerDeadline(link, &deadline);
+        while (readFrameUntil(&link->reader, &deadline, frame, sizeof(frame)) != -1) {
+            if (frame[2] == C_UA && frame[3] == BCC1(A_R, C_UA)) {
+                printf("Switched to %d baud\n", speeds[index].baudRate);
+                link->speedOffer = index;
+                return TRUE;
+            }
+        }
+    }
+
+    if (fallBackSpeed(link) == -1) {
+        return -1;
+    }
+    return FALSE;
+}
+
+// Receiver: switches to the baudrate of index, agreed in the UA just sent, and answers the test frame with UA.
+// Goes back to the initial baudrate if the test frame does not arrive while the transmitter would send it.
+// Returns 0 on success or "-1" on error.
+static int awaitSpeedTest(LinkConnection *link, int index) {
+    if (setSpeed(link, index) == -1) {
+        return -1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += link->layer.nRetransmissions * link->layer.timeout;
+
+    unsigned char frame[MAX_FRAME_SIZE];
+    int frameSize;
+    while ((frameSize = readFrameUntil(&link->reader, &deadline, frame, sizeof(frame))) != -1) {
+        if (isSpeedTest(frame, frameSize)) {
+            printf("Switched to %d baud\n", speeds[index].baudRate);
+            link->speedOffer = index;
+            return sendSupervisionFrame(link->fd, A_R, C_UA);
+        }
+    }
+
+    return fallBackSpeed(link);
+}
 
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int initiateCommunicationTransmiter() {
+// Largest SET / UA: the supervision frame with a parameter byte, a speed byte and their BCC2, all stuffed
+#define MAX_PARAMETER_FRAME_SIZE 11
+
+// Parameter of SET / UA: the FEC group size, or this flag for a full-duplex session
+#define PARAMETER_DUPLEX 0x80
+
+// Parameter of the SET / UA resuming a session after the link was lost: this flag and a sequence.
+// The SET carries the sequence of the last I frame acknowledged, the UA the one of the last I frame accepted.
+#define PARAMETER_RESUME    0x40
+#define RESUME_SEQUENCE     0x01    // Sequence (0 or 1)
+#define RESUME_NONE         0x02    // UA: no I frame accepted yet
+
+// Parameter of the SET / UA going back to the initial baudrate (their speed byte) in the middle of a session
+#define PARAMETER_FALLBACK  0x20
+
+// Writes a supervision frame carrying a one byte parameter (SET and UA negotiating the FEC group size or full-duplex),
+// followed by a speed byte, 1 + an index in speeds, if speed is not 0.
+// Returns 0 on success, -1 otherwise
+static int sendParameterFrame(int fd, unsigned char a, unsigned char c, unsigned char parameter, unsigned char speed) {
+    unsigned char data[2] = {parameter, speed};
+    unsigned char frame[MAX_PARAMETER_FRAME_SIZE];
+    int frameSize = encodeFrame(a, c, data, speed != 0 ? 2 : 1, frame);
+
+    return writeFrame(fd, frame, frameSize);
+}
+
+// Copies the parameter and speed bytes of a SET / UA to data.
+// Returns how many there are, 0 for a plain 5 byte frame or corrupted parameters.
+static int frameParameters(const unsigned char *frame, int frameSize, unsigned char *data) {
+    if (frameSize < 7 || frameSize > MAX_PARAMETER_FRAME_SIZE) {
+        return 0;
+    }
+
+    int dataSize = destuffData(frame + 4, frameSize - 5, data);
+    if (dataSize < 2 || dataSize > 3 || data[dataSize - 1] != BCC2(data, dataSize - 1)) {
+        return 0;
+    }
+    return dataSize - 1;
+}
+
+// Returns the parameter of a SET / UA, 0 for a plain 5 byte frame or a corrupted parameter.
+static int frameParameter(const unsigned char *frame, int frameSize) {
+    unsigned char data[MAX_PARAMETER_FRAME_SIZE];
+    return frameParameters(frame, frameSize, data) > 0 ? data[0] : 0;
+}
+
+// Returns the index in speeds of the baudrate offered by a SET / UA, or "-1" if it offers none.
+static int frameSpeed(const unsigned char *frame, int frameSize) {
+    unsigned char data[MAX_PARAMETER_FRAME_SIZE];
+    if (frameParameters(frame, frameSize, data) != 2 || data[1] == 0 || data[1] > N_SPEEDS) {
+        return -1;
+    }
+    return data[1] - 1;
+}
+
+// Receiver: returns the index in speeds of the baudrate to answer a SET with, the fastest both ends accept,
+// or "-1" if the SET offers none.
+static int agreedSpeed(const LinkConnection *link, const unsigned char *frame, int frameSize) {
+    int offered = frameSpeed(frame, frameSize);
+    if (offered == -1) {
+        return -1;
+    }
+    return offered < link->speedOffer ? offered : link->speedOffer;
+}
+
+// Sets the FEC group size of the session, starting with an empty group of sequence 0.
+// Returns 0 on success or "-1" on error.
+static int setFecGroup(LinkConnection *link, int fecGroup) {
+    if (fecGroup > MAX_FEC_GROUP) {
+        fecGroup = MAX_FEC_GROUP;
+    }
+
+    if (fecGroup > 0 && link->group == NULL) {
+        link->group = malloc(sizeof(FecGroup));
+        if (link->group == NULL) {
+            printf("ERROR - Not possible to allocate FEC group\n");
+            return -1;
+        }
+    }
+    if (fecGroup <= 0) {
+        free(link->group);
+        link->group = NULL;
+        fecGroup = 0;
+    }
+
+    link->fecGroup = fecGroup;
+    if (link->group != NULL) {
+        memset(link->group, 0, sizeof(FecGroup));
+    }
+    return 0;
+}
+
+// Sets whether the session is full-duplex, starting with an empty inbox.
+// Returns 0 on success or "-1" on error.
+static int setDuplex(LinkConnection *link, int duplex) {
+    if (duplex && link->inbox == NULL) {
+        link->inbox = malloc(sizeof(DuplexInbox));
+        if (link->inbox == NULL) {
+            printf("ERROR - Not possible to allocate full-duplex inbox\n");
+            return -1;
+        }
+    }
+    if (!duplex) {
+        free(link->inbox);
+        link->inbox = NULL;
+    }
+
+    if (link->inbox != NULL) {
+        memset(link->inbox, 0, sizeof(DuplexInbox));
+    }
+    link->ackPending = FALSE;
+    return 0;
+}
+
+// Answers the SET resuming the session with UA, carrying the sequence of the last I frame accepted.
+// The session keeps its sequences and parameters.
+// Returns 0 on success or "-1" on error.
+static int acceptResume(LinkConnection *link, int parameter) {
+    printf("Resuming session (last I frame acknowledged: %d, accepted: %d)\n", parameter & RESUME_SEQUENCE, link->lastReceivedSequence);
+    link->stats.resumes++;
+    traceInstant(TRACE_RESUME, link->fd, 0, 0);
+
+    unsigned char answer = PARAMETER_RESUME;
+    answer |= link->lastReceivedSequence == -1 ? RESUME_NONE : link->lastReceivedSequence;
+    return sendParameterFrame(link->fd, A_R, C_UA, answer, 0);
+}
+
+// Answers the SET asking for the initial baudrate with UA, then switches to it. The session keeps its sequences
+// and parameters. If the UA is lost, the transmitter sends the SET again at the initial baudrate.
+// Returns 0 on success or "-1" on error.
+static int acceptFallback(LinkConnection *link) {
+    if (sendParameterFrame(link->fd, A_R, C_UA, PARAMETER_FALLBACK, link->baseSpeed + 1) == -1) {
+        return -1;
+    }
+    if (link->speed != link->baseSpeed) {
+        return fallBackSpeed(link);
+    }
+    return 0;
+}
+
+// Answers a SET with UA. A SET carrying a FEC group size is answered with the size both ends support,
+// and one asking for full-duplex with the flag if this end allows it (full-duplex sessions use plain ARQ).
+// A baudrate offered is answered with the fastest both ends accept, without switching to it.
+// Returns 0 on success or "-1" on error.
+static int acceptSet(LinkConnection *link, const unsigned char *frame, int frameSize) {
+    // Test frame sent again, the UA confirming the baudrate was lost
+    if (isSpeedTest(frame, frameSize)) {
+        return sendSupervisionFrame(link->fd, A_R, C_UA);
+    }
+    if (frameSize == 5) {
+        setFecGroup(link, 0);
+        setDuplex(link, FALSE);
+        return sendSupervisionFrame(link->fd, A_R, C_UA);
+    }
+
+    int parameter = frameParameter(frame, frameSize);
+    if (parameter & PARAMETER_RESUME) {
+        return acceptResume(link, parameter);
+    }
+    if (parameter & PARAMETER_FALLBACK) {
+        return acceptFallback(link);
+    }
+
+    int duplex = (parameter & PARAMETER_DUPLEX) && link->layer.duplex;
+    if (setDuplex(link, duplex) == -1) {
+        setDuplex(link, FALSE);
+    }
+
+    int fecGroup = link->inbox != NULL ? 0 : parameter & ~PARAMETER_DUPLEX;
+    if (fecGroup > link->layer.fecGroup) {
+        fecGroup = link->layer.fecGroup;
+    }
+    if (setFecGroup(link, fecGroup) == -1) {
+        setFecGroup(link, 0);
+    }
+
+    int speed = agreedSpeed(link, frame, frameSize);
+    return sendParameterFrame(link->fd, A_R, C_UA, link->inbox != NULL ? PARAMETER_DUPLEX : link->fecGroup, speed + 1);
+}
+
+static int initiateCommunicationTransmiter(LinkConnection *link) {
     int alarmCount = 0;
+    int fecGroup = link->layer.fecGroup > MAX_FEC_GROUP ? MAX_FEC_GROUP : link->layer.fecGroup;
+    int parameter = link->layer.duplex ? PARAMETER_DUPLEX : fecGroup;
 
     // Will try to send SET nRetransmissions times
-    while (alarmCount < layer.nRetransmissions) {
-        // Send SET
-        int bytes = sendSupervisionFrame(fd, A_T, C_SET);
+    while (alarmCount < link->layer.nRetransmissions) {
+        // Send SET, with the FEC group size or full-duplex wanted and the fastest baudrate accepted
+        int speed = link->speedOffer > link->speed ? link->speedOffer + 1 : 0;
+        int bytes = parameter > 0 || speed > 0 ? sendParameterFrame(link->fd, A_T, C_SET, parameter, speed) : sendSupervisionFrame(link->fd, A_T, C_SET);
         if (bytes == -1) {
-            printf("ERROR - Not possible to send UA\n");
+            printf("ERROR - Not possible to send SET\n");
             return -1;
         }
 
         // Receive UA
-        unsigned char frame[5];
-        if (readFrame(fd, layer.timeout, frame) != -1) {
+        unsigned char frame[MAX_PARAMETER_FRAME_SIZE];
+        int frameSize = readFrameFrom(&link->reader, link->layer.timeout, frame, sizeof(frame));
+        if (frameSize != -1) {
             // Verify BCC1
-            if (frame[3] == BCC1(A_R, C_UA)) {
-                return 0;
+            if (frame[2] == C_UA && frame[3] == BCC1(A_R, C_UA)) {
+                // A receiver without FEC (or full-duplex) answers with a plain UA
+                int accepted = frameParameter(frame, frameSize);
+                if (link->layer.duplex) {
+                    if (!(accepted & PARAMETER_DUPLEX)) {
+                        printf("ERROR - Receiver does not accept full-duplex\n");
+                        return -1;
+                    }
+                    if (setDuplex(link, TRUE) == -1) {
+                        return -1;
+                    }
+                }
+                else {
+                    accepted &= ~PARAMETER_DUPLEX;
+                    if (setFecGroup(link, accepted < fecGroup ? accepted : fecGroup) == -1) {
+                        return -1;
+                    }
+                }
+
+                // Faster baudrate agreed, SET / UA again at the initial one if it does not work
+                int agreed = frameSpeed(frame, frameSize);
+                if (agreed <= link->speed) {
+                    return 0;
+                }
+                int confirmed = confirmSpeed(link, agreed);
+                if (confirmed != FALSE) {
+                    return confirmed == TRUE ? 0 : -1;
+                }
+                alarmCount = 0;
+                continue;
             }
         }
 
@@ -47,176 +530,837 @@ int initiateCommunicationTransmiter() {
     return -1;
 }
 
-int initiateCommunicationReciver() {
-    // Receive SET
-    unsigned char frame[5];
-    if (readFrame(fd, 0, frame) == -1) {
-        printf("ERROR - Not received SET\n");
-        return -1;
-    }
+static int initiateCommunicationReciver(LinkConnection *link) {
+    // Receive SET, anything else (like noise on the line) is ignored
+    unsigned char frame[MAX_PARAMETER_FRAME_SIZE];
+    int frameSize;
+    do {
+        frameSize = readFrameFrom(&link->reader, 0, frame, sizeof(frame));
+        if (frameSize == -1) {
+            printf("ERROR - Not received SET\n");
+            return -1;
+        }
     // Verify BCC1
-    if (frame[3] != BCC1(A_T, C_SET)) {
+    } while (frame[2] != C_SET || frame[3] != BCC1(A_T, C_SET));
+
+    // The application expects to send too, it can not serve a half-duplex transmitter
+    if (link->layer.duplex && !(frameParameter(frame, frameSize) & PARAMETER_DUPLEX)) {
+        printf("ERROR - Transmitter did not ask for full-duplex\n");
         return -1;
     }
 
     // Send UA
-    if (sendSupervisionFrame(fd, A_R, C_UA) == -1) {
+    if (acceptSet(link, frame, frameSize) == -1) {
         printf("ERROR - Not possible to send UA\n");
         return -1;
     }
 
+    // Faster baudrate agreed
+    int agreed = agreedSpeed(link, frame, frameSize);
+    if (agreed > link->speed) {
+        return awaitSpeedTest(link, agreed);
+    }
+
     return 0;
 }
 
-int llopen(LinkLayer connectionParameters) {
+// Allocates a connection and opens and configures its serial port.
+// Returns the connection or NULL on error.
+static LinkConnection *openConnection(LinkLayer connectionParameters) {
+    LinkConnection *link = calloc(1, sizeof(LinkConnection));
+    if (link == NULL) {
+        printf("ERROR - Not possible to allocate link connection\n");
+        return NULL;
+    }
+
     // Set connection parameters
-    layer = connectionParameters;
+    link->layer = connectionParameters;
+    link->lastSequence = 1;             // First should be 0 so last is "1"
+    link->lastReceivedSequence = -1;
 
-    // Open serial port device for reading and writing and not as controlling tty
-    fd = open(layer.serialPort, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-        perror(layer.serialPort);
-        exit(-1);
+    // Open serial port device for reading and writing (non-blocking, writes wait in writeFrame) and not as controlling tty
+    link->fd = open(link->layer.serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (link->fd < 0) {
+        perror(link->layer.serialPort);
+        free(link);
+        return NULL;
     }
+    frameReaderInit(&link->reader, link->fd);
 
     // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1) {
+    if (tcgetattr(link->fd, &link->oldtio) == -1) {
         printf("ERROR - Not possible to save current port settings\n");
-        return -1;
+        close(link->fd);
+        free(link);
+        return NULL;
     }
 
     // Clear struct for new port settings
-    memset(&newtio, 0, sizeof(newtio));
+    memset(&link->newtio, 0, sizeof(link->newtio));
 
     // Set new port settings
-    newtio.c_cflag = layer.baudRate | CS8 | CLOCAL | CREAD; // Set baudrate, 8 bits, no parity, 1 stop bit, ...
-    newtio.c_iflag = IGNPAR;                                // Ignore bytes with parity errors
-    newtio.c_oflag = 0;                                     // Raw output
-    newtio.c_lflag = 0;                                     // Raw input
-    newtio.c_cc[VTIME] = 0;                                 // Inter-character timer unused
-    newtio.c_cc[VMIN] = 0;                                  // Blocking read until 0 chars received
+    link->baseSpeed = speedIndex(link->layer.baudRate);
+    if (link->baseSpeed == -1) {
+        printf("ERROR - Baudrate %d not supported\n", link->layer.baudRate);
+        close(link->fd);
+        free(link);
+        return NULL;
+    }
+    link->speed = link->baseSpeed;
+    link->newtio.c_cflag = CS8 | CLOCAL | CREAD;                        // 8 bits, no parity, 1 stop bit, ...
+    cfsetispeed(&link->newtio, speeds[link->baseSpeed].speed);          // Set baudrate
+    cfsetospeed(&link->newtio, speeds[link->baseSpeed].speed);
+    link->newtio.c_iflag = IGNPAR;                                      // Ignore bytes with parity errors
+    link->newtio.c_oflag = 0;                                           // Raw output
+    link->newtio.c_lflag = 0;                                           // Raw input
+    link->newtio.c_cc[VTIME] = 0;                                       // Inter-character timer unused
+    link->newtio.c_cc[VMIN] = 0;                                        // Blocking read until 0 chars received
 
     // TCIFLUSH - flushes data received but not read.
-    tcflush(fd, TCIOFLUSH);
+    tcflush(link->fd, TCIOFLUSH);
+
+    // Set new port settings
+    if (tcsetattr(link->fd, TCSANOW, &link->newtio) == -1) {
+        printf("ERROR - Not possible to set New port settings\n");
+        close(link->fd);
+        free(link);
+        return NULL;
+    }
+
+    // Fastest baudrate to offer. Resumed sessions stay at the initial baudrate: after a disconnection,
+    // neither end can tell which baudrate the other one is at.
+    link->speedOffer = link->baseSpeed;
+    if (link->layer.maxBaudRate > link->layer.baudRate && link->layer.recoveryTime <= 0) {
+        link->speedOffer = probeSpeeds(link, link->layer.maxBaudRate);
+    }
+
+    pthread_mutex_init(&link->writeLock, NULL);
+    pthread_cond_init(&link->writeTurn, NULL);
+
+    return link;
+}
+
+// Restores the serial port settings, closes it and releases the connection.
+// Returns 0 on success or "-1" on error.
+static int closeConnection(LinkConnection *link) {
+    int result = 0;
+
+    // Restore old port settings
+    if (tcsetattr(link->fd, TCSANOW, &link->oldtio) == -1) {
+        printf("ERROR - Not possible to restore old port settings\n");
+        result = -1;
+    }
+
+    // Close serial port
+    if (close(link->fd) == -1) {
+        printf("ERROR - Not possible to close Serial Port\n");
+        result = -1;
+    }
+
+    pthread_cond_destroy(&link->writeTurn);
+    pthread_mutex_destroy(&link->writeLock);
+    free(link->group);
+    free(link->inbox);
+    free(link);
+    return result;
+}
+
+LinkConnection *ll_open(LinkLayer connectionParameters) {
+    LinkConnection *link = openConnection(connectionParameters);
+    if (link == NULL) {
+        return NULL;
+    }
+
+    // Initialize Connection
+    int result = -1;
+    if (link->layer.role == LlTx) {
+        result = initiateCommunicationTransmiter(link);
+    }
+    else if (link->layer.role == LlRx) {
+        result = initiateCommunicationReciver(link);
+    }
+    else {
+        printf("ERROR - Invalid Role\n");
+    }
+
+    if (result == -1) {
+        closeConnection(link);
+        return NULL;
+    }
+
+    link->session = LINK_SESSION_OPEN;
+    return link;
+}
+
+int llopen(LinkLayer connectionParameters) {
+    if (defaultLink != NULL) {
+        printf("ERROR - Link layer already open\n");
+        return -1;
+    }
+
+    defaultLink = ll_open(connectionParameters);
+    return defaultLink != NULL ? 1 : -1;
+}
+
+////////////////////////////////////////////////
+// FULL-DUPLEX
+////////////////////////////////////////////////
+// Both ends send I frames, each direction with its own stop-and-wait sequence. The control field of every I frame
+// also acknowledges the last I frame received (C_NR), so the RR of a frame can ride on the next frame going back.
+// A RR is still sent on its own when no I frame can go back soon: while waiting for the acknowledgement of the
+// frame sent, or when the application waits for more data.
+
+// Returns TRUE if control is the control field of an I frame, with or without a piggybacked acknowledgement.
+static int isInformation(unsigned char control) {
+    return (control & ~(C_INF1 | C_NR)) == 0;
+}
+
+// Control field of an I frame of the given sequence, acknowledging the last I frame received.
+// Before any frame is received the last one is taken to be 1, as the other end starts with 0.
+static unsigned char duplexControl(const LinkConnection *link, int sequence) {
+    unsigned char control = sequence ? C_INF1 : C_INF0;
+    if (link->lastReceivedSequence != 0) {
+        control |= C_NR;
+    }
+    return control;
+}
+
+// Sends the RR of the last I frame received on its own.
+// Returns 0 on success or "-1" on error.
+static int sendAcknowledgement(LinkConnection *link) {
+    link->ackPending = FALSE;
+    if (sendSupervisionFrame(link->fd, A_R, link->lastReceivedSequence == 0 ? C_RR0 : C_RR1) == -1) {
+        printf("ERROR - Not possible to send RR\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Stores an I frame of the other direction in the inbox. It is acknowledged at once if acknowledgeNow,
+// otherwise by the next I frame sent (or by a RR if the application waits for data first).
+// Corrupted frames are rejected, duplicates acknowledged again and frames not fitting in the inbox dropped.
+// Returns 0 on success or "-1" on error.
+static int receiveDuplexFrame(LinkConnection *link, const unsigned char *stuffedFrame, int stuffedFrameSize, int acknowledgeNow) {
+    DuplexInbox *inbox = link->inbox;
+    int sequence = (stuffedFrame[2] & 0x40) >> 6;  // Gets 7th bit
+
+    // Check duplicate, its acknowledgement was lost
+    if (sequence == link->lastReceivedSequence) {
+        link->stats.duplicates++;
+        return sendAcknowledgement(link);
+    }
+
+    unsigned char data[stuffedFrameSize - 5];
+    int dataSize = destuffData(stuffedFrame + 4, stuffedFrameSize - 5, data);
+
+    // Check BCC2
+    if (dataSize < 2 || data[dataSize - 1] != BCC2(data, dataSize - 1)) {
+        link->stats.rejects++;
+        traceInstant(TRACE_REJECTED, link->fd, sequence, 0);
+        if (sendSupervisionFrame(link->fd, A_R, sequence ? C_REJ1 : C_REJ0) == -1) {
+            printf("ERROR - Not possible to send REJ\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // No room until the application reads, the frame is sent again after a time out
+    if (inbox->count == DUPLEX_INBOX_SIZE) {
+        return 0;
+    }
+
+    int slot = (inbox->first + inbox->count) % DUPLEX_INBOX_SIZE;
+    memcpy(inbox->packets[slot], data, dataSize - 1);
+    inbox->sizes[slot] = dataSize - 1;
+    inbox->count++;
+
+    link->lastReceivedSequence = sequence;
+    link->stats.framesReceived++;
+    link->stats.bytesReceived += dataSize - 1;
+
+    if (acknowledgeNow) {
+        return sendAcknowledgement(link);
+    }
+    link->ackPending = TRUE;
+    return 0;
+}
+
+// Waits for the acknowledgement of the I frame of the given sequence, a RR or an I frame of the other direction
+// acknowledging it. I frames received meanwhile are stored.
+// Returns TRUE when acknowledged, FALSE for REJ (the other end wants it again at once) or "-1" on time out.
+static int waitDuplexAcknowledgement(LinkConnection *link, int sequence) {
+    // The other direction keeps sending while this frame may be lost, so the time out does not restart on each frame
+    struct timespec deadline;
+    answerDeadline(link, &deadline);
+
+    unsigned char frame[MAX_FRAME_SIZE];
+    int frameSize;
+
+    while ((frameSize = readFrameUntil(&link->reader, &deadline, frame, sizeof(frame))) != -1) {
+        unsigned char control = frame[2];
+
+        // SET again, the UA was lost
+        if (control == C_SET && frame[3] == BCC1(A_T, C_SET)) {
+            if (acceptSet(link, frame, frameSize) == -1) {
+                printf("ERROR - Not possible to send UA\n");
+                return -1;
+            }
+        }
+        else if (frameSize == 5 && frame[3] == BCC1(A_R, control)) {
+            if (control == (sequence ? C_RR1 : C_RR0)) {
+                traceInstant(TRACE_ACK, link->fd, sequence, 0);
+                return TRUE;
+            }
+            if (control == (sequence ? C_REJ1 : C_REJ0)) {
+                traceInstant(TRACE_REJ, link->fd, sequence, 0);
+                return FALSE;
+            }
+        }
+        else if (frameSize >= 6 && isInformation(control) && frame[3] == BCC1(A_T, control)) {
+            // The acknowledgement is protected by BCC1, it holds even if the data is corrupted
+            int acknowledged = ((control & C_NR) != 0) == sequence;
+
+            // Acknowledged: the next frame sent carries the acknowledgement of this one
+            if (receiveDuplexFrame(link, frame, frameSize, !acknowledged) == -1) {
+                return -1;
+            }
+            if (acknowledged) {
+                traceInstant(TRACE_ACK, link->fd, sequence, 0);
+                return TRUE;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Sends an I frame in a full-duplex session and waits for its acknowledgement, receiving the other direction meanwhile.
+// Returns the frame size, or "-1" on error.
+static int writeDuplexFrame(LinkConnection *link, const struct iovec *iov, int iovcnt, int bufSize) {
+    int sequence = !link->lastSequence;
+    link->lastSequence = sequence;
+
+    unsigned char frame[2 * bufSize + 7];
+    int frameSize = 0;
+    int alarmCount = 0;
+
+    // Will try to send frame nRetransmissions times
+    while (alarmCount < link->layer.nRetransmissions) {
+        // Built again each time, the acknowledgement carried may have changed
+        frameSize = encodeFrameV(A_T, duplexControl(link, sequence), iov, iovcnt, frame);
+
+        if (sendInformationFrame(link, frame, frameSize) == -1) {
+            return -1;
+        }
+
+        if (link->ackPending) {
+            link->ackPending = FALSE;
+            link->stats.piggybacked++;
+        }
+        link->stats.framesSent++;
+        if (alarmCount > 0) {
+            link->stats.retransmissions++;
+            traceInstant(TRACE_RETRANSMIT, link->fd, sequence, 0);
+        }
+
+        int answer = waitDuplexAcknowledgement(link, sequence);
+        if (answer == TRUE) {
+            link->stats.bytesSent += bufSize;
+            return frameSize;
+        }
+        if (answer == -1) {
+            link->stats.timeouts++;
+            traceInstant(TRACE_TIMEOUT, link->fd, sequence, 0);
+        }
+        alarmCount++;
+    }
+    printf("ERROR - Time Out\n");
+
+    return -1;
+}
+
+// Copies the next packet received in a full-duplex session to packet, waiting for one if none was received yet.
+// Returns the payload size or "-1" on error.
+static int readDuplexPacket(LinkConnection *link, unsigned char *packet) {
+    DuplexInbox *inbox = link->inbox;
+    unsigned char frame[MAX_FRAME_SIZE];
+
+    while (inbox->count == 0) {
+        // No I frame is sent while waiting, so the acknowledgement can not wait for one
+        if (link->ackPending && sendAcknowledgement(link) == -1) {
+            return -1;
+        }
+
+        int frameSize = readFrameFrom(&link->reader, 0, frame, sizeof(frame));
+        if (frameSize == -1) {
+            printf("ERROR - Not possible to read Data Frame\n");
+            return -1;
+        }
+
+        // SET again, the UA was lost
+        if (frame[2] == C_SET && frame[3] == BCC1(A_T, C_SET)) {
+            if (acceptSet(link, frame, frameSize) == -1) {
+                printf("ERROR - Not possible to send UA\n");
+                return -1;
+            }
+        }
+        else if (frameSize >= 6 && isInformation(frame[2]) && frame[3] == BCC1(A_T, frame[2])) {
+            if (receiveDuplexFrame(link, frame, frameSize, FALSE) == -1) {
+                return -1;
+            }
+        }
+        // Acknowledgements repeated for the last frame sent need no answer
+    }
+
+    int size = inbox->sizes[inbox->first];
+    memcpy(packet, inbox->packets[inbox->first], size);
+    inbox->first = (inbox->first + 1) % DUPLEX_INBOX_SIZE;
+    inbox->count--;
+
+    return size;
+}
+
+int ll_pending(const LinkConnection *link) {
+    return link->inbox != NULL ? link->inbox->count : 0;
+}
+
+int llpending() {
+    return defaultLink != NULL ? ll_pending(defaultLink) : 0;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+// Waits for the answer to the I frame (or FEC group) of the given sequence.
+// Returns TRUE for RR, FALSE for REJ (the receiver wants it again at once) or "-1" on time out.
+static int waitAcknowledgement(LinkConnection *link, int sequence) {
+    struct timespec deadline;
+    answerDeadline(link, &deadline);
+
+    unsigned char frame[5];
+    while (readFrameUntil(&link->reader, &deadline, frame, sizeof(frame)) != -1) {
+        // Verify BCC1
+        if (frame[3] != BCC1(A_R, frame[2])) {
+            continue;
+        }
+
+        if (frame[2] == (sequence ? C_RR1 : C_RR0)) {
+            traceInstant(TRACE_ACK, link->fd, sequence, 0);
+            return TRUE;
+        }
+        if (frame[2] == (sequence ? C_REJ1 : C_REJ0)) {
+            traceInstant(TRACE_REJ, link->fd, sequence, 0);
+            return FALSE;
+        }
+        // Anything else, like a repeated RR of the previous frame, is not an answer to this one
+    }
+
+    return -1;
+}
+
+// Sends the SET asking for the initial baudrate until its UA arrives, up to nRetransmissions times.
+// Returns TRUE if answered, FALSE if not or "-1" on error.
+static int sendFallback(LinkConnection *link) {
+    for (int tries = 0; tries < link->layer.nRetransmissions; tries++) {
+        if (sendParameterFrame(link->fd, A_T, C_SET, PARAMETER_FALLBACK, link->baseSpeed + 1) == -1) {
+            printf("ERROR - Not possible to send SET\n");
+            return -1;
+        }
+
+        // Receive UA within one time out, stale answers to the frame in flight do not extend it
+        unsigned char frame[MAX_PARAMETER_FRAME_SIZE];
+        int frameSize;
+        struct timespec deadline;
+        answerDeadline(link, &deadline);
+        while ((frameSize = readFrameUntil(&link->reader, &deadline, frame, sizeof(frame))) != -1) {
+            if (frame[2] == C_UA && frame[3] == BCC1(A_R, C_UA) && (frameParameter(frame, frameSize) & PARAMETER_FALLBACK)) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+// Goes back to the initial baudrate once the retransmissions of a frame ran out at a negotiated one. The SET asking
+// for it is sent at the current baudrate, where the receiver still is, and then at the initial one, where it is
+// if only its UA was lost. Short frames get through errors that defeat the long ones.
+// Returns TRUE once both ends are at the initial baudrate, FALSE if the receiver did not answer or "-1" on error.
+static int negotiateFallback(LinkConnection *link) {
+    int answered = sendFallback(link);
+    if (answered == -1 || fallBackSpeed(link) == -1) {
+        return -1;
+    }
+    if (answered == FALSE) {
+        answered = sendFallback(link);
+    }
+    return answered;
+}
+
+// Re-establishes the session once the retransmissions of the I frame in flight ran out (the cable may be off),
+// sending SET again for up to recoveryTime seconds. The UA tells whether that frame was accepted already.
+// Returns TRUE if the frame was accepted, FALSE if it must be sent again or "-1" if the session was not resumed.
+static int resumeSession(LinkConnection *link) {
+    if (link->layer.recoveryTime <= 0) {
+        return -1;
+    }
+    printf("Link lost, trying to resume the session for %d seconds\n", link->layer.recoveryTime);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += link->layer.recoveryTime;
+
+    struct timespec now;
+    do {
+        // Send SET, with the last I frame acknowledged
+        if (sendParameterFrame(link->fd, A_T, C_SET, PARAMETER_RESUME | !link->lastSequence, 0) == -1) {
+            printf("ERROR - Not possible to send SET\n");
+            return -1;
+        }
+
+        // Receive UA, stale answers to the frame in flight are ignored
+        struct timespec timeout;
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+        timeout.tv_sec += link->layer.timeout;
+
+        unsigned char frame[MAX_PARAMETER_FRAME_SIZE];
+        int frameSize;
+        while ((frameSize = readFrameUntil(&link->reader, &timeout, frame, sizeof(frame))) != -1) {
+            int accepted = frameParameter(frame, frameSize);
+            if (frame[2] == C_UA && frame[3] == BCC1(A_R, C_UA) && (accepted & PARAMETER_RESUME)) {
+                link->stats.resumes++;
+                traceInstant(TRACE_RESUME, link->fd, 0, 0);
+                printf("Session resumed\n");
+                return !(accepted & RESUME_NONE) && (accepted & RESUME_SEQUENCE) == link->lastSequence;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+
+    printf("ERROR - Session not resumed\n");
+    return -1;
+}
+
+// Writes one frame of the current FEC group: a data frame or the parity (index FEC_PARITY).
+// Returns 0 on success or "-1" on error.
+static int sendGroupFrame(LinkConnection *link, int index) {
+    FecGroup *group = link->group;
+    unsigned char header[FEC_HEADER_SIZE];
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = FEC_HEADER_SIZE}};
+
+    header[0] = index;
+    if (index == FEC_PARITY) {
+        header[1] = group->count;
+        header[2] = (group->sizesXor >> 8) & 0xFF;
+        header[3] = group->sizesXor & 0xFF;
+        iov[1].iov_base = group->parity;
+        iov[1].iov_len = group->paritySize;
+    }
+    else {
+        // The final size of the group is only known by its parity
+        header[1] = link->fecGroup;
+        header[2] = 0;
+        header[3] = 0;
+        iov[1].iov_base = group->payloads[index];
+        iov[1].iov_len = group->sizes[index];
+    }
+
+    unsigned char frame[2 * (FEC_HEADER_SIZE + MAX_PAYLOAD_SIZE) + 7];
+    int frameSize = encodeFrameV(A_T, group->sequence ? C_INF1 : C_INF0, iov, 2, frame);
+
+    if (sendInformationFrame(link, frame, frameSize) == -1) {
+        return -1;
+    }
+
+    if (index == FEC_PARITY) {
+        link->stats.paritySent++;
+    }
+    else {
+        link->stats.framesSent++;
+    }
+    return 0;
+}
+
+// Ends the current FEC group with its parity and waits until the receiver acknowledges it.
+// On REJ (more losses than the parity can rebuild) or time out, the whole group is sent again.
+// Returns 0 on success or "-1" on error.
+static int flushGroup(LinkConnection *link) {
+    FecGroup *group = link->group;
+    if (group == NULL || group->count == 0) {
+        return 0;
+    }
+
+    int alarmCount = 0;
+
+    // Will try to send the group nRetransmissions times
+    while (alarmCount < link->layer.nRetransmissions) {
+        if (alarmCount > 0) {
+            for (int i = 0; i < group->count; i++) {
+                if (sendGroupFrame(link, i) == -1) {
+                    return -1;
+                }
+                link->stats.retransmissions++;
+                traceInstant(TRACE_RETRANSMIT, link->fd, group->sequence, 0);
+            }
+        }
+        // The time out starts once the whole group left
+        if (sendGroupFrame(link, FEC_PARITY) == -1) {
+            return -1;
+        }
+
+        int answer = waitAcknowledgement(link, group->sequence);
+        if (answer == TRUE) {
+            for (int i = 0; i < group->count; i++) {
+                link->stats.bytesSent += group->sizes[i];
+            }
+
+            // Next group
+            int sequence = group->sequence;
+            memset(group, 0, sizeof(FecGroup));
+            group->sequence = !sequence;
+            return 0;
+        }
+        if (answer == -1) {
+            link->stats.timeouts++;
+            traceInstant(TRACE_TIMEOUT, link->fd, group->sequence, 0);
+        }
+        alarmCount++;
+
+        // Out of retransmissions at a negotiated baudrate, the group is sent again at the initial one
+        if (alarmCount == link->layer.nRetransmissions && link->speed != link->baseSpeed) {
+            int fellBack = negotiateFallback(link);
+            if (fellBack == -1) {
+                return -1;
+            }
+            if (fellBack == TRUE) {
+                alarmCount = 0;
+            }
+        }
+    }
+    printf("ERROR - Time Out\n");
+
+    return -1;
+}
+
+// Adds a packet to the current FEC group and sends it right away, without waiting for an acknowledgement.
+// The group is acknowledged once full, or when the connection is closed.
+// Returns the packet size, or "-1" on error.
+static int writeGroupFrame(LinkConnection *link, const struct iovec *iov, int iovcnt, int bufSize) {
+    FecGroup *group = link->group;
+    if (bufSize > MAX_PAYLOAD_SIZE) {
+        printf("ERROR - Payload too big\n");
+        return -1;
+    }
+
+    // The packet is kept for the parity and a retransmission of the group
+    int index = group->count++;
+    int offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(group->payloads[index] + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    group->sizes[index] = bufSize;
+
+    // Parity of the group so far
+    for (int i = 0; i < bufSize; i++) {
+        group->parity[i] ^= group->payloads[index][i];
+    }
+    if (bufSize > group->paritySize) {
+        group->paritySize = bufSize;
+    }
+    group->sizesXor ^= bufSize;
+
+    if (sendGroupFrame(link, index) == -1) {
+        return -1;
+    }
+    if (group->count == link->fecGroup && flushGroup(link) == -1) {
+        return -1;
+    }
+
+    return bufSize;
+}
+
+// Sends an I frame and waits for its acknowledgement (stop-and-wait ARQ), resuming the session if the link is lost.
+// Returns the frame size, or "-1" on error.
+static int writeInformationFrame(LinkConnection *link, const struct iovec *iov, int iovcnt, int bufSize) {
+    // Construct Frame
+    unsigned char control;
+    if (link->lastSequence == 0) {
+        link->lastSequence = 1;
+        control = C_INF1;
+    }
+    else {
+        link->lastSequence = 0;
+        control = C_INF0;
+    }
+
+    unsigned char frame[2 * bufSize + 7];
+    int frameSize = encodeFrameV(A_T, control, iov, iovcnt, frame);
+
+    // Send frame
+    int alarmCount = 0;
+
+    // Will try to send frame nRetransmissions times
+    while (alarmCount < link->layer.nRetransmissions) {
+        // Send frame, the time out starts once it left
+        if (sendInformationFrame(link, frame, frameSize) == -1) {
+            return -1;
+        }
+
+        link->stats.framesSent++;
+        if (alarmCount > 0) {
+            link->stats.retransmissions++;
+            traceInstant(TRACE_RETRANSMIT, link->fd, link->lastSequence, 0);
+        }
+
+        // Receive RR, a REJ asks for the frame again without waiting for the time out
+        int answer = waitAcknowledgement(link, link->lastSequence);
+        if (answer == TRUE) {
+            link->stats.bytesSent += bufSize;
+            return frameSize;
+        }
+        if (answer == -1) {
+            link->stats.timeouts++;
+            traceInstant(TRACE_TIMEOUT, link->fd, link->lastSequence, 0);
+        }
+        alarmCount++;
+
+        // Out of retransmissions at a negotiated baudrate, the frame is sent again at the initial one
+        if (alarmCount == link->layer.nRetransmissions && link->speed != link->baseSpeed) {
+            int fellBack = negotiateFallback(link);
+            if (fellBack == -1) {
+                return -1;
+            }
+            if (fellBack == TRUE) {
+                alarmCount = 0;
+                continue;
+            }
+        }
+
+        // Out of retransmissions, the frame is sent again from the start once the session is resumed
+        if (alarmCount == link->layer.nRetransmissions) {
+            int resumed = resumeSession(link);
+            if (resumed == TRUE) {
+                link->stats.bytesSent += bufSize;
+                return frameSize;
+            }
+            if (resumed == FALSE) {
+                alarmCount = 0;
+            }
+        }
+    }
+    printf("ERROR - Time Out\n");
+
+    return -1;
+}
+
+// Microseconds elapsed since start (CLOCK_MONOTONIC)
+static long elapsedUs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Waits until no packet is being sent and no lower channel has one waiting, then takes the turn of channel.
+static void acquireChannel(LinkConnection *link, int channel) {
+    pthread_mutex_lock(&link->writeLock);
+    link->waiting[channel]++;
+
+    while (TRUE) {
+        int lowerWaiting = FALSE;
+        for (int i = 0; i < channel; i++) {
+            lowerWaiting |= link->waiting[i] > 0;
+        }
+        if (!link->writing && !lowerWaiting) {
+            break;
+        }
+        pthread_cond_wait(&link->writeTurn, &link->writeLock);
+    }
+
+    link->waiting[channel]--;
+    link->writing = TRUE;
+    pthread_mutex_unlock(&link->writeLock);
+}
+
+// Ends the turn of the packet sent, waking the writers waiting.
+static void releaseChannel(LinkConnection *link) {
+    pthread_mutex_lock(&link->writeLock);
+    link->writing = FALSE;
+    pthread_cond_broadcast(&link->writeTurn);
+    pthread_mutex_unlock(&link->writeLock);
+}
 
-    // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1) {
-        printf("ERROR - Not possible to set New port settings\n");
+int ll_writech(LinkConnection *link, int channel, const struct iovec *iov, int iovcnt) {
+    if (link == NULL || channel < 0 || channel >= LL_CHANNELS) {
         return -1;
     }
 
-    // Initialize Connection
-    if (layer.role == LlTx) {
-        if (initiateCommunicationTransmiter() == -1) {
-            return -1;
-        }
+    int bufSize = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bufSize += iov[i].iov_len;
     }
-    else if (layer.role == LlRx) {
-        if (initiateCommunicationReciver() == -1) {
-            return -1;
-        }
+
+    struct timespec written;
+    clock_gettime(CLOCK_MONOTONIC, &written);
+    acquireChannel(link, channel);
+    long waitUs = elapsedUs(&written);
+    traceBegin(TRACE_LLWRITE, link->fd, bufSize);
+
+    int result;
+    if (link->group != NULL) {
+        result = writeGroupFrame(link, iov, iovcnt, bufSize);
+    }
+    else if (link->inbox != NULL) {
+        result = writeDuplexFrame(link, iov, iovcnt, bufSize);
     }
     else {
-        printf("ERROR - Invalid Role\n");
-        return -1;
+        result = writeInformationFrame(link, iov, iovcnt, bufSize);
     }
 
-    return 0;
-}
-
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize) {
-    static int lastSequence = 1; // First should be 0 so last is "1"
+    traceEnd(TRACE_LLWRITE, link->fd, result);
 
-    // Stuff Data
-    unsigned int stuffedDataSize = 2 * bufSize;
-    unsigned char stuffedData[stuffedDataSize];
-    stuffedDataSize = stuffData(buf, bufSize, stuffedData);
+    // Only the writer holding the turn updates the statistics
+    if (result != -1) {
+        long latencyUs = elapsedUs(&written);
+        link->stats.channelPackets[channel]++;
+        link->stats.channelWaitUs[channel] += waitUs;
+        link->stats.channelLatencyUs[channel] += latencyUs;
+        if (latencyUs > link->stats.channelMaxLatencyUs[channel]) {
+            link->stats.channelMaxLatencyUs[channel] = latencyUs;
+        }
+    }
+    releaseChannel(link);
 
-    // Construct Frame
-    unsigned int frameSize = stuffedDataSize + 6;
-    unsigned char frame[frameSize];
+    return result;
+}
 
-    frame[0] = FLAG;                                         // Start Flag
-    frame[1] = A_T;                                          // Address
-
-    if (lastSequence == 0) {                                 //
-        lastSequence = 1;                                    //
-        frame[2] = C_INF1;                                   //
-    }                                                        // Control
-    else if (lastSequence == 1) {                            //
-        lastSequence = 0;                                    //
-        frame[2] = C_INF0;                                   //
-    }
-
-    frame[3] = BCC1(A_T, frame[2]);                          // BCC1
-    memcpy(frame + 4, stuffedData, stuffedDataSize);         // Copy stuffed data
-
-    unsigned char bcc2 = BCC2(buf, bufSize);                 //
-    if (bcc2 == FLAG) {                                      //
-        frameSize++;                                         //
-        frame[frameSize - 3] = ESCAPE;                       //
-        frame[frameSize - 2] = FLAG ^ 0x20;                  //
-    }                                                        // 
-    else if (bcc2 == ESCAPE) {                               // BCC2
-        frameSize++;                                         //
-        frame[frameSize - 3] = ESCAPE;                       //
-        frame[frameSize - 2] = ESCAPE ^ 0x20;                //
-    }                                                        //
-    else {                                                   //
-        frame[frameSize - 2] = bcc2;                         //
-    }                                                        //
-
-    frame[frameSize - 1] = FLAG;                             // End Flag
+int ll_writev(LinkConnection *link, const struct iovec *iov, int iovcnt) {
+    return ll_writech(link, LL_BULK_CHANNEL, iov, iovcnt);
+}
 
-    // Send frame
-    int alarmCount = 0;
+int ll_write(LinkConnection *link, const unsigned char *buf, int bufSize) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = bufSize};
+    return ll_writev(link, &iov, 1);
+}
 
-    // Will try to send frame nRetransmissions times
-    while (alarmCount < layer.nRetransmissions) {
-        // Send frame
-        int bytes = write(fd, frame, frameSize);
-        if (bytes == -1) {
-            printf("ERROR - Not possible to write to Serial Port\n");
-            return -1;
-        }
-        else if (bytes != frameSize) {
-            printf("ERROR - Partial write to Serial Port\n");
-            return -1;
-        }
+int llwrite(const unsigned char *buf, int bufSize) {
+    return ll_write(defaultLink, buf, bufSize);
+}
 
-        // Receive RR
-        unsigned char frame[5];
-        if (readFrame(fd, layer.timeout, frame) != -1) {
-            // Verify BCC1
-            if (frame[3] == BCC1(A_R, frame[2])) {
-                return frameSize;
-            }
-        }
-        alarmCount++;
-    }
-    printf("ERROR - Time Out\n");
+int llwritev(const struct iovec *iov, int iovcnt) {
+    return ll_writev(defaultLink, iov, iovcnt);
+}
 
-    return -1;
+int llwritech(int channel, const struct iovec *iov, int iovcnt) {
+    return ll_writech(defaultLink, channel, iov, iovcnt);
 }
 
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
-int llread(unsigned char *packet) {
-
-    unsigned char stuffedFrame[2 * (MAX_PAYLOAD_SIZE + 1) + 5]; // Allocate memory for stuffed frame
-    unsigned int stuffedFrameSize = 0;
-
-    // Read frame
-    stuffedFrameSize = readFrame(fd, 0, stuffedFrame);
-    if (stuffedFrameSize == -1) {
-        printf("ERROR - Not possible to read Data Frame\n");
-        return -1;
-    }
-
+// Verifies and acknowledges a received I frame, copying its payload to packet.
+// Returns the payload size, 0 for a duplicated or rejected frame or "-1" on error.
+static int receiveInformationFrame(LinkConnection *link, const unsigned char *stuffedFrame, int stuffedFrameSize, unsigned char *packet) {
     // Unstuffing Data
     unsigned char data[stuffedFrameSize - 5]; 
     unsigned int dataSize = destuffData(stuffedFrame + 4, stuffedFrameSize - 5, data);
@@ -232,22 +1376,22 @@ int llread(unsigned char *packet) {
     memcpy(frame + 4, data, dataSize);                         // Copy data + BCC2
     frame[frameSize - 1] = stuffedFrame[stuffedFrameSize - 1]; // End Flag
 
-    static int lastReceivedSequence = -1;           // 0 or 1 
     int receivedSequence = (frame[2] & 0x40) >> 6;  // Gets 7th bit
 
     // Check duplicate
-    if (receivedSequence == lastReceivedSequence) {
+    if (receivedSequence == link->lastReceivedSequence) {
         printf("ERROR - Received duplicated frame\n");
+        link->stats.duplicates++;
         if (receivedSequence == 0) {
             // Send RR0
-            if (sendSupervisionFrame(fd, A_R, C_RR0) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_RR0) == -1) {
                 printf("ERROR - Not possible to send RR0\n");
                 return -1;
             }   
         } 
         else if (receivedSequence == 1) {
             // Send RR1
-            if (sendSupervisionFrame(fd, A_R, C_RR1) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_RR1) == -1) {
                 printf("ERROR - Not possible to send RR1\n");
                 return -1;
             }
@@ -257,59 +1401,65 @@ int llread(unsigned char *packet) {
 
     // Check BCC1
     if (frame[3] != BCC1(A_T, frame[2])) {
-        printf("ERROR - BCC1 failed - (Received: 0x%x \t Expected: 0x%x)\n", frame[3], BCC2(A_T, frame[2]));
+        link->stats.rejects++;
+        traceInstant(TRACE_REJECTED, link->fd, receivedSequence, 0);
+        printf("ERROR - BCC1 failed - (Received: 0x%x \t Expected: 0x%x)\n", frame[3], BCC1(A_T, frame[2]));
         if (frame[2] == C_INF0) {
             // Send REJ0
-            if (sendSupervisionFrame(fd, A_T, C_REJ0) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_REJ0) == -1) {
                 printf("ERROR - Not possible to send REJ0\n");
                 return -1;
             }
         }
         if (frame[2] == C_INF1) {
             // Send REJ1
-            if (sendSupervisionFrame(fd, A_T, C_REJ1) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_REJ1) == -1) {
                 printf("ERROR - Not possible to send REJ1\n");
                 return -1;
             }
         }
-        return -1;
+        return 0;
     }
 
     // Check BCC2
     if (frame[frameSize - 2] != BCC2(data, dataSize - 1)) {
+        link->stats.rejects++;
+        traceInstant(TRACE_REJECTED, link->fd, receivedSequence, 0);
         printf("ERROR - BCC2 failed - (Received: 0x%x \t Expected: 0x%x)\n", frame[frameSize - 2], BCC2(data, dataSize));
         if (frame[2] == C_INF0) {
             // Send REJ0
-            if (sendSupervisionFrame(fd, A_T, C_REJ0) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_REJ0) == -1) {
                 printf("ERROR - Not possible to send REJ0\n");
                 return -1;
             }
         }
         else if (frame[2] == C_INF1) {
             // Send REJ1
-            if (sendSupervisionFrame(fd, A_T, C_REJ1) == -1) {
+            if (sendSupervisionFrame(link->fd, A_R, C_REJ1) == -1) {
                 printf("ERROR - Not possible to send REJ1\n");
                 return -1;
             }
         }
-        return -1;
+        return 0;
     }
 
     // Send RR0 or RR1
     if (frame[2] == C_INF0) {
-        if (sendSupervisionFrame(fd, A_R, C_RR0) == -1) {
+        if (sendSupervisionFrame(link->fd, A_R, C_RR0) == -1) {
             printf("ERROR - Not possible to send RR0\n");
             return -1;
         }
     }
     else if (frame[2] == C_INF1) {
-        if (sendSupervisionFrame(fd, A_R, C_RR1) == -1) {
+        if (sendSupervisionFrame(link->fd, A_R, C_RR1) == -1) {
             printf("ERROR - Not possible to send RR1\n");
             return -1;
         }
     }
 
-    lastReceivedSequence = receivedSequence; // Update last received sequence
+    link->lastReceivedSequence = receivedSequence; // Update last received sequence
+    link->stats.framesReceived++;
+    link->stats.bytesReceived += dataSize - 1;
 
     // Copy data payload
     memcpy(packet, data, dataSize - 1);
@@ -318,32 +1468,257 @@ int llread(unsigned char *packet) {
     return dataSize - 1;
 }
 
+// Rebuilds the only missing frame of the group from the parity and the other frames.
+// Returns TRUE on success, FALSE if the result can not be a frame of the group.
+static int rebuildFrame(FecGroup *group) {
+    int missing = -1;
+    for (int i = 0; i < group->count; i++) {
+        if (!group->received[i]) {
+            missing = i;
+        }
+    }
+
+    unsigned char *payload = group->payloads[missing];
+    int size = group->sizesXor;
+    memcpy(payload, group->parity, group->paritySize);
+
+    for (int i = 0; i < group->count; i++) {
+        if (i != missing) {
+            for (int j = 0; j < group->sizes[i]; j++) {
+                payload[j] ^= group->payloads[i][j];
+            }
+            size ^= group->sizes[i];
+        }
+    }
+
+    if (size > group->paritySize) {
+        return FALSE;
+    }
+
+    group->sizes[missing] = size;
+    group->received[missing] = TRUE;
+    return TRUE;
+}
+
+// Stores a received I frame of the current FEC group. Corrupted frames are dropped, the parity stands in for them.
+// Once the parity arrived, one missing frame is rebuilt, and with more the group is rejected (frames received are kept).
+// Returns 0 on success or "-1" on error.
+static int receiveGroupFrame(LinkConnection *link, const unsigned char *stuffedFrame, int stuffedFrameSize) {
+    FecGroup *group = link->group;
+
+    unsigned char data[stuffedFrameSize - 5];
+    int dataSize = destuffData(stuffedFrame + 4, stuffedFrameSize - 5, data);
+
+    // Check BCC1 and BCC2
+    int sequence = (stuffedFrame[2] & 0x40) >> 6;  // Gets 7th bit
+    if (stuffedFrame[3] != BCC1(A_T, stuffedFrame[2]) || dataSize < FEC_HEADER_SIZE + 1 || data[dataSize - 1] != BCC2(data, dataSize - 1)) {
+        link->stats.rejects++;
+        traceInstant(TRACE_REJECTED, link->fd, sequence, 0);
+        return 0;
+    }
+
+    int index = data[0];
+    int count = data[1];
+    int size = dataSize - 1 - FEC_HEADER_SIZE;
+
+    if (count == 0 || count > link->fecGroup || size > MAX_PAYLOAD_SIZE || (index != FEC_PARITY && index >= count)) {
+        link->stats.rejects++;
+        traceInstant(TRACE_REJECTED, link->fd, sequence, 0);
+        return 0;
+    }
+
+    // Frame of the previous group, sent again because its RR was lost: the parity ends each send of a group
+    if (sequence != group->sequence) {
+        link->stats.duplicates++;
+        if (index == FEC_PARITY && sendSupervisionFrame(link->fd, A_R, sequence ? C_RR1 : C_RR0) == -1) {
+            printf("ERROR - Not possible to send RR\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (index == FEC_PARITY) {
+        memcpy(group->parity, data + FEC_HEADER_SIZE, size);
+        group->paritySize = size;
+        group->sizesXor = (data[2] << 8) | data[3];
+        group->count = count;
+        group->hasParity = TRUE;
+    }
+    else if (!group->received[index]) {
+        memcpy(group->payloads[index], data + FEC_HEADER_SIZE, size);
+        group->sizes[index] = size;
+        group->received[index] = TRUE;
+        if (!group->hasParity) {
+            group->count = count;
+        }
+    }
+    else {
+        link->stats.duplicates++;
+    }
+
+    if (!group->hasParity) {
+        return 0;
+    }
+
+    int missing = 0;
+    for (int i = 0; i < group->count; i++) {
+        if (!group->received[i]) {
+            missing++;
+        }
+    }
+    if (missing == 1 && rebuildFrame(group)) {
+        link->stats.rebuilt++;
+        return 0;
+    }
+    if (missing > 0) {
+        // Too many losses for the parity, the group is sent again
+        group->hasParity = FALSE;
+        if (sendSupervisionFrame(link->fd, A_R, sequence ? C_REJ1 : C_REJ0) == -1) {
+            printf("ERROR - Not possible to send REJ\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Copies the next frame of the current FEC group to packet, in order, and acknowledges the group once all were delivered.
+// Returns the payload size, 0 if the next frame is not available yet or "-1" on error.
+static int nextGroupPacket(LinkConnection *link, unsigned char *packet) {
+    FecGroup *group = link->group;
+    int size = 0;
+
+    if (group->delivered < group->count && group->received[group->delivered]) {
+        size = group->sizes[group->delivered];
+        memcpy(packet, group->payloads[group->delivered], size);
+        group->delivered++;
+
+        link->stats.framesReceived++;
+        link->stats.bytesReceived += size;
+    }
+
+    if (group->count > 0 && group->delivered == group->count) {
+        int sequence = group->sequence;
+        memset(group, 0, sizeof(FecGroup));
+        group->sequence = !sequence;
+        link->lastReceivedSequence = sequence;
+
+        if (sendSupervisionFrame(link->fd, A_R, sequence ? C_RR1 : C_RR0) == -1) {
+            printf("ERROR - Not possible to send RR\n");
+            return -1;
+        }
+    }
+
+    return size;
+}
+
+// Seconds the receiver waits for the next frame: the transmitter gives up on the session after its
+// retransmissions and recovery time, or never when sessions are not resumed.
+static int sessionTimeout(const LinkConnection *link) {
+    if (link->layer.recoveryTime <= 0) {
+        return 0;
+    }
+    return link->layer.nRetransmissions * link->layer.timeout + link->layer.recoveryTime;
+}
+
+// Receives the next packet of link.
+// Returns the payload size, 0 if the frame received carried none or "-1" on error.
+static int readPacket(LinkConnection *link, unsigned char *packet) {
+    if (link->inbox != NULL) {
+        return readDuplexPacket(link, packet);
+    }
+
+    // Frames rebuilt from the parity may be waiting already
+    if (link->group != NULL) {
+        int size = nextGroupPacket(link, packet);
+        if (size != 0) {
+            return size;
+        }
+    }
+
+    unsigned char stuffedFrame[MAX_FRAME_SIZE]; // Allocate memory for stuffed frame
+
+    // Read frame
+    int stuffedFrameSize = readFrameFrom(&link->reader, sessionTimeout(link), stuffedFrame, sizeof(stuffedFrame));
+    if (stuffedFrameSize == -1) {
+        printf("ERROR - Not possible to read Data Frame\n");
+        return -1;
+    }
+
+    // SET again: the UA was lost, the session is resumed or goes back to the initial baudrate
+    if (stuffedFrame[2] == C_SET) {
+        if (acceptSet(link, stuffedFrame, stuffedFrameSize) == -1) {
+            printf("ERROR - Not possible to send UA\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (stuffedFrameSize < 6) {
+        return 0;   // Not an I frame
+    }
+
+    if (link->group != NULL) {
+        if (receiveGroupFrame(link, stuffedFrame, stuffedFrameSize) == -1) {
+            return -1;
+        }
+        return nextGroupPacket(link, packet);
+    }
+
+    return receiveInformationFrame(link, stuffedFrame, stuffedFrameSize, packet);
+}
+
+int ll_read(LinkConnection *link, unsigned char *packet) {
+    if (link == NULL) {
+        return -1;
+    }
+
+    traceBegin(TRACE_LLREAD, link->fd, 0);
+    int result = readPacket(link, packet);
+    traceEnd(TRACE_LLREAD, link->fd, result);
+
+    return result;
+}
+
+int llread(unsigned char *packet) {
+    return ll_read(defaultLink, packet);
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int terminateCommunicationTransmitter() {
+static int terminateCommunicationTransmitter(LinkConnection *link) {
     int alarmCount = 0;
 
     // Will try to send DISC nRetransmissions times
-    while (alarmCount < layer.nRetransmissions) {
+    while (alarmCount < link->layer.nRetransmissions) {
         // Send DISC
-        if (sendSupervisionFrame(fd, A_T, C_DISC) == -1) {
+        if (sendSupervisionFrame(link->fd, A_T, C_DISC) == -1) {
             printf("ERROR - Not possible to send DISC\n");
             return -1;
         }
 
-        // Receive DISC
-        unsigned char frame[5];
-        if (readFrame(fd, layer.timeout, frame) != -1) {
+        // Receive DISC within one time out, the I frames of the other direction do not extend it
+        unsigned char frame[MAX_FRAME_SIZE];
+        int frameSize;
+        struct timespec deadline;
+        answerDeadline(link, &deadline);
+        while ((frameSize = readFrameUntil(&link->reader, &deadline, frame, sizeof(frame))) != -1) {
             // Verify BCC1
-            if (frame[3] == BCC1(A_R, C_DISC)) {
+            if (frame[2] == C_DISC && frame[3] == BCC1(A_R, C_DISC)) {
                 // Send UA
-                if (sendSupervisionFrame(fd, A_T, C_UA) == -1) {
+                if (sendSupervisionFrame(link->fd, A_T, C_UA) == -1) {
                     printf("ERROR - Not possible to send UA\n");
                     return -1;
                 }
                 return 0;
             }
+
+            // Full-duplex: the other end may still be waiting for the acknowledgement of its last frame
+            if (link->inbox != NULL && frameSize >= 6 && isInformation(frame[2]) && frame[3] == BCC1(A_T, frame[2])) {
+                if (receiveDuplexFrame(link, frame, frameSize, TRUE) == -1) {
+                    return -1;
+                }
+            }
         }
         alarmCount++;
     }
@@ -352,61 +1727,262 @@ int terminateCommunicationTransmitter() {
     return -1;
 }
 
-int terminateCommunicationReceiver() {
+static int terminateCommunicationReceiver(LinkConnection *link) {
     // Receive DISC
-    unsigned char frame[5];
-    if (readFrame(fd, 0, frame) == -1) {
-        printf("ERROR - Not received DISC\n");
-        return -1;
+    unsigned char frame[MAX_FRAME_SIZE];
+    while (TRUE) {
+        int frameSize = readFrameFrom(&link->reader, sessionTimeout(link), frame, sizeof(frame));
+        if (frameSize == -1) {
+            printf("ERROR - Not received DISC\n");
+            return -1;
+        }
+        // Verify BCC1
+        if (frame[2] == C_DISC && frame[3] == BCC1(A_T, C_DISC)) {
+            break;
+        }
+
+        // The transmitter may still be waiting for the acknowledgement of its last frames (or FEC group)
+        if (frameSize >= 6 && isInformation(frame[2])) {
+            unsigned char packet[MAX_PAYLOAD_SIZE];
+            if (link->inbox != NULL) {
+                if (frame[3] == BCC1(A_T, frame[2]) && receiveDuplexFrame(link, frame, frameSize, TRUE) == -1) {
+                    return -1;
+                }
+            }
+            else if (link->group != NULL) {
+                if (receiveGroupFrame(link, frame, frameSize) == -1) {
+                    return -1;
+                }
+                while (nextGroupPacket(link, packet) > 0);
+            }
+            else {
+                receiveInformationFrame(link, frame, frameSize, packet);
+            }
+        }
     }
-    // Verify BCC1
-    if (frame[3] != BCC1(A_T, C_DISC)) {
-        return -1;
+
+    int alarmCount = 0;
+
+    // Will try to send DISC nRetransmissions times, the transmitter sends DISC again if it was lost
+    while (alarmCount < link->layer.nRetransmissions) {
+        // Send DISC
+        if (sendSupervisionFrame(link->fd, A_R, C_DISC) == -1) {
+            return -1;
+        }
+
+        // Receive UA
+        int frameSize;
+        struct timespec deadline;
+        answerDeadline(link, &deadline);
+        while ((frameSize = readFrameUntil(&link->reader, &deadline, frame, sizeof(frame))) != -1) {
+            // Verify BCC1
+            if (frame[2] == C_UA && frame[3] == BCC1(A_T, C_UA)) {
+                return 0;
+            }
+            if (frame[2] == C_DISC && frame[3] == BCC1(A_T, C_DISC)) {
+                break;
+            }
+        }
+        alarmCount++;
     }
+    printf("ERROR - Not received UA\n");
 
-    // Send DISC
-    if (sendSupervisionFrame(fd, A_R, C_DISC) == -1) {
-        return -1;
+    return -1;
+}
+
+void ll_statistics(const LinkConnection *link, LinkStatistics *stats) {
+    *stats = link->stats;
+}
+
+void llstatistics(LinkStatistics *stats) {
+    if (defaultLink == NULL) {
+        memset(stats, 0, sizeof(LinkStatistics));
+        return;
     }
+    ll_statistics(defaultLink, stats);
+}
 
-    // Receive UA
-    if (readFrame(fd, 0, frame) == -1) {
-        printf("ERROR - Not received UA\n");
+int ll_close(LinkConnection *link, int showStatistics) {
+    if (link == NULL) {
         return -1;
     }
-    // Verify BCC1
-    if (frame[3] != BCC1(A_T, C_UA)) {
-        return -1;
+
+    // Listening connections have no peer to disconnect from
+    if (!link->passive) {
+        // Full-duplex, the last I frame received is acknowledged first
+        if (link->ackPending) {
+            sendAcknowledgement(link);
+        }
+
+        // Transmitter, the last FEC group is acknowledged first
+        if (link->layer.role == LlTx) {
+            flushGroup(link);
+            terminateCommunicationTransmitter(link);
+        }
+        // Receiver
+        else if (link->layer.role == LlRx) {
+            terminateCommunicationReceiver(link);
+        }
     }
 
-    return 0;
-}
+    if (showStatistics) {
+        printf("\nLink layer statistics (%s):\n", link->layer.serialPort);
+        printf("  -I frames sent: %ld\n", link->stats.framesSent);
+        printf("  -Retransmissions: %ld\n", link->stats.retransmissions);
+        printf("  -Time outs: %ld\n", link->stats.timeouts);
+        printf("  -I frames received: %ld\n", link->stats.framesReceived);
+        printf("  -Duplicated frames: %ld\n", link->stats.duplicates);
+        printf("  -Rejected frames: %ld\n", link->stats.rejects);
+        printf("  -Payload bytes sent: %ld\n", link->stats.bytesSent);
+        printf("  -Payload bytes received: %ld\n", link->stats.bytesReceived);
+        printf("  -Baudrate: %d\n", speeds[link->speed].baudRate);
+        if (link->fecGroup > 0) {
+            printf("  -FEC group: %d frames\n", link->fecGroup);
+            printf("  -FEC parity frames sent: %ld\n", link->stats.paritySent);
+            printf("  -Frames rebuilt from parity: %ld\n", link->stats.rebuilt);
+        }
+        if (link->inbox != NULL) {
+            printf("  -Acknowledgements piggybacked: %ld\n", link->stats.piggybacked);
+        }
+        if (link->stats.paced > 0) {
+            printf("  -I frames paced by the transmit queue: %ld\n", link->stats.paced);
+        }
+        if (link->stats.resumes > 0) {
+            printf("  -Sessions resumed: %ld\n", link->stats.resumes);
+        }
 
-int llclose(int showStatistics) {
-    // Transmitter
-    if (layer.role == LlTx) {
-        terminateCommunicationTransmitter();
+        // Latency of each channel, once packets were sent on more than the bulk one. FEC groups and full-duplex
+        // windows are acknowledged after the write returns, so there it only lasts until the frame was sent.
+        const char *latency = link->group != NULL || link->inbox != NULL ? "time to send" : "latency";
+        long otherPackets = 0;
+        for (int i = 0; i < LL_BULK_CHANNEL; i++) {
+            otherPackets += link->stats.channelPackets[i];
+        }
+        for (int i = 0; i < LL_CHANNELS && otherPackets > 0; i++) {
+            long packets = link->stats.channelPackets[i];
+            if (packets > 0) {
+                printf("  -Channel %d: %ld packets, %s %.3f ms average (%.3f ms waiting for other channels), %.3f ms max\n",
+                       i, packets, latency, link->stats.channelLatencyUs[i] / 1000.0 / packets,
+                       link->stats.channelWaitUs[i] / 1000.0 / packets, link->stats.channelMaxLatencyUs[i] / 1000.0);
+            }
+        }
     }
-    // Receiver
-    else if (layer.role == LlRx) {
-        terminateCommunicationReceiver();
+
+    return closeConnection(link);
+}
+
+////////////////////////////////////////////////
+// EVENT-DRIVEN RECEIVER
+////////////////////////////////////////////////
+LinkConnection *ll_listen(LinkLayer connectionParameters) {
+    connectionParameters.role = LlRx;
+
+    LinkConnection *link = openConnection(connectionParameters);
+    if (link == NULL) {
+        return NULL;
     }
-    else {
-        printf("ERROR - Invalide Role\n");
-        return -1;
+
+    // Sessions are served from ll_poll, which does not switch baudrates
+    link->passive = TRUE;
+    link->session = LINK_SESSION_IDLE;
+    link->speedOffer = link->baseSpeed;
+    return link;
+}
+
+int ll_fd(const LinkConnection *link) {
+    return link->fd;
+}
+
+// Returns TRUE if the SET starts a session: not the test frame of a baudrate, nor a SET resuming the session or
+// going back to the initial baudrate.
+static int isSessionSet(const unsigned char *frame, int frameSize) {
+    if (isSpeedTest(frame, frameSize)) {
+        return FALSE;
     }
+    return !(frameParameter(frame, frameSize) & (PARAMETER_RESUME | PARAMETER_FALLBACK));
+}
 
-    // Restore old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1) {
-        printf("ERROR - Not possible to restore old port settings\n");
-        return -1;
+LinkEvent ll_poll(LinkConnection *link, unsigned char *packet, int *packetSize) {
+    unsigned char stuffedFrame[MAX_FRAME_SIZE];
+
+    // The session replaced by a new one was reported closed by the previous call
+    if (link->session == LINK_SESSION_REOPENED) {
+        link->session = LINK_SESSION_OPEN;
+        return LlEventOpen;
     }
 
-    // Close serial port
-    if (close(fd) == -1) {
-        printf("ERROR - Not possible to close Serial Port\n");
-        return -1;
+    while (TRUE) {
+        // Frames rebuilt from the parity may be waiting already
+        if (link->group != NULL && link->session == LINK_SESSION_OPEN) {
+            int size = nextGroupPacket(link, packet);
+            if (size == -1) {
+                return LlEventError;
+            }
+            if (size > 0) {
+                *packetSize = size;
+                return LlEventData;
+            }
+        }
+
+        int stuffedFrameSize = frameReaderNext(&link->reader, stuffedFrame, sizeof(stuffedFrame));
+        if (stuffedFrameSize == -1) {
+            return LlEventError;
+        }
+        if (stuffedFrameSize == 0) {
+            return LlEventNone;
+        }
+
+        unsigned char control = stuffedFrame[2];
+
+        // New session (or SET again because the UA was lost)
+        if (control == C_SET) {
+            // Once an I frame was accepted, only a new transmitter starts a session (the previous one died without
+            // DISC): the SET resets the sequences and the FEC group, and the session it replaces is closed first
+            int replaced = link->session == LINK_SESSION_OPEN && link->lastReceivedSequence != -1 && isSessionSet(stuffedFrame, stuffedFrameSize);
+
+            if (acceptSet(link, stuffedFrame, stuffedFrameSize) == -1) {
+                return LlEventError;
+            }
+            if (replaced) {
+                link->session = LINK_SESSION_REOPENED;
+                link->lastReceivedSequence = -1;
+                return LlEventClose;
+            }
+            if (link->session != LINK_SESSION_OPEN) {
+                link->session = LINK_SESSION_OPEN;
+                link->lastReceivedSequence = -1;
+                return LlEventOpen;
+            }
+        }
+        // Peer is closing the session
+        else if (control == C_DISC) {
+            if (sendSupervisionFrame(link->fd, A_R, C_DISC) == -1) {
+                return LlEventError;
+            }
+            link->session = LINK_SESSION_CLOSING;
+        }
+        // Last step of the disconnection
+        else if (control == C_UA && link->session == LINK_SESSION_CLOSING) {
+            link->session = LINK_SESSION_IDLE;
+            return LlEventClose;
+        }
+        else if ((control == C_INF0 || control == C_INF1) && stuffedFrameSize >= 6 && link->session == LINK_SESSION_OPEN && link->group != NULL) {
+            if (receiveGroupFrame(link, stuffedFrame, stuffedFrameSize) == -1) {
+                return LlEventError;
+            }
+        }
+        else if ((control == C_INF0 || control == C_INF1) && stuffedFrameSize >= 6 && link->session == LINK_SESSION_OPEN) {
+            int size = receiveInformationFrame(link, stuffedFrame, stuffedFrameSize, packet);
+            if (size > 0) {
+                *packetSize = size;
+                return LlEventData;
+            }
+        }
     }
+}
 
-    return 0;
+int llclose(int showStatistics) {
+    int result = ll_close(defaultLink, showStatistics);
+    defaultLink = NULL;
+    return result;
 }
@@ -1,80 +1,112 @@
 #include "../include/state_machine.h"
+#include "../include/trace.h"
 
-int stateMachine(unsigned char receivedByte) {
+#include <string.h>
 
-    switch (currentState) {
-        case START:
-            if (receivedByte == FLAG) {
-                currentState = FLAG_OK;
-            }
-            break;
- 
-        case FLAG_OK:
-            if (receivedByte == A_T) {
-                currentState = A_RCV;
-            }
-            else if (receivedByte == A_R) {
-                currentState = A_TX;
-            }
-            else if (receivedByte == FLAG) {
-                currentState = FLAG_OK;
-            }
-            else {
-                currentState = START;
-            }
-            break; 
+// Byte classes, so the transition table does not need one column per byte value.
+// A_T and C_SET share the value 0x03 and A_R and C_REJ0 share 0x01, so each has its own class.
+typedef enum {
+    CLASS_OTHER,
+    CLASS_FLAG,
+    CLASS_A_T,          // A_T / C_SET
+    CLASS_A_R,          // A_R / C_REJ0
+    CLASS_C_BOTH,       // Control valid in both directions (UA, DISC)
+    CLASS_C_TX,         // Control only sent by the Receiver (RR0, RR1, REJ1)
+    CLASS_C_RX,         // Control only sent by the Transmitter (INF0, INF1, with or without a piggybacked acknowledgement)
+    CLASS_COUNT
+} ByteClass;
 
-        // Address
-        case A_TX:
-            if (receivedByte == C_UA) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == C_RR0 || receivedByte == C_RR1 ||
-                     receivedByte == C_REJ0 || receivedByte == C_REJ1) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == C_DISC) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == FLAG) {
-                currentState = FLAG_OK;
-            }
-            else {
-                currentState = START;
-            }
-            break;
+static const unsigned char byteClass[256] = {
+    [FLAG] = CLASS_FLAG,
+    [A_T] = CLASS_A_T,
+    [A_R] = CLASS_A_R,
+    [C_UA] = CLASS_C_BOTH,
+    [C_DISC] = CLASS_C_BOTH,
+    [C_RR0] = CLASS_C_TX,
+    [C_RR1] = CLASS_C_TX,
+    [C_REJ1] = CLASS_C_TX,
+    [C_INF0] = CLASS_C_RX,
+    [C_INF1] = CLASS_C_RX,
+    [C_INF0 | C_NR] = CLASS_C_RX,
+    [C_INF1 | C_NR] = CLASS_C_RX,
+};
+
+static const unsigned char transitions[RECEIVE + 1][CLASS_COUNT] = {
+    //            OTHER    FLAG     A_T      A_R      C_BOTH   C_TX     C_RX
+    [START]   = { START,   FLAG_OK, START,   START,   START,   START,   START   },
+    [STOP]    = { STOP,    STOP,    STOP,    STOP,    STOP,    STOP,    STOP    },
+    [FLAG_OK] = { START,   FLAG_OK, A_RCV,   A_TX,    START,   START,   START   },
+    [A_TX]    = { START,   FLAG_OK, START,   C_RCV,   C_RCV,   C_RCV,   START   },
+    [A_RCV]   = { START,   FLAG_OK, C_RCV,   START,   C_RCV,   START,   C_RCV   },
+    [C_RCV]   = { RECEIVE, FLAG_OK, RECEIVE, RECEIVE, RECEIVE, RECEIVE, RECEIVE },
+    [RECEIVE] = { RECEIVE, STOP,    RECEIVE, RECEIVE, RECEIVE, RECEIVE, RECEIVE },
+};
 
+void stateMachineReset(StateMachine *sm) {
+    sm->state = START;
+    sm->address = 0;
+    sm->control = 0;
+    sm->bcc1Ok = FALSE;
+    sm->length = 0;
+}
+
+State stateMachineStep(StateMachine *sm, unsigned char receivedByte) {
+    // Track the header of the frame inline
+    switch (sm->state) {
+        case FLAG_OK:
+            sm->address = receivedByte;
+            break;
+        case A_TX:
         case A_RCV:
-            if (receivedByte == C_SET) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == C_UA) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == C_INF0 || receivedByte == C_INF1) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == C_DISC) {
-                currentState = RECEIVE;
-            }
-            else if (receivedByte == FLAG) {
-                currentState = FLAG_OK;
-            }
-            else {
-                currentState = START;
-            }
+            sm->control = receivedByte;
             break;
-
-        // Receive Data
-        case RECEIVE:
-            if (receivedByte == FLAG) {
-                currentState = STOP;
+        case C_RCV:
+            sm->bcc1Ok = (receivedByte == BCC1(sm->address, sm->control));
+            if (!sm->bcc1Ok) {
+                traceInstant(TRACE_BAD_HEADER, -1, sm->address, sm->control);
             }
             break;
-            
         default:
             break;
     }
-    
-    return 0;
-}
\ No newline at end of file
+
+    State previous = sm->state;
+    sm->state = transitions[sm->state][byteClass[receivedByte]];
+
+    if (sm->state == START) {
+        // A frame header was started and dropped
+        if (sm->length > 1) {
+            traceInstant(TRACE_RESYNC, -1, previous, sm->length);
+        }
+        sm->length = 0;
+    }
+    else if (sm->state == FLAG_OK) {
+        sm->length = 1;
+    }
+    else {
+        sm->length++;
+    }
+
+    return sm->state;
+}
+
+int stateMachineScan(StateMachine *sm, const unsigned char *buffer, int length) {
+    int i = 0;
+
+    while (i < length && sm->state != STOP) {
+        // Fast path: skip the data field up to the closing FLAG
+        if (sm->state == RECEIVE) {
+            const unsigned char *flag = memchr(buffer + i, FLAG, length - i);
+            if (flag == NULL) {
+                sm->length += length - i;
+                return length;
+            }
+            sm->length += (flag - buffer) - i;
+            i = flag - buffer;
+        }
+
+        stateMachineStep(sm, buffer[i++]);
+    }
+
+    return i;
+}
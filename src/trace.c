@@ -0,0 +1,337 @@
+#include "../include/trace.h"
+
+#include "../include/macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MASK (TRACE_RING_SIZE - 1)
+
+// Size of the buffer the dump is written through
+#define DUMP_BUFFER_SIZE 65536
+
+// One event of the ring. Written by any thread without locks: the sequence is cleared while the event is written,
+// so the dump skips events overwritten while it reads them.
+typedef struct {
+    atomic_ulong sequence;      // Index of the event + 1 once written, 0 while being written
+    long timestamp;             // CLOCK_MONOTONIC, in nanoseconds
+    long args[2];
+    int link;
+    int thread;
+    unsigned char event;
+    char phase;                 // Chrome trace phase: 'B' (begin), 'E' (end) or 'i' (instant)
+} TraceRecord;
+
+static TraceRecord ring[TRACE_RING_SIZE];
+static atomic_ulong head;       // Index of the next event
+static atomic_int threads;      // Threads that recorded events so far
+static _Thread_local int threadId;
+
+static volatile sig_atomic_t tracing = FALSE;
+static atomic_int dumping;
+static long startTime;          // Timestamps are dumped relative to traceStart
+static char traceFilename[256];
+
+// Name of each event and of its arguments: for durations, the argument of the begin and of the end events
+static const struct {
+    const char *name;
+    const char *args[2];
+} events[TRACE_EVENT_COUNT] = {
+    [TRACE_LLWRITE] = {"llwrite", {"size", "result"}},
+    [TRACE_LLREAD] = {"llread", {NULL, "result"}},
+    [TRACE_READ_FRAME] = {"readFrame", {NULL, "size"}},
+    [TRACE_DISK_READ] = {"disk read", {NULL, "bytes"}},
+    [TRACE_DISK_WRITE] = {"disk write", {"bytes", NULL}},
+    [TRACE_DISK_STALL] = {"disk stall", {"queued", NULL}},
+    [TRACE_FRAME_TX] = {"frame tx", {"control", "size"}},
+    [TRACE_FRAME_RX] = {"frame rx", {"control", "size"}},
+    [TRACE_STUFFING] = {"stuffing", {"payload", "frame"}},
+    [TRACE_ACK] = {"ack", {"sequence", NULL}},
+    [TRACE_REJ] = {"rej", {"sequence", NULL}},
+    [TRACE_REJECTED] = {"rejected", {"sequence", NULL}},
+    [TRACE_TIMEOUT] = {"timeout", {"sequence", NULL}},
+    [TRACE_RETRANSMIT] = {"retransmit", {"sequence", NULL}},
+    [TRACE_RESUME] = {"resume", {NULL, NULL}},
+    [TRACE_BAD_HEADER] = {"bad header", {"address", "control"}},
+    [TRACE_RESYNC] = {"resync", {"state", "dropped"}},
+};
+
+static long nowNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void record(TraceEvent event, char phase, int link, long arg1, long arg2) {
+    if (!tracing) {
+        return;
+    }
+
+    long timestamp = nowNanoseconds();
+    if (threadId == 0) {
+        threadId = atomic_fetch_add_explicit(&threads, 1, memory_order_relaxed) + 1;
+    }
+
+    // Claim a slot, then publish it once written
+    unsigned long index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TraceRecord *slot = &ring[index & TRACE_MASK];
+
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->timestamp = timestamp;
+    slot->args[0] = arg1;
+    slot->args[1] = arg2;
+    slot->link = link;
+    slot->thread = threadId;
+    slot->event = event;
+    slot->phase = phase;
+
+    atomic_store_explicit(&slot->sequence, index + 1, memory_order_release);
+}
+
+void traceBegin(TraceEvent event, int link, long arg) {
+    record(event, 'B', link, arg, 0);
+}
+
+void traceEnd(TraceEvent event, int link, long arg) {
+    record(event, 'E', link, 0, arg);
+}
+
+void traceInstant(TraceEvent event, int link, long arg1, long arg2) {
+    record(event, 'i', link, arg1, arg2);
+}
+
+////////////////////////////////////////////////
+// DUMP
+////////////////////////////////////////////////
+// The dump may run in a signal handler, so it only formats into a static buffer and uses write
+
+typedef struct {
+    int fd;
+    char buffer[DUMP_BUFFER_SIZE];
+    int used;
+    int failed;
+} DumpWriter;
+
+static DumpWriter writer;
+
+static void flushDump(DumpWriter *out) {
+    int written = 0;
+    while (written < out->used && !out->failed) {
+        ssize_t bytes = write(out->fd, out->buffer + written, out->used - written);
+        if (bytes > 0) {
+            written += bytes;
+        }
+        else if (bytes == -1 && errno != EINTR) {
+            out->failed = TRUE;
+        }
+    }
+    out->used = 0;
+}
+
+static void putString(DumpWriter *out, const char *string) {
+    while (*string != '\0') {
+        if (out->used == DUMP_BUFFER_SIZE) {
+            flushDump(out);
+        }
+        out->buffer[out->used++] = *string++;
+    }
+}
+
+// Writes number in decimal, with at least digits digits
+static void putNumber(DumpWriter *out, long number, int digits) {
+    char text[24];
+    int length = 0;
+    unsigned long value = number < 0 ? -(unsigned long)number : (unsigned long)number;
+
+    do {
+        text[sizeof(text) - 1 - length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || length < digits);
+    if (number < 0) {
+        text[sizeof(text) - 1 - length++] = '-';
+    }
+
+    char string[sizeof(text) + 1];
+    memcpy(string, &text[sizeof(text) - length], length);
+    string[length] = '\0';
+    putString(out, string);
+}
+
+static void putArgument(DumpWriter *out, const char *name, long value) {
+    putString(out, ",\"");
+    putString(out, name);
+    putString(out, "\":");
+    putNumber(out, value, 1);
+}
+
+static void putRecord(DumpWriter *out, const TraceRecord *event, long pid) {
+    long time = event->timestamp - startTime;
+
+    putString(out, ",\n{\"name\":\"");
+    putString(out, events[event->event].name);
+    putString(out, "\",\"cat\":\"link\",\"ph\":\"");
+    char phase[2] = {event->phase, '\0'};
+    putString(out, phase);
+    putString(out, "\",\"ts\":");
+    putNumber(out, time / 1000, 1);             // Microseconds
+    putString(out, ".");
+    putNumber(out, time % 1000, 3);
+    putString(out, ",\"pid\":");
+    putNumber(out, pid, 1);
+    putString(out, ",\"tid\":");
+    putNumber(out, event->thread, 1);
+    if (event->phase == 'i') {
+        putString(out, ",\"s\":\"t\"");
+    }
+
+    putString(out, ",\"args\":{\"link\":");
+    putNumber(out, event->link, 1);
+    for (int i = 0; i < 2; i++) {
+        const char *name = events[event->event].args[i];
+        int used = (event->phase == 'i') || (event->phase == 'B' ? i == 0 : i == 1);
+        if (name != NULL && used) {
+            putArgument(out, name, event->args[i]);
+        }
+    }
+    putString(out, "}}");
+}
+
+int traceDump() {
+    if (!tracing || atomic_exchange(&dumping, TRUE)) {
+        return -1;
+    }
+
+    DumpWriter *out = &writer;
+    out->fd = open(traceFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        atomic_store(&dumping, FALSE);
+        return -1;
+    }
+    out->used = 0;
+    out->failed = FALSE;
+
+    long pid = getpid();
+    unsigned long end = atomic_load_explicit(&head, memory_order_acquire);
+    unsigned long start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+    putString(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":");
+    putNumber(out, start, 1);
+    putString(out, "},\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    putNumber(out, pid, 1);
+    putString(out, ",\"args\":{\"name\":\"serial link\"}}");
+
+    for (unsigned long index = start; index < end; index++) {
+        // Copy the event, skipping it if it is being written or was overwritten meanwhile
+        TraceRecord *slot = &ring[index & TRACE_MASK];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != index + 1) {
+            continue;
+        }
+        TraceRecord event;
+        event.timestamp = slot->timestamp;
+        event.args[0] = slot->args[0];
+        event.args[1] = slot->args[1];
+        event.link = slot->link;
+        event.thread = slot->thread;
+        event.event = slot->event;
+        event.phase = slot->phase;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != index + 1 || event.event >= TRACE_EVENT_COUNT) {
+            continue;
+        }
+
+        putRecord(out, &event, pid);
+    }
+
+    putString(out, "\n]}\n");
+    flushDump(out);
+    int failed = out->failed;
+    close(out->fd);
+
+    atomic_store(&dumping, FALSE);
+    return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////
+// START
+////////////////////////////////////////////////
+static void dumpAtExit() {
+    traceDump();
+}
+
+static void dumpHandler(int signal) {
+    int savedErrno = errno;
+    traceDump();
+    errno = savedErrno;
+}
+
+// SIGINT / SIGTERM: dumps, then dies of the signal as it would have without tracing
+static void dumpAndExitHandler(int signal) {
+    traceDump();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+    raise(signal);
+}
+
+int traceStart(const char *filename) {
+    if (tracing || strlen(filename) >= sizeof(traceFilename)) {
+        return -1;
+    }
+    strcpy(traceFilename, filename);
+    startTime = nowNanoseconds();
+    tracing = TRUE;
+
+    if (atexit(dumpAtExit) != 0) {
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = dumpHandler;
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        return -1;
+    }
+
+    // Signals the program handles itself end in a normal exit, dumped by atexit
+    int signals[] = {SIGINT, SIGTERM};
+    action.sa_handler = dumpAndExitHandler;
+    for (int i = 0; i < 2; i++) {
+        struct sigaction current;
+        if (sigaction(signals[i], NULL, &current) == 0 && current.sa_handler == SIG_DFL) {
+            sigaction(signals[i], &action, NULL);
+        }
+    }
+
+    return 0;
+}
+
+int traceFork() {
+    if (!tracing) {
+        return 0;
+    }
+
+    char filename[sizeof(traceFilename)];
+    int length = snprintf(filename, sizeof(filename), "%s.%ld", traceFilename, (long)getpid());
+    if (length < 0 || length >= (int)sizeof(filename)) {
+        tracing = FALSE;
+        return -1;
+    }
+    strcpy(traceFilename, filename);
+
+    // The events recorded before the fork are in the parent's dump. Timestamps keep the parent's start,
+    // so the dumps line up when opened together.
+    atomic_store(&head, 0);
+    return 0;
+}
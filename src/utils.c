@@ -2,15 +2,15 @@
 
 #include "../include/macros.h"
 #include "../include/state_machine.h"
-#include "../include/alarm.h"
+#include "../include/trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <signal.h>
-
-State currentState = START;
-int alarmEnabled = TRUE;
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
 
 unsigned char BCC2(const unsigned char *buffer, int length) {
     unsigned char bcc = 0x00;
@@ -32,56 +32,156 @@ int sendSupervisionFrame(int fd, unsigned char a, unsigned char c) {
     frame[4] = FLAG;
 
     // Send Frame
-    ssize_t bytes = write(fd, frame, sizeof(frame));
-    if (bytes == -1) {
-        perror("Error writing to serial port");
-        return -1;
-    } 
-    else if (bytes != sizeof(frame)) {
-        perror("Partial write to serial port");
-        return -1;
+    return writeFrame(fd, frame, sizeof(frame));
+}
+
+int writeFrame(int fd, const unsigned char *frame, int frameSize) {
+    int written = 0;
+    traceInstant(TRACE_FRAME_TX, fd, frame[2], frameSize);
+
+    while (written < frameSize) {
+        ssize_t bytes = write(fd, frame + written, frameSize - written);
+        if (bytes > 0) {
+            written += bytes;
+            continue;
+        }
+        if (bytes == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("Error writing to serial port");
+            return -1;
+        }
+
+        // The transmit queue is full, wait until the kernel takes more
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        int ready = poll(&pfd, 1, -1);
+        if (ready == -1 && errno != EINTR) {
+            perror("Error waiting for serial port");
+            return -1;
+        }
+        if (ready > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+            printf("Error - Serial port closed while writing\n");
+            return -1;
+        }
     }
 
     return 0;
 }
 
-int readFrame(int fd, unsigned int timeout, unsigned char* data) {
-    // Ser alarm Handler
-    (void)signal(SIGALRM, alarmHandler);
+void frameReaderInit(FrameReader *reader, int fd) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    stateMachineReset(&reader->sm);
+    reader->frameSize = 0;
+}
 
-    // Turn on Alarm
-    if (timeout != 0) {
-        alarmEnabled = TRUE;
-        alarm(timeout);
-    }
+int frameReaderNext(FrameReader *reader, unsigned char* data, int maxSize) {
+    while (TRUE) {
+        // Read Bytes
+        if (reader->start == reader->end) {
+            ssize_t bytesRead = read(reader->fd, reader->buffer, RX_BUFFER_SIZE);
 
-    currentState = START;
-    int dataIndex = 0;
+            if (bytesRead == -1) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    return 0;
+                }
+                perror("Error reading from serial port");
+                return -1;
+            }
+            else if (bytesRead == 0) {
+                return 0;
+            }
+            reader->start = 0;
+            reader->end = bytesRead;
+        }
 
-    // Read Frame while alarm is enabled or Infinite Loop, until STOP state
-    while (alarmEnabled) {
-        // Read Byte
-        unsigned char receivedByte;
-        ssize_t bytesRead = read(fd, &receivedByte, 1);
+        // Update State Machine over everything available
+        const unsigned char *bytes = reader->buffer + reader->start;
+        int consumed = stateMachineScan(&reader->sm, bytes, reader->end - reader->start);
+        reader->start += consumed;
 
-        if (bytesRead == -1) {
-            perror("Error reading from serial port");
-            return -1;
-        }
-        else if (bytesRead == 0) {
+        // Keep only the bytes of the current frame (anything received before its start is dropped)
+        int length = reader->sm.length;
+        if (length > MAX_FRAME_SIZE) {
+            traceInstant(TRACE_RESYNC, reader->fd, reader->sm.state, length);
+            stateMachineReset(&reader->sm); // Too big to be a frame of ours
+            reader->frameSize = 0;
             continue;
         }
+        if (length <= consumed) {
+            memcpy(reader->frame, bytes + consumed - length, length);
+        }
         else {
-            data[dataIndex++] = receivedByte; // Save Byte
-            stateMachine(receivedByte);       // Update State Machine
+            memcpy(reader->frame + reader->frameSize, bytes, consumed);
+        }
+        reader->frameSize = length;
 
-            if (currentState == STOP) {
-                return dataIndex;
+        if (reader->sm.state == STOP) {
+            int frameSize = reader->frameSize;
+            stateMachineReset(&reader->sm);
+            reader->frameSize = 0;
+
+            if (frameSize <= maxSize) {
+                traceInstant(TRACE_FRAME_RX, reader->fd, reader->frame[2], frameSize);
+                memcpy(data, reader->frame, frameSize);
+                return frameSize;
             }
         }
     }
+}
 
-    return -1;
+// Milliseconds left until deadline, never negative
+static int remainingMs(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Reads a frame like readFrameUntil, without tracing the wait
+static int waitFrame(FrameReader *reader, const struct timespec *deadline, unsigned char* data, int maxSize) {
+    // Read Frame until the deadline or forever
+    while (TRUE) {
+        int frameSize = frameReaderNext(reader, data, maxSize);
+        if (frameSize != 0) {
+            return frameSize;
+        }
+
+        // Wait for more bytes
+        struct pollfd pfd = {.fd = reader->fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, deadline != NULL ? remainingMs(deadline) : -1);
+
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for serial port");
+            return -1;
+        }
+        if (ready == 0) {
+            return -1; // Time Out
+        }
+    }
+}
+
+int readFrameUntil(FrameReader *reader, const struct timespec *deadline, unsigned char* data, int maxSize) {
+    traceBegin(TRACE_READ_FRAME, reader->fd, 0);
+    int frameSize = waitFrame(reader, deadline, data, maxSize);
+    traceEnd(TRACE_READ_FRAME, reader->fd, frameSize);
+
+    return frameSize;
+}
+
+int readFrameFrom(FrameReader *reader, unsigned int timeout, unsigned char* data, int maxSize) {
+    if (timeout == 0) {
+        return readFrameUntil(reader, NULL, data, maxSize);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+
+    return readFrameUntil(reader, &deadline, data, maxSize);
 }
 
 int stuffData(const unsigned char* data, int dataSize, unsigned char* stuffedData) {
@@ -116,4 +216,43 @@ int destuffData(const unsigned char* stuffedData, int stuffedDataSize, unsigned
     }
 
     return destuffedDataSize;
-}
\ No newline at end of file
+}
+
+int encodeFrameV(unsigned char a, unsigned char c, const struct iovec *iov, int iovcnt, unsigned char* frame) {
+    int frameSize = 0;
+
+    frame[frameSize++] = FLAG;                                   // Start Flag
+    frame[frameSize++] = a;                                      // Address
+    frame[frameSize++] = c;                                      // Control
+    frame[frameSize++] = BCC1(a, c);                             // BCC1
+
+    // Stuffed data, BCC2 computed in the same pass
+    unsigned char bcc2 = 0x00;
+    long dataSize = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const unsigned char *data = iov[i].iov_base;
+        dataSize += iov[i].iov_len;
+        for (size_t j = 0; j < iov[i].iov_len; j++) {
+            bcc2 ^= data[j];
+            if (data[j] == FLAG || data[j] == ESCAPE) {
+                frame[frameSize++] = ESCAPE;
+                frame[frameSize++] = data[j] ^ 0x20;
+            }
+            else {
+                frame[frameSize++] = data[j];
+            }
+        }
+    }
+
+    frameSize += stuffData(&bcc2, 1, frame + frameSize);         // Stuffed BCC2
+
+    frame[frameSize++] = FLAG;                                   // End Flag
+
+    traceInstant(TRACE_STUFFING, -1, dataSize, frameSize);
+    return frameSize;
+}
+
+int encodeFrame(unsigned char a, unsigned char c, const unsigned char* data, int dataSize, unsigned char* frame) {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = dataSize};
+    return encodeFrameV(a, c, &iov, 1, frame);
+}